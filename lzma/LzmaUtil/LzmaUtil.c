@@ -9,36 +9,36 @@
 #include <assert.h>
 
 #include "LzmaUtil.h"
+#include "bsmem.h"
+#include "bstrace.h"
 
 
 
-static const ISzAlloc g_bsAlloc = { bsAlloc, bsFree };
-
+/* untagged, see bsmem_isz() for the allocators LzmaUtil hands out */
 void *bsAlloc(ISzAllocPtr p, size_t size)
 {
     UNUSED_VAR(p);
-    return malloc(size);
+    return bsmem_alloc(BSMEM_OTHER, size);
 }
 
 void bsFree(ISzAllocPtr p, void *address)
 {
     UNUSED_VAR(p);
-    free(address);
+    bsmem_free(address);
 }
 
 
-#if defined(BSPATCH_EXECUTABLE)
-
-static CLzmaDec lzmadec;
-static decode_t dec;
+#if defined(LZMAUTIL_DECODER)
 
-SRes decodeInit(uint8_t *header, size_t size, uint32_t patchsize)
+SRes decodeInit(decode_t *dec, uint8_t *header, size_t size, uint32_t patchsize,
+    size_t inBufSize, size_t outBufSize)
 {
     int i;
-    decode_t *decinf = &dec;
-    CLzmaDec *state = &lzmadec;
+    decode_t *decinf = dec;
+    CLzmaDec *state = &dec->state;
 
     memset(decinf, 0, sizeof(decode_t));
+    LzmaDec_CONSTRUCT(state);
 
     if(size < HEADER_SIZE)
         return SZ_ERROR_DATA;
@@ -47,65 +47,214 @@ SRes decodeInit(uint8_t *header, size_t size, uint32_t patchsize)
         decinf->unpackSize += (UInt64)header[LZMA_PROPS_SIZE + i] << (i * 8);
 
     decinf->patchsize = patchsize;
-    
-    printf("unpackSize %d patchsize %d\n", decinf->unpackSize, decinf->patchsize);
+    decinf->inBufSize = inBufSize ? inBufSize : IN_BUF_SIZE;
+    decinf->outBufSize = outBufSize ? outBufSize : OUT_BUF_SIZE;
 
-    LzmaDec_CONSTRUCT(state);
-    RINOK(LzmaDec_Allocate(state, header, LZMA_PROPS_SIZE, &g_bsAlloc));
+#if defined(BSPATCH_STATIC)
+    {
+        CLzmaProps props;
+        size_t dicSize;
+
+        RINOK(LzmaProps_Decode(&props, header, LZMA_PROPS_SIZE));
+
+        /* nothing is ever further back than the start of the payload */
+        dicSize = props.dicSize < decinf->unpackSize ? props.dicSize : decinf->unpackSize;
+        if(dicSize == 0)
+            dicSize = 1;
+
+        if(props.lc + props.lp > BSPATCH_STATIC_LCLP || dicSize > BSPATCH_STATIC_DIC_SIZE)
+            return SZ_ERROR_UNSUPPORTED;
+
+        if(decinf->inBufSize > IN_BUF_SIZE)
+            decinf->inBufSize = IN_BUF_SIZE;
+
+        state->prop = props;
+        state->probs = decinf->probs;
+        state->probs_1664 = decinf->probs + 1664;
+        state->numProbs = LZMA_NUM_PROBS(props.lc + props.lp);
+        state->dic = decinf->dic;
+        state->dicBufSize = dicSize;
+        decinf->inBuf = decinf->in;
+    }
 
     LzmaDec_Init(state);
+#else
+    RINOK(LzmaDec_Allocate(state, header, LZMA_PROPS_SIZE, bsmem_isz(BSMEM_DICTIONARY)));
 
-    if(decinf->inBuf == NULL)
-        decinf->inBuf = (Byte *)ISzAlloc_Alloc(&g_bsAlloc, IN_BUF_SIZE);
+    LzmaDec_Init(state);
+
+    decinf->inBuf = (Byte *)ISzAlloc_Alloc(bsmem_isz(BSMEM_PATCH_IN), decinf->inBufSize);
 
-    if(decinf->outBuf == NULL)
+    if(decinf->inBuf == NULL)
     {
-        decinf->outBuf = ringbuffer_init(OUT_BUF_SIZE * 2);
-        assert(decinf->outBuf != NULL);
+        decodeUninit(decinf);
+        return SZ_ERROR_MEM;
     }
+#endif
 
     return SZ_OK;
 }
 
-void decodeUninit(void)
+void decodeUninit(decode_t *dec)
 {
-    decode_t *decinf = &dec;
-    CLzmaDec *state = &lzmadec;
+#if defined(BSPATCH_STATIC)
+    /* all of it is part of decode_t */
+    dec->inBuf = NULL;
+#else
+    decode_t *decinf = dec;
+    CLzmaDec *state = &dec->state;
 
-    LzmaDec_Free(state, &g_bsAlloc);
+    LzmaDec_Free(state, bsmem_isz(BSMEM_DICTIONARY));
 
     if(decinf->inBuf)
     {
-        ISzAlloc_Free(&g_bsAlloc, decinf->inBuf);
+        ISzAlloc_Free(bsmem_isz(BSMEM_PATCH_IN), decinf->inBuf);
         decinf->inBuf = NULL;
     }
-    
-    if(decinf->outBuf)
-        ringbuffer_free(decinf->outBuf);
+#endif
 }
 
-int decodeGetData(struct bspatch_stream* stream, void* buffer, int length)
+/* fixed part of a saved decoder, followed by probs and dictionary */
+typedef struct
+{
+    CLzmaDec state;     /* pointers are not restored */
+    size_t outPos;
+    size_t outEnd;
+    uint32_t unpackSize;
+    uint32_t patchsize; /* including input read but not decoded */
+    size_t dicUsed;
+} decode_saved_t;
+
+size_t decodeSave(const decode_t *dec, uint8_t *buf)
+{
+    const CLzmaDec *state = &dec->state;
+    decode_saved_t saved;
+    size_t probsSize = state->numProbs * sizeof(CLzmaProb);
+
+    /* until the first wrap only the start of the dictionary is in use */
+    saved.dicUsed = state->processedPos >= state->dicBufSize ? state->dicBufSize : state->dicPos;
+
+    if(buf == NULL)
+        return sizeof(saved) + probsSize + saved.dicUsed;
+
+    saved.state = *state;
+    saved.outPos = dec->outPos;
+    saved.outEnd = dec->outEnd;
+    saved.unpackSize = dec->unpackSize;
+    saved.patchsize = dec->patchsize + (uint32_t)(dec->inSize - dec->inPos);
+
+    memcpy(buf, &saved, sizeof(saved));
+    memcpy(buf + sizeof(saved), state->probs, probsSize);
+    memcpy(buf + sizeof(saved) + probsSize, state->dic, saved.dicUsed);
+
+    return sizeof(saved) + probsSize + saved.dicUsed;
+}
+
+int decodeRestore(decode_t *dec, const uint8_t *buf, size_t size)
+{
+    CLzmaDec *state = &dec->state;
+    decode_saved_t saved;
+    size_t probsSize = state->numProbs * sizeof(CLzmaProb);
+
+    if(size < sizeof(saved))
+        return SZ_ERROR_DATA;
+
+    memcpy(&saved, buf, sizeof(saved));
+
+    /* the decoder must have been set up for the same stream */
+    if(saved.state.numProbs != state->numProbs || saved.state.dicBufSize != state->dicBufSize ||
+            saved.dicUsed > state->dicBufSize || saved.outEnd > state->dicBufSize ||
+            saved.outPos > saved.outEnd || size != sizeof(saved) + probsSize + saved.dicUsed)
+        return SZ_ERROR_DATA;
+
+    saved.state.probs = state->probs;
+    saved.state.probs_1664 = state->probs_1664;
+    saved.state.dic = state->dic;
+    *state = saved.state;
+
+    memcpy(state->probs, buf + sizeof(saved), probsSize);
+    memcpy(state->dic, buf + sizeof(saved) + probsSize, saved.dicUsed);
+
+    dec->outPos = saved.outPos;
+    dec->outEnd = saved.outEnd;
+    dec->unpackSize = saved.unpackSize;
+    dec->patchsize = saved.patchsize;
+    dec->inPos = dec->inSize = 0;
+
+    return SZ_OK;
+}
+
+size_t decodeFootprint(const uint8_t *header, size_t inBufSize, size_t *dicSize, unsigned *lclp)
 {
-    size_t residue;
-    size_t copied;
+    CLzmaProps props;
+    uint64_t unpackSize = 0;
+    size_t dic;
+    int i;
+
+    if(LzmaProps_Decode(&props, header, LZMA_PROPS_SIZE) != SZ_OK)
+        return 0;
+
+    for(i = 0; i < HEADER_SIZE - LZMA_PROPS_SIZE; i++)
+        unpackSize += (uint64_t)header[LZMA_PROPS_SIZE + i] << (i * 8);
+
+    /* same rule as decodeInit */
+    dic = props.dicSize < unpackSize ? props.dicSize : (size_t)unpackSize;
+    if(dic == 0)
+        dic = 1;
 
-    residue = ringbuffer_size(dec.outBuf);
+    if(dicSize)
+        *dicSize = dic;
+    if(lclp)
+        *lclp = props.lc + props.lp;
 
-    while(residue < (size_t)length && dec.unpackSize > 0)
+    return LZMA_NUM_PROBS(props.lc + props.lp) * sizeof(CLzmaProb) + dic +
+           (inBufSize ? inBufSize : IN_BUF_SIZE);
+}
+
+uint32_t decodeRemaining(const decode_t *dec)
+{
+    return dec->patchsize + (uint32_t)(dec->inSize - dec->inPos);
+}
+
+int decodeBorrow(struct bspatch_stream* stream, const void** buffer, int length)
+{
+    decode_t *dec = stream->opaque_dec;
+    size_t n;
+
+    while(dec->outPos == dec->outEnd)
     {
+        if(dec->unpackSize == 0)
+            return 0;
+
         if(SZ_OK != decodeRead(stream))
-            break;
-        
-        residue = ringbuffer_size(dec.outBuf);
+            return -1;
     }
-    
-    if(residue < (size_t)length)
+
+    n = dec->outEnd - dec->outPos;
+    if(n > (size_t)length)
+        n = length;
+
+    *buffer = dec->state.dic + dec->outPos;
+    dec->outPos += n;
+
+    return (int)n;
+}
+
+int decodeGetData(struct bspatch_stream* stream, void* buffer, int length)
+{
+    const void *p;
+    int copied = 0;
+    int n;
+
+    while(copied < length)
     {
-        length = residue;
-    }
+        n = decodeBorrow(stream, &p, length - copied);
+        if(n <= 0)
+            break;
 
-    copied = ringbuffer_pop(dec.outBuf, (uint8_t *)buffer, (size_t)length);
-    assert(copied == (size_t)length);
+        memcpy((uint8_t *)buffer + copied, p, n);
+        copied += n;
+    }
 
     return copied;
 }
@@ -113,21 +262,32 @@ int decodeGetData(struct bspatch_stream* stream, void* buffer, int length)
 int32_t decodeRead(struct bspatch_stream* stream)
 {
     int32_t res;
-    decode_t *decinf = &dec;
+    decode_t *decinf = stream->opaque_dec;
+    CLzmaDec *state = &decinf->state;
     SizeT inProcessed;
-    SizeT outProcessed = OUT_BUF_SIZE;
+    SizeT outProcessed = decinf->outBufSize;
     ELzmaFinishMode finishMode = LZMA_FINISH_ANY;
     ELzmaStatus status;
 
+    /* Everything handed out has been consumed, so the dictionary may
+       wrap and overwrite it; new output never runs past its end */
+    if(state->dicPos == state->dicBufSize)
+        state->dicPos = 0;
+
+    decinf->outPos = decinf->outEnd = state->dicPos;
+
+    if(outProcessed > state->dicBufSize - state->dicPos)
+        outProcessed = state->dicBufSize - state->dicPos;
+
     if(decinf->inPos == decinf->inSize && decinf->patchsize > 0)
     {
-        if(decinf->patchsize >= IN_BUF_SIZE)
-            decinf->inSize = IN_BUF_SIZE;
+        if(decinf->patchsize >= decinf->inBufSize)
+            decinf->inSize = decinf->inBufSize;
         else
             decinf->inSize = decinf->patchsize;
         
         if(stream->rpatch(stream, decinf->inBuf, decinf->inSize))
-            errx(1, "patch file read failed");
+            return SZ_ERROR_READ;
 
         decinf->inPos = 0;
         decinf->patchsize -= decinf->inSize;
@@ -135,102 +295,296 @@ int32_t decodeRead(struct bspatch_stream* stream)
 
     inProcessed = decinf->inSize - decinf->inPos;
 
-    if(outProcessed > decinf->unpackSize)
+    if(outProcessed >= decinf->unpackSize)
     {
         outProcessed = (SizeT)decinf->unpackSize;
         finishMode = LZMA_FINISH_END;
     }
 
-    res = LzmaDecToBuf(&lzmadec, (void *)decinf->outBuf, &outProcessed,
+    TRACE_BEGIN("lzma_decode");
+    res = LzmaDec_DecodeToDic(state, state->dicPos + outProcessed,
                               decinf->inBuf + decinf->inPos, &inProcessed, finishMode, &status);
+    TRACE_END("lzma_decode");
+    outProcessed = state->dicPos - decinf->outPos;
+
     decinf->inPos += inProcessed;
+    decinf->outEnd = state->dicPos;
     decinf->unpackSize -= outProcessed;
 
     if(res != SZ_OK || decinf->unpackSize == 0)
         return res;
 
+    /* no progress on either side: truncated or corrupt input */
     if(inProcessed == 0 && outProcessed == 0)
+        return SZ_ERROR_DATA;
+
+    return res;
+}
+
+int lzma_block_size(const uint8_t *block, size_t size, uint64_t *unpackSize)
+{
+    int i;
+
+    if(size < HEADER_SIZE)
+        return -1;
+
+    *unpackSize = 0;
+    for(i = 0; i < 8; i++)
+        *unpackSize |= (uint64_t)block[LZMA_PROPS_SIZE + i] << (8 * i);
+
+    return 0;
+}
+
+int lzma_block_decode(const uint8_t *block, size_t size, uint8_t *out, size_t outSize)
+{
+    ELzmaStatus status;
+    uint64_t unpackSize;
+    SizeT outLen = outSize, inLen;
+
+    if(lzma_block_size(block, size, &unpackSize) || unpackSize != outSize)
+        return -1;
+
+    inLen = size - HEADER_SIZE;
+
+    if(LzmaDecode(out, &outLen, block + HEADER_SIZE, &inLen, block, LZMA_PROPS_SIZE,
+                  LZMA_FINISH_END, &status, bsmem_isz(BSMEM_DICTIONARY)) != SZ_OK || outLen != outSize)
+        return -1;
+
+    return 0;
+}
+
+#endif /* LZMAUTIL_DECODER */
+
+
+#if defined(LZMAUTIL_ENCODER)
+
+#ifndef _WIN32
+#include <time.h>
+#endif
+#include "../Threads.h"
+
+static const char *const kCantReadMessage = "Cannot read input file";
+static const char *const kCantWriteMessage = "Cannot write output file";
+static const char *const kCantAllocateMessage = "Cannot allocate memory";
+static const char *const kDataErrorMessage = "Data error";
+static const char *const kCancelledMessage = "Cancelled";
+
+/* lc/lp/pb/fb candidates, default first so it always gets a trial */
+static const uint16_t g_tuneSets[][4] =
+{
+    { 3, 0, 2, 32 },
+    { 3, 0, 2, 64 },
+    { 0, 2, 2, 64 },
+    { 1, 2, 2, 64 },
+    { 0, 0, 0, 64 },
+    { 4, 0, 0, 64 },
+    { 3, 0, 0, 128 },
+    { 0, 2, 2, 273 },
+    { 2, 0, 2, 273 },
+};
+
+#define TUNE_SETS (sizeof(g_tuneSets) / sizeof(g_tuneSets[0]))
+
+typedef struct
+{
+    const uint8_t *sample;
+    size_t sampleSize;
+    UInt64 deadline;
+    LONG volatile next;
+    SizeT packed[TUNE_SETS];
+} autotune_t;
+
+typedef struct
+{
+    ICompressProgress vt;
+    UInt64 deadline;
+} deadline_t;
+
+static UInt64 GetTimeMs(void)
+{
+#ifdef _WIN32
+    return GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (UInt64)ts.tv_sec * 1000 + (UInt64)ts.tv_nsec / 1000000;
+#endif
+}
+
+/* stops a trial between encoder blocks once the budget is spent */
+static SRes DeadlineProgress(ICompressProgressPtr pp, UInt64 inSize, UInt64 outSize)
+{
+    deadline_t *p = Z7_CONTAINER_FROM_VTBL(pp, deadline_t, vt);
+
+    (void)inSize;
+    (void)outSize;
+
+    return GetTimeMs() >= p->deadline ? SZ_ERROR_PROGRESS : SZ_OK;
+}
+
+static THREAD_FUNC_DECL AutotuneThread(void *param)
+{
+    autotune_t *t = (autotune_t *)param;
+    uint8_t *dest;
+    SizeT destCap = t->sampleSize + t->sampleSize / 3 + 128;
+    deadline_t deadline;
+
+    deadline.vt.Progress = DeadlineProgress;
+    deadline.deadline = t->deadline;
+
+    dest = (uint8_t *)ISzAlloc_Alloc(bsmem_isz(BSMEM_ENCODER), destCap);
+    if(dest == NULL)
+        return THREAD_FUNC_RET_ZERO;
+
+    for(;;)
     {
-        if(status != LZMA_STATUS_FINISHED_WITH_MARK)
-            return SZ_ERROR_DATA;
+        LONG i = InterlockedIncrement(&t->next) - 1;
+        CLzmaEncProps props;
+        uint8_t propsEncoded[LZMA_PROPS_SIZE];
+        SizeT propsSize = LZMA_PROPS_SIZE;
+        SizeT destLen = destCap;
+
+        if((size_t)i >= TUNE_SETS || GetTimeMs() >= t->deadline)
+            break;
+
+        LzmaEncProps_Init(&props);
+        props.lc = g_tuneSets[i][0];
+        props.lp = g_tuneSets[i][1];
+        props.pb = g_tuneSets[i][2];
+        props.fb = g_tuneSets[i][3];
+        props.reduceSize = t->sampleSize;
+        props.numThreads = 1;
+
+        TRACE_BEGIN("autotune_trial");
+        if(LzmaEncode(dest, &destLen, t->sample, t->sampleSize, &props,
+                      propsEncoded, &propsSize, 0, &deadline.vt, bsmem_isz(BSMEM_ENCODER),
+                      bsmem_isz(BSMEM_MATCH_FINDER)) == SZ_OK)
+            t->packed[i] = destLen;
+        TRACE_END("autotune_trial");
     }
 
-    return res;
+    ISzAlloc_Free(bsmem_isz(BSMEM_ENCODER), dest);
+    return THREAD_FUNC_RET_ZERO;
 }
 
-int32_t LzmaDecToBuf(CLzmaDec *p, uint8_t *dest, SizeT *destLen, 
-    const uint8_t *src, SizeT *srcLen, 
-    ELzmaFinishMode finishMode, ELzmaStatus *status)
+int lzma_autotune(const uint8_t *data, size_t size, uint32_t budgetMs, CLzmaEncProps *props,
+                  autotune_result_t *result)
 {
-  SizeT outSize = *destLen;
-  SizeT inSize = *srcLen;
-  
-  *srcLen = *destLen = 0;
-  
-  for (;;)
-  {
-    SizeT inSizeCur = inSize, outSizeCur, dicPos;
-    ELzmaFinishMode curFinishMode;
-    int32_t res;
-    
-    if (p->dicPos == p->dicBufSize)
-      p->dicPos = 0;
-    dicPos = p->dicPos;
-    if (outSize > p->dicBufSize - dicPos)
+    autotune_t t;
+    CThread threads[AUTOTUNE_THREADS];
+    uint8_t *sample = NULL;
+    size_t i, best;
+    int n;
+
+    LzmaEncProps_Init(props);
+    props->reduceSize = size;
+    memset(result, 0, sizeof(*result));
+
+    if(size == 0)
+        return SZ_OK;
+
+    memset(&t, 0, sizeof(t));
+
+    /* small payloads are tried whole, large ones by evenly spaced slices */
+    if(size <= AUTOTUNE_SAMPLE_SIZE * AUTOTUNE_SAMPLES)
     {
-      outSizeCur = p->dicBufSize;
-      curFinishMode = LZMA_FINISH_ANY;
+        t.sample = data;
+        t.sampleSize = size;
     }
     else
     {
-      outSizeCur = dicPos + outSize;
-      curFinishMode = finishMode;
+        size_t step = size / AUTOTUNE_SAMPLES;
+
+        sample = (uint8_t *)ISzAlloc_Alloc(bsmem_isz(BSMEM_ENCODER), AUTOTUNE_SAMPLE_SIZE * AUTOTUNE_SAMPLES);
+        if(sample == NULL)
+            return SZ_ERROR_MEM;
+
+        for(i = 0; i < AUTOTUNE_SAMPLES; i++)
+            memcpy(sample + i * AUTOTUNE_SAMPLE_SIZE, data + i * step, AUTOTUNE_SAMPLE_SIZE);
+
+        t.sample = sample;
+        t.sampleSize = AUTOTUNE_SAMPLE_SIZE * AUTOTUNE_SAMPLES;
+    }
+
+    t.deadline = GetTimeMs() + (budgetMs ? budgetMs : AUTOTUNE_BUDGET_MS);
+
+    for(n = 0; n < AUTOTUNE_THREADS; n++)
+    {
+        Thread_CONSTRUCT(&threads[n])
+        if(Thread_Create(&threads[n], AutotuneThread, &t) != 0)
+            break;
     }
 
-    res = LzmaDec_DecodeToDic(p, outSizeCur, src, &inSizeCur, curFinishMode, status);
-    src += inSizeCur;
-    inSize -= inSizeCur;
-    *srcLen += inSizeCur;
-    outSizeCur = p->dicPos - dicPos;
-    
-    if(ringbuffer_available((ringbuffer_t *)dest) >= outSizeCur)
+    if(n == 0)
+        AutotuneThread(&t);
+
+    while(n > 0)
+        Thread_Wait_Close(&threads[--n]);
+
+    if(sample)
+        ISzAlloc_Free(bsmem_isz(BSMEM_ENCODER), sample);
+
+    /* without the default to compare against, keep the default */
+    best = 0;
+    for(i = 0; i < TUNE_SETS; i++)
     {
-        assert(outSizeCur == ringbuffer_insert((ringbuffer_t *)dest, p->dic + dicPos, outSizeCur));
+        if(t.packed[i] == 0)
+            continue;
+
+        result->trials++;
+        if(t.packed[0] != 0 && t.packed[i] < t.packed[best])
+            best = i;
     }
 
-    outSize -= outSizeCur;
-    *destLen += outSizeCur;
-    
-    if (res != 0)
-      return res;
-    
-    if (outSizeCur == 0 || outSize == 0)
-      return SZ_OK;
-  }
+    props->lc = g_tuneSets[best][0];
+    props->lp = g_tuneSets[best][1];
+    props->pb = g_tuneSets[best][2];
+    props->fb = g_tuneSets[best][3];
+
+    result->defaultSize = t.packed[0];
+    result->bestSize = t.packed[best];
+
+    return SZ_OK;
 }
 
-#endif /* BSPATCH_EXECUTABLE */
+typedef struct
+{
+    ICompressProgress vt;
+    struct bsdiff_stream *stream;
+    UInt64 total;
+} progress_t;
 
+static SRes EncodeProgress(ICompressProgressPtr pp, UInt64 inSize, UInt64 outSize)
+{
+    progress_t *p = Z7_CONTAINER_FROM_VTBL(pp, progress_t, vt);
 
-#if defined(BSDIFF_EXECUTABLE)
+    if(p->stream->progress(p->stream, BSDIFF_PHASE_LZMA, inSize, p->total, outSize))
+        return SZ_ERROR_PROGRESS;
 
-static const char *const kCantReadMessage = "Cannot read input file";
-static const char *const kCantWriteMessage = "Cannot write output file";
-static const char *const kCantAllocateMessage = "Cannot allocate memory";
-static const char *const kDataErrorMessage = "Data error";
+    return SZ_OK;
+}
 
-static int32_t Encode(ISeqOutStreamPtr outStream, ISeqInStreamPtr inStream, UInt64 fileSize)
+static int32_t Encode(ISeqOutStreamPtr outStream, ISeqInStreamPtr inStream, UInt64 fileSize,
+                      const CLzmaEncProps *tuned, struct bsdiff_stream *stream)
 {
+    progress_t progress;
+
     CLzmaEncHandle enc;
     int32_t res;
     CLzmaEncProps props;
 
-    enc = LzmaEnc_Create(&g_bsAlloc);
+    enc = LzmaEnc_Create(bsmem_isz(BSMEM_ENCODER));
 
     if(enc == 0)
         return SZ_ERROR_MEM;
 
-    LzmaEncProps_Init(&props);
+    if(tuned)
+        props = *tuned;
+    else
+        LzmaEncProps_Init(&props);
+
+    /* size the dictionary to the payload, the decoder allocates what we write here */
+    props.reduceSize = fileSize;
     res = LzmaEnc_SetProps(enc, &props);
 
     if(res == SZ_OK)
@@ -248,16 +602,43 @@ static int32_t Encode(ISeqOutStreamPtr outStream, ISeqInStreamPtr inStream, UInt
             res = SZ_ERROR_WRITE;
         else
         {
+            progress.vt.Progress = EncodeProgress;
+            progress.stream = stream;
+            progress.total = fileSize;
+
             if(res == SZ_OK)
-                res = LzmaEnc_Encode(enc, outStream, inStream, NULL, &g_bsAlloc, &g_bsAlloc);
+                res = LzmaEnc_Encode(enc, outStream, inStream,
+                                     (stream && stream->progress) ? &progress.vt : NULL,
+                                     bsmem_isz(BSMEM_ENCODER), bsmem_isz(BSMEM_MATCH_FINDER));
         }
     }
 
-    LzmaEnc_Destroy(enc, &g_bsAlloc, &g_bsAlloc);
+    LzmaEnc_Destroy(enc, bsmem_isz(BSMEM_ENCODER), bsmem_isz(BSMEM_MATCH_FINDER));
     return res;
 }
 
-int lzma_encode(const char *out, const char *in)
+size_t lzma_encode_mem_estimate(const CLzmaEncProps *props, uint64_t size)
+{
+    CLzmaEncProps p;
+    uint64_t dic;
+
+    if(props)
+        p = *props;
+    else
+        LzmaEncProps_Init(&p);
+
+    p.reduceSize = size;
+    LzmaEncProps_Normalize(&p);
+
+    /* bt4 keeps 9.5 bytes per dictionary byte plus the window, hc4 5.5 */
+    dic = p.dictSize;
+    dic = p.btMode ? dic * 23 / 2 : dic * 15 / 2;
+
+    return (size_t)(dic + (6 << 20));
+}
+
+int lzma_encode(const char *out, const char *in, const CLzmaEncProps *props,
+                struct bsdiff_stream *stream)
 {
     CFileSeqInStream inStream;
     CFileOutStream outStream;
@@ -288,7 +669,7 @@ int lzma_encode(const char *out, const char *in)
     if(wres != 0)
         return printf("Cannot get file length %d\n", wres);
 
-    res = Encode(&outStream.vt, &inStream.vt, fileSize);
+    res = Encode(&outStream.vt, &inStream.vt, fileSize, props, stream);
 
     File_Close(&outStream.file);
 
@@ -304,6 +685,8 @@ int lzma_encode(const char *out, const char *in)
             return printf("%s %d\n", kCantWriteMessage, outStream.wres);
         else if(res == SZ_ERROR_READ)
             return printf("%s %d\n", kCantReadMessage, inStream.wres);
+        else if(res == SZ_ERROR_PROGRESS)
+            return printf("\nError: %s\n", kCancelledMessage);
 
         return printf("\n7-Zip error code: %d\n", res);
     }
@@ -311,6 +694,34 @@ int lzma_encode(const char *out, const char *in)
     return 0;
 }
 
-#endif /* BSDIFF_EXECUTABLE */
+uint8_t *lzma_block_encode(const uint8_t *data, size_t size, const CLzmaEncProps *props,
+                           size_t *blockSize)
+{
+    CLzmaEncProps p = *props;
+    SizeT outSize = size + size / 3 + 128, propsSize = LZMA_PROPS_SIZE;
+    uint8_t *block = bsmem_alloc(BSMEM_IMAGE, HEADER_SIZE + outSize);
+    int i;
+
+    if(block == NULL)
+        return NULL;
+
+    p.reduceSize = size;
+
+    for(i = 0; i < 8; i++)
+        block[LZMA_PROPS_SIZE + i] = (uint8_t)((uint64_t)size >> (8 * i));
+
+    if(LzmaEncode(block + HEADER_SIZE, &outSize, data, size, &p, block, &propsSize, 0, NULL,
+                  bsmem_isz(BSMEM_ENCODER), bsmem_isz(BSMEM_MATCH_FINDER)) != SZ_OK)
+    {
+        bsmem_free(block);
+        return NULL;
+    }
+
+    *blockSize = HEADER_SIZE + outSize;
+
+    return block;
+}
+
+#endif /* LZMAUTIL_ENCODER */
 
 
@@ -15,29 +15,63 @@
 #include "../LzFind.h"
 #include "../LzmaDec.h"
 #include "../LzmaEnc.h"
-#include "ringbuffer.h"
 #include "../../win-bspatch/bspatch.h"
 
 
 #undef MY_CPU_NAME
 
+/* the executables pull in their half, other users (bench) define what they need */
+#if defined(BSPATCH_EXECUTABLE) && !defined(LZMAUTIL_DECODER)
+#define LZMAUTIL_DECODER
+#endif
+
+#if defined(BSDIFF_EXECUTABLE) && !defined(LZMAUTIL_ENCODER)
+#define LZMAUTIL_ENCODER
+#endif
+
 
 #define HEADER_SIZE (LZMA_PROPS_SIZE + 8)
 
+/* defaults, decodeInit takes the actual sizes */
+#ifndef IN_BUF_SIZE
 #define IN_BUF_SIZE (1 << 10)
+#endif
 #define OUT_BUF_SIZE (1 << 10)
 
+/* decoder probability table entries for lc + lp, see LzmaDec.c */
+#define LZMA_NUM_PROBS(lclp) (1984 + ((size_t)0x300 << (lclp)))
+
+/* BSPATCH_STATIC: the decoder lives entirely inside decode_t, nothing comes
+   from the heap. Patches whose dictionary or lc + lp exceed these are
+   refused by decodeInit; the input buffer is at most IN_BUF_SIZE. */
+#if defined(BSPATCH_STATIC)
+#ifndef BSPATCH_STATIC_DIC_SIZE
+#define BSPATCH_STATIC_DIC_SIZE (64 << 10)
+#endif
+#ifndef BSPATCH_STATIC_LCLP
+#define BSPATCH_STATIC_LCLP 3
+#endif
+#endif
+
+/* one per patch stream, hang it off bspatch_stream.opaque_dec */
 typedef struct
 {
+#if defined(BSPATCH_STATIC)
+    CLzmaProb probs[LZMA_NUM_PROBS(BSPATCH_STATIC_LCLP)];
+    uint8_t dic[BSPATCH_STATIC_DIC_SIZE];
+    uint8_t in[IN_BUF_SIZE];
+#endif
+    CLzmaDec state;
     size_t inPos;
     size_t inSize;
-    size_t outPos;
+    size_t outPos;      /* next byte of state.dic to hand out */
+    size_t outEnd;      /* end of the decoded, not yet handed out bytes */
+    size_t inBufSize;
+    size_t outBufSize;  /* most bytes decoded per decodeRead */
     uint32_t unpackSize;
     uint32_t patchsize;
     
     uint8_t *inBuf;
-    //uint8_t *outBuf;
-    ringbuffer_t *outBuf;
 } decode_t;
 
 
@@ -47,22 +81,87 @@ void *bsAlloc(ISzAllocPtr p, size_t size);
 
 void bsFree(ISzAllocPtr p, void *address);
 
-#if defined(BSPATCH_EXECUTABLE)
-int32_t decodeInit(uint8_t *header, size_t size, uint32_t patchsize);
+#if defined(LZMAUTIL_DECODER)
+int32_t decodeInit(decode_t *dec, uint8_t *header, size_t size, uint32_t patchsize,
+    size_t inBufSize, size_t outBufSize);
 
-void decodeUninit(void);
+void decodeUninit(decode_t *dec);
+
+/* Checkpoints: decodeSave writes the decoder (state, probabilities and the
+   used part of the dictionary) to |buf| and returns its size; with a NULL
+   |buf| it only returns the size. Input already read but not yet decoded is
+   not saved. decodeRestore loads it into a decoder freshly set up by
+   decodeInit from the same header; the caller then positions rpatch at
+   initial patchsize - dec->patchsize bytes into the LZMA data. The blob is
+   only meaningful to the same build. */
+size_t decodeSave(const decode_t *dec, uint8_t *buf);
+
+int decodeRestore(decode_t *dec, const uint8_t *buf, size_t size);
+
+/* Bytes a BSPATCH_STATIC decoder needs for this LZMA header: probabilities,
+   dictionary (no larger than the payload) and input buffer; 0 if the header
+   is bad. dicSize and lclp, if given, receive what the patch asks for. */
+size_t decodeFootprint(const uint8_t *header, size_t inBufSize, size_t *dicSize, unsigned *lclp);
+
+/* LZMA data the decoder has not consumed yet, counting input it has read
+   but not decoded; it only moves once per decodeRead of up to outBufSize */
+uint32_t decodeRemaining(const decode_t *dec);
+
+/* Lends up to |length| decoded bytes straight from the dictionary. The view
+   stays valid until the next decodeBorrow/decodeGetData call; the decoder
+   only refills once everything lent has been consumed. Returns the bytes
+   lent, 0 at the end of the stream, -1 on error. */
+int decodeBorrow(struct bspatch_stream* stream, const void** buffer, int length);
 
 int decodeGetData(struct bspatch_stream* stream, void* buffer, int length);
 
 int32_t decodeRead(struct bspatch_stream* stream);
 
-int32_t LzmaDecToBuf(CLzmaDec *p, uint8_t *dest, SizeT *destLen, 
-    const uint8_t *src, SizeT *srcLen, 
-    ELzmaFinishMode finishMode, ELzmaStatus *status);
+/* The decoded size a block states (see lzma_block_encode), -1 if |size|
+   does not even cover its header */
+int lzma_block_size(const uint8_t *block, size_t size, uint64_t *unpackSize);
+
+/* Decodes a block into |out|, which must be exactly the stated size.
+   Returns 0, or -1 for a corrupt block. */
+int lzma_block_decode(const uint8_t *block, size_t size, uint8_t *out, size_t outSize);
 #endif
 
-#if defined(BSDIFF_EXECUTABLE)
-int lzma_encode(const char *out, const char *in);
+#if defined(LZMAUTIL_ENCODER)
+#include "../../win-bsdiff/bsdiff.h"
+
+/* autotune: trial samples of the raw diff stream */
+#define AUTOTUNE_SAMPLE_SIZE (1 << 18)
+#define AUTOTUNE_SAMPLES 4
+#define AUTOTUNE_THREADS 4
+#define AUTOTUNE_BUDGET_MS 2000
+
+/* What a tuning run found: sample sizes packed with the default props and
+   with the picked ones, 0 for a trial the budget cut short */
+typedef struct
+{
+    uint32_t trials;    /* trials that finished */
+    SizeT defaultSize;
+    SizeT bestSize;
+} autotune_result_t;
+
+/* Tries lc/lp/pb/fb sets on samples of |data| until |budgetMs| (0 for
+   AUTOTUNE_BUDGET_MS) runs out, trials stopping mid-encode at the deadline,
+   and leaves the best in |props|: the defaults unless something beat them */
+int lzma_autotune(const uint8_t *data, size_t size, uint32_t budgetMs, CLzmaEncProps *props,
+                  autotune_result_t *result);
+
+int lzma_encode(const char *out, const char *in, const CLzmaEncProps *props,
+                struct bsdiff_stream *stream);
+
+/* Rough heap an lzma_encode of |size| bytes with |props| (NULL for the
+   defaults) takes, mostly the match finder: see LzmaLib.h */
+size_t lzma_encode_mem_estimate(const CLzmaEncProps *props, uint64_t size);
+
+/* One-shot LZMA block: 5 bytes properties, 8 bytes data size and the
+   compressed data, as the bundle manifest and seekable patch blocks are
+   stored. Returns it (bsmem_free) and its size, NULL if out of memory. */
+uint8_t *lzma_block_encode(const uint8_t *data, size_t size, const CLzmaEncProps *props,
+                           size_t *blockSize);
 #endif
 
 #endif /* __LZMAUTIL_H__ */
@@ -0,0 +1,72 @@
+/* bsaes.c -- AES-CTR over the patch payload */
+
+#include <string.h>
+
+#include "bsaes.h"
+
+#define ALIGN16(p) ((void *)(((uintptr_t)(p) + 15) & ~(uintptr_t)15))
+#define ALIGN64(p) ((void *)(((uintptr_t)(p) + 63) & ~(uintptr_t)63))
+
+void bsaes_prepare(void)
+{
+    AesGenTables();
+}
+
+int bsaes_init(bsaes_t *a, const uint8_t *key, unsigned keySize, const uint8_t *nonce)
+{
+    if(keySize != 16 && keySize != 24 && keySize != 32)
+        return -1;
+
+    memcpy(a->nonce, nonce, BSAES_NONCE_SIZE);
+    Aes_SetKey_Enc((UInt32 *)ALIGN16(a->mem) + 4, key, keySize);
+
+    return 0;
+}
+
+/* counter block for payload block |block|, one before as AesCtr_Code
+   increments first */
+static void set_counter(bsaes_t *a, uint64_t block)
+{
+    UInt32 *iv = ALIGN16(a->mem);
+    uint64_t lo = 0;
+    int i;
+
+    for(i = 0; i < 8; i++)
+        lo |= (uint64_t)a->nonce[i] << (8 * i);
+
+    lo += block - 1;
+
+    iv[0] = (UInt32)lo;
+    iv[1] = (UInt32)(lo >> 32);
+    memcpy(iv + 2, a->nonce + 8, 8);
+}
+
+void bsaes_code(bsaes_t *a, uint64_t pos, uint8_t *data, size_t size)
+{
+    uint8_t *tmp = ALIGN64(a->tmp);
+    size_t head, n, blocks;
+
+    while(size > 0)
+    {
+        /* the kernels want whole aligned blocks, so the range goes through
+           tmp at its offset within the first block */
+        head = (size_t)(pos & 15);
+        n = BSAES_CHUNK - head;
+        if(n > size)
+            n = size;
+
+        blocks = (head + n + 15) / 16;
+
+        memset(tmp, 0, blocks * 16);
+        memcpy(tmp + head, data, n);
+
+        set_counter(a, pos >> 4);
+        g_AesCtr_Code((UInt32 *)ALIGN16(a->mem), tmp, blocks);
+
+        memcpy(data, tmp + head, n);
+
+        pos += n;
+        data += n;
+        size -= n;
+    }
+}
@@ -0,0 +1,38 @@
+/* bsaes.h -- AES-CTR over the patch payload
+ *
+ * The payload (LZMA header and data) is XORed with the AES-CTR keystream;
+ * block b of the payload uses counter nonce + b + 1, the nonce's low 8
+ * bytes taken as a little endian integer, as AesCtr_Code counts. Any byte
+ * range can be coded on its own, so chunks may be done in parallel or out
+ * of order. CRC segments (bsseg.h) cover the encrypted bytes.
+ */
+
+#ifndef BSAES_H
+#define BSAES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../Aes.h"
+
+#define BSAES_NONCE_SIZE 16
+#define BSAES_CHUNK      4096
+
+typedef struct
+{
+    UInt32 mem[AES_NUM_IVMRK_WORDS + 4];    /* iv + key schedule, aligned in place */
+    uint8_t tmp[BSAES_CHUNK + 64];         /* the VAES path wants 32 byte alignment */
+    uint8_t nonce[BSAES_NONCE_SIZE];
+} bsaes_t;
+
+// Builds the tables and picks the AES-NI / VAES kernels; call once before
+// any bsaes_init, it is not thread safe
+void bsaes_prepare(void);
+
+// |keySize| is 16, 24 or 32. Returns 0, or -1 for a bad key size.
+int bsaes_init(bsaes_t *a, const uint8_t *key, unsigned keySize, const uint8_t *nonce);
+
+// Encrypts or decrypts |size| bytes that sit at payload offset |pos|
+void bsaes_code(bsaes_t *a, uint64_t pos, uint8_t *data, size_t size);
+
+#endif
@@ -0,0 +1,360 @@
+/* bsbundle.c -- directory bundles, one patch for a whole tree */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#else
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#endif
+
+#include "bsbundle.h"
+#include "bsmem.h"
+
+void bsbundle_init(bsbundle_t *b)
+{
+    b->e = NULL;
+    b->count = 0;
+    b->cap = 0;
+}
+
+void bsbundle_free(bsbundle_t *b)
+{
+    size_t i;
+
+    for(i = 0; i < b->count; i++)
+    {
+        bsmem_free(b->e[i].path);
+        bsmem_free(b->e[i].from);
+    }
+
+    bsmem_free(b->e);
+    bsbundle_init(b);
+}
+
+static char *copy_str(const char *s)
+{
+    size_t n = strlen(s) + 1;
+    char *p = bsmem_alloc(BSMEM_OTHER, n);
+
+    if(p)
+        memcpy(p, s, n);
+
+    return p;
+}
+
+int bsbundle_add(bsbundle_t *b, int kind, uint32_t size, const char *path, const char *from)
+{
+    bsbundle_entry_t *e;
+
+    if(b->count == b->cap)
+    {
+        size_t cap = b->cap ? b->cap * 2 : 64;
+
+        e = b->e ? bsmem_realloc(b->e, cap * sizeof(*e)) : bsmem_alloc(BSMEM_OTHER, cap * sizeof(*e));
+        if(e == NULL)
+            return -1;
+
+        b->e = e;
+        b->cap = cap;
+    }
+
+    e = &b->e[b->count];
+    e->kind = kind;
+    e->size = size;
+    e->path = copy_str(path);
+    e->from = from ? copy_str(from) : NULL;
+
+    if(e->path == NULL || (from && e->from == NULL))
+    {
+        bsmem_free(e->path);
+        bsmem_free(e->from);
+        return -1;
+    }
+
+    b->count++;
+
+    return 0;
+}
+
+int bsbundle_path(char *out, size_t size, const char *root, const char *rel)
+{
+    int n = snprintf(out, size, "%s/%s", root, rel);
+
+    return n < 0 || (size_t)n >= size ? -1 : 0;
+}
+
+int bsbundle_mkdirs(const char *root, const char *rel)
+{
+    char path[FILENAME_MAX];
+    size_t i;
+
+    if(bsbundle_path(path, sizeof(path), root, rel))
+        return -1;
+
+    /* the root and its parents too, existing ones are fine */
+    for(i = 1; path[i]; i++)
+    {
+        int ret;
+
+        if(path[i] != '/')
+            continue;
+
+        path[i] = 0;
+#ifdef _WIN32
+        {
+            DWORD attr;
+
+            ret = _mkdir(path) == 0 ||
+                  ((attr = GetFileAttributesA(path)) != INVALID_FILE_ATTRIBUTES &&
+                   (attr & FILE_ATTRIBUTE_DIRECTORY)) ? 0 : -1;
+        }
+#else
+        ret = mkdir(path, 0777) == 0 || errno == EEXIST ? 0 : -1;
+#endif
+        path[i] = '/';
+
+        if(ret)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* the manifest is line and tab separated */
+static int valid_name(const char *s)
+{
+    return *s && strpbrk(s, "\t\n\r") == NULL;
+}
+
+/* |rel|/|name|, or |name| at the top */
+static int child_path(char *out, size_t size, const char *rel, const char *name)
+{
+    int n;
+
+    if(rel[0])
+        return bsbundle_path(out, size, rel, name);
+
+    n = snprintf(out, size, "%s", name);
+
+    return n < 0 || (size_t)n >= size ? -1 : 0;
+}
+
+static int scan_dir(bsbundle_t *b, const char *root, const char *rel, int kind)
+{
+    char dir[FILENAME_MAX], child[FILENAME_MAX];
+    int ret = 0;
+
+    if(bsbundle_path(dir, sizeof(dir), root, rel[0] ? rel : "."))
+        return -1;
+
+#ifdef _WIN32
+    {
+        WIN32_FIND_DATAA fd;
+        HANDLE h;
+        char pattern[FILENAME_MAX];
+
+        snprintf(pattern, sizeof(pattern), "%s/*", dir);
+        if((h = FindFirstFileA(pattern, &fd)) == INVALID_HANDLE_VALUE)
+            return -1;
+
+        do
+        {
+            if(strcmp(fd.cFileName, ".") == 0 || strcmp(fd.cFileName, "..") == 0)
+                continue;
+
+            if(!valid_name(fd.cFileName) || child_path(child, sizeof(child), rel, fd.cFileName))
+                ret = -1;
+            else if(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+                ret = scan_dir(b, root, child, kind);
+            else if(fd.nFileSizeHigh)
+                ret = -1;
+            else
+                ret = bsbundle_add(b, kind, fd.nFileSizeLow, child, NULL);
+        }
+        while(ret == 0 && FindNextFileA(h, &fd));
+
+        FindClose(h);
+    }
+#else
+    {
+        struct dirent *de;
+        struct stat st;
+        char full[FILENAME_MAX];
+        DIR *d;
+
+        if((d = opendir(dir)) == NULL)
+            return -1;
+
+        while(ret == 0 && (de = readdir(d)) != NULL)
+        {
+            if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+                continue;
+
+            /* symlinks are followed, anything but files and directories skipped */
+            if(!valid_name(de->d_name) || child_path(child, sizeof(child), rel, de->d_name) ||
+                    bsbundle_path(full, sizeof(full), root, child) || stat(full, &st) != 0)
+                ret = -1;
+            else if(S_ISDIR(st.st_mode))
+                ret = scan_dir(b, root, child, kind);
+            else if(!S_ISREG(st.st_mode))
+                continue;
+            else if((uint64_t)st.st_size > UINT32_MAX)
+                ret = -1;
+            else
+                ret = bsbundle_add(b, kind, (uint32_t)st.st_size, child, NULL);
+        }
+
+        closedir(d);
+    }
+#endif
+
+    return ret;
+}
+
+static int by_path(const void *a, const void *b)
+{
+    return strcmp(((const bsbundle_entry_t *)a)->path, ((const bsbundle_entry_t *)b)->path);
+}
+
+int bsbundle_scan(bsbundle_t *b, const char *root, int kind)
+{
+    size_t first = b->count;
+
+    if(scan_dir(b, root, "", kind))
+        return -1;
+
+    qsort(b->e + first, b->count - first, sizeof(*b->e), by_path);
+
+    return 0;
+}
+
+#if defined(LZMAUTIL_ENCODER)
+/* the text form, or only its size with a NULL |buf| */
+static size_t format(const bsbundle_t *b, char *buf)
+{
+    char line[2 * FILENAME_MAX + 32];
+    size_t i, n, len = 0;
+
+    for(i = 0; i < b->count; i++)
+    {
+        const bsbundle_entry_t *e = &b->e[i];
+
+        if(e->from)
+            n = snprintf(line, sizeof(line), "%c\t%u\t%s\t%s\n", e->kind, e->size, e->path, e->from);
+        else
+            n = snprintf(line, sizeof(line), "%c\t%u\t%s\n", e->kind, e->size, e->path);
+
+        if(buf)
+            memcpy(buf + len, line, n);
+
+        len += n;
+    }
+
+    return len;
+}
+
+uint8_t *bsbundle_pack(const bsbundle_t *b, size_t *size)
+{
+    CLzmaEncProps props;
+    size_t textSize = format(b, NULL);
+    char *text = bsmem_alloc(BSMEM_OTHER, textSize + 1);
+    uint8_t *block;
+
+    if(text == NULL)
+        return NULL;
+
+    format(b, text);
+
+    LzmaEncProps_Init(&props);
+    block = lzma_block_encode((const uint8_t *)text, textSize, &props, size);
+
+    bsmem_free(text);
+
+    return block;
+}
+#endif
+
+#if defined(LZMAUTIL_DECODER)
+/* relative, no empty, "." or ".." components */
+static int safe_path(const char *p)
+{
+    const char *c = p;
+
+    if(*p == '/' || strchr(p, '\\') || strchr(p, ':'))
+        return 0;
+
+    for(;;)
+    {
+        size_t n = strcspn(c, "/");
+
+        if(n == 0 || (n == 1 && c[0] == '.') || (n == 2 && c[0] == '.' && c[1] == '.'))
+            return 0;
+
+        if(c[n] == 0)
+            return 1;
+
+        c += n + 1;
+    }
+}
+
+static int parse(bsbundle_t *b, char *text, size_t size)
+{
+    char *line = text, *end = text + size;
+
+    while(line < end)
+    {
+        char *nl = memchr(line, '\n', end - line);
+        char *f[4];
+        int n = 0;
+
+        if(nl == NULL)
+            return -1;
+
+        *nl = 0;
+
+        for(f[n++] = line; n < 4 && (f[n] = strchr(f[n - 1], '\t')) != NULL; n++)
+            *f[n]++ = 0;
+
+        if(strlen(f[0]) != 1 || n != (f[0][0] == BSBUNDLE_COPY ? 4 : 3) ||
+                (f[0][0] != BSBUNDLE_OLD && f[0][0] != BSBUNDLE_NEW && f[0][0] != BSBUNDLE_COPY) ||
+                strchr(f[n - 1], '\t') || *f[1] == 0 || strspn(f[1], "0123456789") != strlen(f[1]) ||
+                strlen(f[1]) > 10 || strtoul(f[1], NULL, 10) > UINT32_MAX || !safe_path(f[2]) ||
+                (n == 4 && !safe_path(f[3])))
+            return -1;
+
+        if(bsbundle_add(b, f[0][0], (uint32_t)strtoul(f[1], NULL, 10), f[2], n == 4 ? f[3] : NULL))
+            return -1;
+
+        line = nl + 1;
+    }
+
+    return 0;
+}
+
+int bsbundle_unpack(bsbundle_t *b, const uint8_t *block, size_t size)
+{
+    uint64_t textSize;
+    char *text;
+    int ret = -1;
+
+    /* a manifest line takes at least a few bytes of text */
+    if(lzma_block_size(block, size, &textSize) || textSize > (uint64_t)size * 1024 + (1 << 20))
+        return -1;
+
+    if((text = bsmem_alloc(BSMEM_OTHER, (size_t)textSize + 1)) == NULL)
+        return -1;
+
+    if(lzma_block_decode(block, size, (uint8_t *)text, (size_t)textSize) == 0)
+        ret = parse(b, text, (size_t)textSize);
+
+    bsmem_free(text);
+
+    return ret;
+}
+#endif
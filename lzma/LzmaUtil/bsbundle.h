@@ -0,0 +1,77 @@
+/* bsbundle.h -- directory bundles, one patch for a whole tree
+ *
+ * bsdiff -b concatenates the regular files of the old tree (sorted by
+ * path) into one corpus and the new files that are not byte-identical to
+ * some old file into one image, and diffs the two as usual: matches cross
+ * file boundaries and the payload is one solid LZMA stream. The manifest
+ * says how to cut both, one line per file:
+ *
+ *   O <size> <path>          old corpus member, in corpus order
+ *   N <size> <path>          new file cut from the patched image, in order
+ *   C <size> <path> <from>   new file identical to old file <from>, copied
+ *
+ * Fields are separated by tabs, paths are relative to the tree root with
+ * '/' between components. In the patch file the manifest follows the
+ * header (BSHDR_BUNDLE) as an LZMA block: 5 bytes properties, 8 bytes
+ * text size and the compressed text.
+ */
+
+#ifndef BSBUNDLE_H
+#define BSBUNDLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "LzmaUtil.h"
+
+enum
+{
+    BSBUNDLE_OLD = 'O',
+    BSBUNDLE_NEW = 'N',
+    BSBUNDLE_COPY = 'C'
+};
+
+typedef struct
+{
+    int kind;
+    uint32_t size;
+    char *path;
+    char *from;         /* BSBUNDLE_COPY only */
+} bsbundle_entry_t;
+
+typedef struct
+{
+    bsbundle_entry_t *e;
+    size_t count;
+    size_t cap;
+} bsbundle_t;
+
+void bsbundle_init(bsbundle_t *b);
+void bsbundle_free(bsbundle_t *b);
+
+// Appends an entry, copying the strings. Returns 0 or -1 if out of memory.
+int bsbundle_add(bsbundle_t *b, int kind, uint32_t size, const char *path, const char *from);
+
+// Appends every regular file under |root| as a |kind| entry, sorted by
+// path. Fails on unreadable directories, files of 4 GB or more and names a
+// manifest cannot hold (tabs, newlines).
+int bsbundle_scan(bsbundle_t *b, const char *root, int kind);
+
+// |root|/|rel| into |out|, -1 if it does not fit
+int bsbundle_path(char *out, size_t size, const char *root, const char *rel);
+
+// Creates the directories leading to |root|/|rel|, |root| included
+int bsbundle_mkdirs(const char *root, const char *rel);
+
+#if defined(LZMAUTIL_ENCODER)
+// Manifest block for the patch file, NULL if out of memory; bsmem_free it
+uint8_t *bsbundle_pack(const bsbundle_t *b, size_t *size);
+#endif
+
+#if defined(LZMAUTIL_DECODER)
+// Reads a manifest block into |b|. Rejects paths that would leave the
+// tree root. Returns 0 or -1.
+int bsbundle_unpack(bsbundle_t *b, const uint8_t *block, size_t size);
+#endif
+
+#endif
@@ -0,0 +1,194 @@
+/* bshdr.c -- patch file header, shared by bsdiff and bspatch */
+
+#include <string.h>
+
+#include "bshdr.h"
+#include "bsseek.h"
+#include "bsseg.h"
+
+static void put64(int32_t x, uint8_t *buf)
+{
+    uint32_t y = x < 0 ? -x : x;
+    int i;
+
+    for(i = 0; i < 8; i++, y >>= 8)
+        buf[i] = (uint8_t)y;
+
+    if(x < 0) buf[7] |= 0x80;
+}
+
+int32_t bshdr_get64(const uint8_t *buf)
+{
+    uint64_t y = buf[7] & 0x7F;
+    int i;
+
+    for(i = 6; i >= 0; i--)
+        y = y << 8 | buf[i];
+
+    if(y > INT32_MAX)
+        return BSHDR_BAD;
+
+    return (buf[7] & 0x80) ? -(int32_t)y : (int32_t)y;
+}
+
+size_t bshdr_write(const bshdr_t *h, uint8_t *buf)
+{
+    size_t len = BSHDR_SIZE_V41;
+
+    memcpy(buf, "BSDIFF41", 8);
+    put64(h->oldsize, buf + 8);
+    put64(h->newsize, buf + 16);
+    put64(h->patchsize, buf + 24);
+    put64(h->flags, buf + 40);
+
+    if(h->flags & BSHDR_SHA256)
+    {
+        memcpy(buf + len, h->oldsha, 32);
+        memcpy(buf + len + 32, h->newsha, 32);
+        len += 64;
+    }
+
+    if(h->flags & BSHDR_CRC32)
+    {
+        put64(h->segsize, buf + len);
+        len += 8;
+    }
+
+    if(h->flags & BSHDR_AES)
+    {
+        memcpy(buf + len, h->nonce, 16);
+        len += 16;
+    }
+
+    if(h->flags & BSHDR_BUNDLE)
+    {
+        put64(h->manifestsize, buf + len);
+        len += 8;
+    }
+
+    if(h->flags & BSHDR_SEEKABLE)
+    {
+        put64(h->blocksize, buf + len);
+        len += 8;
+    }
+
+    put64((int32_t)len, buf + 32);
+
+    return len;
+}
+
+int bshdr_read(bshdr_t *h, const uint8_t *buf, size_t size)
+{
+    int32_t o, n, p, len, flags;
+    size_t need = BSHDR_SIZE_V41;
+
+    if(size < BSHDR_SIZE_V40)
+        return BSHDR_SIZE_V40;
+
+    memset(h, 0, sizeof(*h));
+
+    o = bshdr_get64(buf + 8);
+    n = bshdr_get64(buf + 16);
+    p = bshdr_get64(buf + 24);
+
+    /* only a bundle may have an empty side, checked once flags are known */
+    if(o < 0 || n < 0 || p <= 0)
+        return -1;
+
+    h->oldsize = o;
+    h->newsize = n;
+    h->patchsize = p;
+
+    if(memcmp(buf, "BSDIFF41", 8) != 0 && (o == 0 || n == 0))
+        return -1;
+
+    if(memcmp(buf, "BSDIFF40", 8) == 0)
+        return BSHDR_SIZE_V40;
+
+    if(memcmp(buf, "BSDIFFIP", 8) == 0)
+    {
+        h->flags = BSHDR_INPLACE;
+        return BSHDR_SIZE_V40;
+    }
+
+    if(memcmp(buf, "BSDIFF41", 8) != 0)
+        return -1;
+
+    if(size < BSHDR_SIZE_V41)
+        return BSHDR_SIZE_V41;
+
+    len = bshdr_get64(buf + 32);
+    flags = bshdr_get64(buf + 40);
+
+    /* an unknown flag may change how the payload reads */
+    if(flags < 0 || (flags & ~BSHDR_KNOWN) || len < BSHDR_SIZE_V41 || len > BSHDR_SIZE_MAX)
+        return -1;
+
+    if(flags & BSHDR_SHA256)
+        need += 64;
+    if(flags & BSHDR_CRC32)
+        need += 8;
+    if(flags & BSHDR_AES)
+        need += 16;
+    if(flags & BSHDR_BUNDLE)
+        need += 8;
+    if(flags & BSHDR_SEEKABLE)
+        need += 8;
+
+    if((size_t)len < need || (!(flags & BSHDR_BUNDLE) && (o == 0 || n == 0)))
+        return -1;
+
+    if(size < (size_t)len)
+        return len;
+
+    h->flags = flags;
+    need = BSHDR_SIZE_V41;
+
+    if(flags & BSHDR_SHA256)
+    {
+        memcpy(h->oldsha, buf + need, 32);
+        memcpy(h->newsha, buf + need + 32, 32);
+        need += 64;
+    }
+
+    if(flags & BSHDR_CRC32)
+    {
+        int32_t segsize = bshdr_get64(buf + need);
+
+        if(segsize < BSSEG_MIN_SIZE)
+            return -1;
+
+        h->segsize = segsize;
+        need += 8;
+    }
+
+    if(flags & BSHDR_AES)
+    {
+        memcpy(h->nonce, buf + need, 16);
+        need += 16;
+    }
+
+    if(flags & BSHDR_BUNDLE)
+    {
+        int32_t manifestsize = bshdr_get64(buf + need);
+
+        if(manifestsize <= 0)
+            return -1;
+
+        h->manifestsize = manifestsize;
+        need += 8;
+    }
+
+    if(flags & BSHDR_SEEKABLE)
+    {
+        int32_t blocksize = bshdr_get64(buf + need);
+
+        if(blocksize < BSSEEK_MIN_BLOCK)
+            return -1;
+
+        h->blocksize = blocksize;
+        need += 8;
+    }
+
+    return len;
+}
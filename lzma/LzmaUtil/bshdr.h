@@ -0,0 +1,80 @@
+/* bshdr.h -- patch file header, shared by bsdiff and bspatch
+ *
+ * BSDIFF40 (and BSDIFFIP for in-place patches) is the original fixed 32
+ * byte header. BSDIFF41 adds a header length and flags, each flag brings
+ * an optional field; the fields follow in flag bit order:
+ *
+ *   0   8   "BSDIFF41"
+ *   8   8   old file size
+ *   16  8   new file size
+ *   24  8   patch size (LZMA data after this header and the manifest)
+ *   32  8   header length
+ *   40  8   flags
+ *   48  -   BSHDR_SHA256: SHA-256 of old, SHA-256 of new
+ *       8   BSHDR_CRC32: segment size, see bsseg.h
+ *       16  BSHDR_AES: AES-CTR nonce, see bsaes.h
+ *       8   BSHDR_BUNDLE: manifest size, the manifest follows the header
+ *               (bsbundle.h); old and new are the concatenated trees and
+ *               may be empty
+ *       8   BSHDR_SEEKABLE: block size, the payload is an index and
+ *               independent blocks (bsseek.h)
+ *
+ * BSHDR_FILL brings no field: a control tuple whose extra length is -n
+ * stands for n copies of the one byte that follows its diff bytes.
+ *
+ * All numbers are 8 byte sign-magnitude little endian, as in the payload.
+ */
+
+#ifndef BSHDR_H
+#define BSHDR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BSHDR_SIZE_V40  32
+#define BSHDR_SIZE_V41  48
+#define BSHDR_SIZE_MAX  256
+
+/* flags */
+#define BSHDR_INPLACE   0x01    /* payload is a bsdiff_inplace op stream */
+#define BSHDR_SHA256    0x02    /* digests of old and new */
+#define BSHDR_CRC32     0x04    /* payload in CRC32 checked segments */
+#define BSHDR_AES       0x08    /* payload encrypted with AES-CTR */
+#define BSHDR_BUNDLE    0x10    /* directory bundle, see bsbundle.h */
+#define BSHDR_SEEKABLE  0x20    /* random access blocks, see bsseek.h */
+#define BSHDR_FILL      0x40    /* tuples may fill instead of carrying extra */
+
+#define BSHDR_KNOWN     (BSHDR_INPLACE | BSHDR_SHA256 | BSHDR_CRC32 | BSHDR_AES | BSHDR_BUNDLE | \
+                         BSHDR_SEEKABLE | BSHDR_FILL)
+
+/* what bshdr_get64 returns for a number that does not fit int32_t */
+#define BSHDR_BAD       INT32_MIN
+
+typedef struct
+{
+    uint32_t oldsize;
+    uint32_t newsize;
+    uint32_t patchsize;
+    uint32_t flags;
+    uint8_t oldsha[32];
+    uint8_t newsha[32];
+    uint32_t segsize;
+    uint8_t nonce[16];
+    uint32_t manifestsize;
+    uint32_t blocksize;
+} bshdr_t;
+
+// Writes a BSDIFF41 header for |h| to |buf| (BSHDR_SIZE_MAX bytes).
+// Returns its length.
+size_t bshdr_write(const bshdr_t *h, uint8_t *buf);
+
+// Parses the first |size| bytes of a patch. Returns the header length once
+// |size| covers it, a larger value if more bytes are needed (call again
+// with at least that many) and -1 for a corrupt or unsupported header.
+int bshdr_read(bshdr_t *h, const uint8_t *buf, size_t size);
+
+// Decodes an 8 byte sign-magnitude number of the header or the payload,
+// BSHDR_BAD if its magnitude is above INT32_MAX.
+int32_t bshdr_get64(const uint8_t *buf);
+
+#endif
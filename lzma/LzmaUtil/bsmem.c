@@ -0,0 +1,223 @@
+/* bsmem.c -- allocation accounting shared by bsdiff, bspatch and LZMA */
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bsmem.h"
+
+/* keeps the block behind it as aligned as malloc's */
+#define BSMEM_HEADER 16
+
+typedef struct
+{
+    size_t size;
+    int tag;
+    uint32_t offset;    /* of the header in the malloc'd block, aligned only */
+} bsmem_header_t;
+
+typedef struct
+{
+    atomic_size_t live;
+    atomic_size_t peak;
+    atomic_size_t largest;
+    atomic_ullong count;
+    atomic_ullong total;
+} bsmem_counter_t;
+
+typedef struct
+{
+    ISzAlloc vt;
+    int tag;
+} bsmem_isz_t;
+
+static const char *const g_names[BSMEM_TAGS] = {
+    "other", "image", "suffix array", "rank array", "diff", "match finder",
+    "encoder", "dictionary", "patch input", "scratch", "ringbuffer", "writer",
+    "journal"
+};
+
+static bsmem_counter_t g_tags[BSMEM_TAGS];
+static bsmem_counter_t g_all;
+static _Thread_local int t_tag = BSMEM_OTHER;
+
+static void raise_to(atomic_size_t *m, size_t v)
+{
+    size_t cur = atomic_load_explicit(m, memory_order_relaxed);
+
+    while(v > cur && !atomic_compare_exchange_weak_explicit(m, &cur, v,
+            memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+static void charge(bsmem_counter_t *c, size_t size)
+{
+    size_t live = atomic_fetch_add_explicit(&c->live, size, memory_order_relaxed) + size;
+
+    raise_to(&c->peak, live);
+    raise_to(&c->largest, size);
+    atomic_fetch_add_explicit(&c->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&c->total, size, memory_order_relaxed);
+}
+
+static void *track(void *raw, int tag, size_t size)
+{
+    bsmem_header_t *h = raw;
+
+    if(raw == NULL)
+        return NULL;
+
+    if(tag < 0 || tag >= BSMEM_TAGS)
+        tag = BSMEM_OTHER;
+
+    h->size = size;
+    h->tag = tag;
+    h->offset = 0;
+    charge(&g_tags[tag], size);
+    charge(&g_all, size);
+
+    return (uint8_t *)raw + BSMEM_HEADER;
+}
+
+static bsmem_header_t *untrack(void *p)
+{
+    bsmem_header_t *h = (bsmem_header_t *)((uint8_t *)p - BSMEM_HEADER);
+
+    atomic_fetch_sub_explicit(&g_tags[h->tag].live, h->size, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&g_all.live, h->size, memory_order_relaxed);
+
+    return h;
+}
+
+void *bsmem_alloc(int tag, size_t size)
+{
+    return track(malloc(BSMEM_HEADER + size), tag, size);
+}
+
+void *bsmem_calloc(int tag, size_t size)
+{
+    return track(calloc(1, BSMEM_HEADER + size), tag, size);
+}
+
+void *bsmem_alloc_aligned(int tag, size_t size, size_t align)
+{
+    uint8_t *raw, *p;
+
+    if(align < BSMEM_HEADER)
+        align = BSMEM_HEADER;
+
+    if((raw = malloc(BSMEM_HEADER + size + align - 1)) == NULL)
+        return NULL;
+
+    /* the header sits right below the aligned block */
+    p = (uint8_t *)(((uintptr_t)raw + BSMEM_HEADER + align - 1) & ~(uintptr_t)(align - 1));
+    track(p - BSMEM_HEADER, tag, size);
+    ((bsmem_header_t *)(p - BSMEM_HEADER))->offset = (uint32_t)(p - BSMEM_HEADER - raw);
+
+    return p;
+}
+
+void *bsmem_realloc(void *p, size_t size)
+{
+    bsmem_header_t *h;
+    void *raw;
+    int tag;
+
+    if(p == NULL)
+        return bsmem_alloc(t_tag, size);
+
+    h = untrack(p);
+    tag = h->tag;
+
+    raw = realloc(h, BSMEM_HEADER + size);
+    if(raw == NULL)
+    {
+        /* the old block is still there */
+        track(h, tag, h->size);
+        return NULL;
+    }
+
+    return track(raw, tag, size);
+}
+
+void bsmem_free(void *p)
+{
+    bsmem_header_t *h;
+
+    if(p)
+    {
+        h = untrack(p);
+        free((uint8_t *)h - h->offset);
+    }
+}
+
+void bsmem_tag(int tag)
+{
+    t_tag = tag;
+}
+
+void *bsmem_malloc(size_t size)
+{
+    return bsmem_alloc(t_tag, size);
+}
+
+static void *isz_alloc(ISzAllocPtr p, size_t size)
+{
+    return bsmem_alloc(Z7_CONTAINER_FROM_VTBL(p, bsmem_isz_t, vt)->tag, size);
+}
+
+static void isz_free(ISzAllocPtr p, void *address)
+{
+    (void)p;
+    bsmem_free(address);
+}
+
+#define ISZ(tag) { { isz_alloc, isz_free }, tag }
+
+static const bsmem_isz_t g_isz[BSMEM_TAGS] = {
+    ISZ(0), ISZ(1), ISZ(2), ISZ(3), ISZ(4), ISZ(5), ISZ(6), ISZ(7), ISZ(8), ISZ(9), ISZ(10),
+    ISZ(11), ISZ(12)
+};
+
+const ISzAlloc *bsmem_isz(int tag)
+{
+    if(tag < 0 || tag >= BSMEM_TAGS)
+        tag = BSMEM_OTHER;
+
+    return &g_isz[tag].vt;
+}
+
+void bsmem_stat(int tag, bsmem_stat_t *st)
+{
+    const bsmem_counter_t *c = (tag >= 0 && tag < BSMEM_TAGS) ? &g_tags[tag] : &g_all;
+
+    st->live = atomic_load((atomic_size_t *)&c->live);
+    st->peak = atomic_load((atomic_size_t *)&c->peak);
+    st->largest = atomic_load((atomic_size_t *)&c->largest);
+    st->count = atomic_load((atomic_ullong *)&c->count);
+    st->total = atomic_load((atomic_ullong *)&c->total);
+}
+
+const char *bsmem_name(int tag)
+{
+    return (tag >= 0 && tag < BSMEM_TAGS) ? g_names[tag] : "total";
+}
+
+void bsmem_report(FILE *f)
+{
+    bsmem_stat_t st;
+    int tag;
+
+    fprintf(f, "%-14s %12s %12s %12s %10s\n", "memory", "peak", "live", "largest", "allocs");
+
+    for(tag = 0; tag <= BSMEM_TAGS; tag++)
+    {
+        bsmem_stat(tag, &st);
+        if(st.count == 0 && tag < BSMEM_TAGS)
+            continue;
+
+        fprintf(f, "%-14s %12llu %12llu %12llu %10llu\n", bsmem_name(tag),
+                (unsigned long long)st.peak, (unsigned long long)st.live,
+                (unsigned long long)st.largest, (unsigned long long)st.count);
+    }
+}
@@ -0,0 +1,68 @@
+/* bsmem.h -- allocation accounting shared by bsdiff, bspatch and LZMA
+ *
+ * Every block carries a small header with its size and subsystem tag, so
+ * live and peak bytes, allocation counts and the largest block are kept
+ * per tag and in total. bsdiff_stream.malloc/free take bsmem_malloc and
+ * bsmem_free, which charge the tag the caller set with bsmem_tag(); the
+ * LZMA encoder and decoder get a tagged ISzAlloc from bsmem_isz().
+ */
+
+#ifndef BSMEM_H
+#define BSMEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "../7zTypes.h"
+
+enum
+{
+    BSMEM_OTHER,
+    BSMEM_IMAGE,        /* old, new and patch images held by the tools */
+    BSMEM_SUFFIX,       /* bsdiff suffix array I */
+    BSMEM_RANK,         /* qsufsort rank array V */
+    BSMEM_DIFF,         /* diff bytes, in-place op lists */
+    BSMEM_MATCH_FINDER, /* LZMA encoder hash and binary tree */
+    BSMEM_ENCODER,      /* LZMA encoder state, autotune buffers */
+    BSMEM_DICTIONARY,   /* LZMA decoder dictionary and probabilities */
+    BSMEM_PATCH_IN,     /* decoder input buffer */
+    BSMEM_SCRATCH,      /* bspatch transfer buffers */
+    BSMEM_RINGBUFFER,   /* bspatch_mt queues (spsc.h) */
+    BSMEM_WRITER,       /* bspatch output write buffer */
+    BSMEM_JOURNAL,      /* checkpoint decoder state */
+    BSMEM_TAGS
+};
+
+typedef struct
+{
+    size_t live;
+    size_t peak;
+    size_t largest;
+    uint64_t count;     /* allocations */
+    uint64_t total;     /* bytes allocated over time */
+} bsmem_stat_t;
+
+void *bsmem_alloc(int tag, size_t size);
+void *bsmem_calloc(int tag, size_t size);
+void *bsmem_realloc(void *p, size_t size);   /* keeps the tag */
+void bsmem_free(void *p);
+
+// |align| a power of two; bsmem_free releases it, bsmem_realloc must not
+void *bsmem_alloc_aligned(int tag, size_t size, size_t align);
+
+// Tag charged by bsmem_malloc on the calling thread
+void bsmem_tag(int tag);
+void *bsmem_malloc(size_t size);
+
+// ISzAlloc charging |tag|, freeing works for any tag
+const ISzAlloc *bsmem_isz(int tag);
+
+// Counters of |tag|, or all tags together for BSMEM_TAGS
+void bsmem_stat(int tag, bsmem_stat_t *st);
+const char *bsmem_name(int tag);
+
+// Table of the tags that saw any allocation
+void bsmem_report(FILE *f);
+
+#endif
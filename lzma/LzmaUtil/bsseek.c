@@ -0,0 +1,100 @@
+/* bsseek.c -- seekable patches, random access into the new image */
+
+#include "bsmem.h"
+#include "bsseek.h"
+
+/* 8 byte sign-magnitude little endian, as everywhere in the patch */
+static void put64(int32_t x, uint8_t *buf)
+{
+    uint32_t y = x < 0 ? -x : x;
+    int i;
+
+    for(i = 0; i < 8; i++, y >>= 8)
+        buf[i] = (uint8_t)y;
+
+    if(x < 0) buf[7] |= 0x80;
+}
+
+static int64_t get64(const uint8_t *buf)
+{
+    int64_t y = buf[7] & 0x7F;
+    int i;
+
+    for(i = 6; i >= 0; i--)
+        y = y * 256 + buf[i];
+
+    return (buf[7] & 0x80) ? -y : y;
+}
+
+uint32_t bsseek_count(uint32_t newsize, uint32_t blocksize)
+{
+    return newsize / blocksize + (newsize % blocksize != 0);
+}
+
+size_t bsseek_max_raw(uint32_t blocksize)
+{
+    /* a tuple of one byte is 24 bytes of control and that byte */
+    return (size_t)blocksize * 25;
+}
+
+void bsseek_entry(uint8_t *buf, uint32_t packed, int32_t oldpos)
+{
+    put64((int32_t)packed, buf);
+    put64(oldpos, buf + 8);
+}
+
+int bsseek_load(bsseek_t *s, const uint8_t *index, uint32_t newsize, uint32_t blocksize,
+                uint32_t datasize)
+{
+    uint64_t pos;
+    uint32_t i;
+
+    s->blocksize = blocksize;
+    s->count = bsseek_count(newsize, blocksize);
+    s->offset = NULL;
+    s->oldpos = NULL;
+
+    /* the index alone has to fit */
+    if((uint64_t)s->count * BSSEEK_ENTRY_SIZE > datasize)
+        return -1;
+
+    s->offset = bsmem_alloc(BSMEM_OTHER, (s->count + 1) * sizeof(*s->offset));
+    s->oldpos = bsmem_alloc(BSMEM_OTHER, (s->count + 1) * sizeof(*s->oldpos));
+
+    if(s->offset == NULL || s->oldpos == NULL)
+    {
+        bsseek_free(s);
+        return -1;
+    }
+
+    pos = (uint64_t)s->count * BSSEEK_ENTRY_SIZE;
+
+    for(i = 0; i < s->count; i++)
+    {
+        int64_t packed = get64(index + i * BSSEEK_ENTRY_SIZE);
+        int64_t oldpos = get64(index + i * BSSEEK_ENTRY_SIZE + 8);
+
+        if(packed <= 0 || oldpos < INT32_MIN || oldpos > INT32_MAX || pos + packed > datasize)
+        {
+            bsseek_free(s);
+            return -1;
+        }
+
+        s->offset[i] = (uint32_t)pos;
+        s->oldpos[i] = (int32_t)oldpos;
+        pos += packed;
+    }
+
+    s->offset[s->count] = (uint32_t)pos;
+
+    return 0;
+}
+
+void bsseek_free(bsseek_t *s)
+{
+    bsmem_free(s->offset);
+    bsmem_free(s->oldpos);
+    s->offset = NULL;
+    s->oldpos = NULL;
+    s->count = 0;
+}
@@ -0,0 +1,51 @@
+/* bsseek.h -- seekable patches, random access into the new image
+ *
+ * bsdiff -x<n> cuts the raw patch so that block i holds exactly the control
+ * tuples that build new bytes [i * n, (i + 1) * n), splitting a tuple where
+ * it crosses a boundary, and compresses every block on its own. The block
+ * size n is in the header (BSHDR_SEEKABLE), the payload is
+ *
+ *   16  per block: compressed size, old position at the block start
+ *   -   the blocks, as lzma_block_encode stores them
+ *
+ * so new bytes [a, b) take blocks a / n to (b - 1) / n and nothing else;
+ * bspatch_range() applies one. Every tuple builds at least one byte, which
+ * bounds a decoded block. CRC segments and AES cover this payload as they
+ * cover a plain one.
+ */
+
+#ifndef BSSEEK_H
+#define BSSEEK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BSSEEK_BLOCK        (64 << 10)
+#define BSSEEK_MIN_BLOCK    4096
+#define BSSEEK_ENTRY_SIZE   16
+
+typedef struct
+{
+    uint32_t blocksize;
+    uint32_t count;
+    uint32_t *offset;   /* count + 1 payload offsets, the last one the end */
+    int32_t *oldpos;
+} bsseek_t;
+
+// Blocks of a |newsize| byte image
+uint32_t bsseek_count(uint32_t newsize, uint32_t blocksize);
+
+// Largest decoded block a valid patch has for this block size
+size_t bsseek_max_raw(uint32_t blocksize);
+
+// Index entry of a block of |packed| bytes that starts at old position |oldpos|
+void bsseek_entry(uint8_t *buf, uint32_t packed, int32_t oldpos);
+
+// Reads the index, bsseek_count() entries at the start of a |datasize| byte
+// payload. Returns 0, or -1 if out of memory or the blocks do not fit.
+int bsseek_load(bsseek_t *s, const uint8_t *index, uint32_t newsize, uint32_t blocksize,
+                uint32_t datasize);
+
+void bsseek_free(bsseek_t *s);
+
+#endif
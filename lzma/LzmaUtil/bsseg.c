@@ -0,0 +1,155 @@
+/* bsseg.c -- CRC32 checked segments of the patch payload */
+
+#include <string.h>
+
+#include "../7zCrc.h"
+#include "bsmem.h"
+#include "bsseg.h"
+
+uint32_t bsseg_data_size(uint32_t framed, uint32_t segsize)
+{
+    uint32_t n;
+
+    if(segsize == 0)
+        return framed;
+
+    n = (framed + segsize + 3) / (segsize + 4);
+
+    return framed - 4 * n;
+}
+
+uint32_t bsseg_framed_size(uint32_t datasize, uint32_t segsize)
+{
+    if(segsize == 0)
+        return datasize;
+
+    return datasize + 4 * ((datasize + segsize - 1) / segsize);
+}
+
+uint32_t bsseg_offset(uint32_t index, uint32_t segsize)
+{
+    return index * (segsize + 4);
+}
+
+void bsseg_frame(uint8_t *dst, const uint8_t *src, uint32_t size, uint32_t segsize)
+{
+    uint32_t n, crc;
+
+    CrcGenerateTable();
+
+    while(size > 0)
+    {
+        n = size < segsize ? size : segsize;
+        crc = CrcCalc(src, n);
+
+        memcpy(dst, src, n);
+        dst[n] = (uint8_t)crc;
+        dst[n + 1] = (uint8_t)(crc >> 8);
+        dst[n + 2] = (uint8_t)(crc >> 16);
+        dst[n + 3] = (uint8_t)(crc >> 24);
+
+        src += n;
+        dst += n + 4;
+        size -= n;
+    }
+}
+
+int bsseg_init(bsseg_t *s, uint32_t segsize, uint32_t datasize, uint32_t index,
+               int (*raw)(void *ctx, void *buf, int length), void *ctx)
+{
+    memset(s, 0, sizeof(*s));
+    s->segsize = segsize;
+    s->datasize = datasize;
+    s->raw = raw;
+    s->ctx = ctx;
+    bsseg_seek(s, index);
+
+    if(segsize == 0)
+        return 0;
+
+    CrcGenerateTable();
+
+    /* never more than the payload holds */
+    if(datasize < segsize)
+        segsize = datasize;
+
+    s->seg = bsmem_alloc(BSMEM_PATCH_IN, (size_t)segsize + 4);
+
+    return s->seg ? 0 : -1;
+}
+
+void bsseg_free(bsseg_t *s)
+{
+    bsmem_free(s->seg);
+    s->seg = NULL;
+}
+
+void bsseg_seek(bsseg_t *s, uint32_t index)
+{
+    s->index = index;
+    s->pos = s->segsize ? index * s->segsize : 0;
+    s->have = 0;
+    s->used = 0;
+}
+
+/* the segment at |pos|, all of it checked */
+static int load_segment(bsseg_t *s)
+{
+    uint32_t n = s->datasize - s->pos, crc;
+    uint8_t *t;
+
+    if(n > s->segsize)
+        n = s->segsize;
+
+    s->index = s->pos / s->segsize;
+
+    if(s->raw(s->ctx, s->seg, n + 4))
+        return -1;
+
+    t = s->seg + n;
+    crc = (uint32_t)t[0] | (uint32_t)t[1] << 8 | (uint32_t)t[2] << 16 | (uint32_t)t[3] << 24;
+    if(CrcCalc(s->seg, n) != crc)
+        return BSSEG_CORRUPT;
+
+    s->have = n;
+    s->used = 0;
+
+    return 0;
+}
+
+int bsseg_read(bsseg_t *s, void *buf, int length)
+{
+    uint8_t *p = buf;
+    uint32_t n;
+    int res;
+
+    if(s->segsize == 0)
+    {
+        if(s->raw(s->ctx, buf, length))
+            return -1;
+
+        s->pos += length;
+        return 0;
+    }
+
+    if((uint32_t)length > s->datasize - s->pos)
+        return -1;
+
+    while(length > 0)
+    {
+        if(s->used == s->have && (res = load_segment(s)) != 0)
+            return res;
+
+        n = s->have - s->used;
+        if(n > (uint32_t)length)
+            n = (uint32_t)length;
+
+        memcpy(p, s->seg + s->used, n);
+        s->used += n;
+        s->pos += n;
+        p += n;
+        length -= n;
+    }
+
+    return 0;
+}
@@ -0,0 +1,58 @@
+/* bsseg.h -- CRC32 checked segments of the patch payload
+ *
+ * The payload (LZMA header and data) is cut into segments of a fixed
+ * number of bytes, the last one possibly shorter; each segment is followed
+ * by the CRC32 of its bytes, 4 bytes little endian. A reader takes in a
+ * whole segment and checks it before handing out any of its bytes, so bad
+ * input never reaches the decoder; it names the failing segment so a
+ * transport can fetch it again.
+ */
+
+#ifndef BSSEG_H
+#define BSSEG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BSSEG_SIZE      (64 << 10)
+#define BSSEG_MIN_SIZE  256
+#define BSSEG_CORRUPT   (-2)
+
+typedef struct
+{
+    uint32_t segsize;   /* 0: payload is not segmented */
+    uint32_t datasize;  /* payload bytes, without the CRCs */
+    uint32_t pos;       /* payload bytes handed out */
+    uint32_t index;     /* segment in |seg|, or the one that failed */
+    uint8_t *seg;       /* segment and CRC as read */
+    uint32_t have;      /* payload bytes in |seg| */
+    uint32_t used;      /* of them handed out */
+
+    int (*raw)(void *ctx, void *buf, int length);  /* reads the file bytes */
+    void *ctx;
+} bsseg_t;
+
+// Payload size for |framed| bytes as stored, and the other way round
+uint32_t bsseg_data_size(uint32_t framed, uint32_t segsize);
+uint32_t bsseg_framed_size(uint32_t datasize, uint32_t segsize);
+
+// Raw file offset of segment |index| relative to the start of the payload
+uint32_t bsseg_offset(uint32_t index, uint32_t segsize);
+
+// Frames |size| bytes of |src| into |dst| (bsseg_framed_size bytes)
+void bsseg_frame(uint8_t *dst, const uint8_t *src, uint32_t size, uint32_t segsize);
+
+// Reader starting at segment |index|; the raw source must be positioned at
+// bsseg_offset(index). Holds one segment; returns 0 or -1 if out of memory.
+int bsseg_init(bsseg_t *s, uint32_t segsize, uint32_t datasize, uint32_t index,
+               int (*raw)(void *ctx, void *buf, int length), void *ctx);
+void bsseg_free(bsseg_t *s);
+
+// Continues at segment |index| after the raw source was moved there
+void bsseg_seek(bsseg_t *s, uint32_t index);
+
+// Reads exactly |length| payload bytes. Returns 0, -1 on a read error or
+// past the end, BSSEG_CORRUPT if a segment fails its CRC (s->index).
+int bsseg_read(bsseg_t *s, void *buf, int length);
+
+#endif
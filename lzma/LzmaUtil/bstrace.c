@@ -0,0 +1,161 @@
+/* bstrace.c -- timeline trace of diff and apply */
+
+#if defined(BSTRACE)
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "bstrace.h"
+
+typedef struct
+{
+    const char *name;
+    uint64_t ns;
+    char ph;            /* 'B' or 'E' */
+} bstrace_event;
+
+typedef struct bstrace_buf
+{
+    struct bstrace_buf *next;
+    const char *thread;
+    uint32_t tid;
+    uint32_t count;
+    uint32_t dropped;
+    bstrace_event ev[BSTRACE_EVENTS];
+} bstrace_buf;
+
+static _Atomic(bstrace_buf *) g_bufs;
+static atomic_uint g_tids;
+static _Thread_local bstrace_buf *t_buf;
+
+static uint64_t now_ns(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER f, c;
+    QueryPerformanceFrequency(&f);
+    QueryPerformanceCounter(&c);
+    return (uint64_t)((double)c.QuadPart * 1e9 / (double)f.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/* the calling thread's buffer, created and published on first use */
+static bstrace_buf *thread_buf(void)
+{
+    bstrace_buf *b = t_buf, *head;
+
+    if(b)
+        return b;
+
+    b = calloc(1, sizeof(bstrace_buf));
+    if(b == NULL)
+        return NULL;
+
+    b->tid = atomic_fetch_add(&g_tids, 1) + 1;
+
+    head = atomic_load(&g_bufs);
+    do
+        b->next = head;
+    while(!atomic_compare_exchange_weak(&g_bufs, &head, b));
+
+    t_buf = b;
+    return b;
+}
+
+static void record(const char *name, char ph)
+{
+    bstrace_buf *b = thread_buf();
+    bstrace_event *e;
+
+    if(b == NULL)
+        return;
+
+    if(b->count == BSTRACE_EVENTS)
+    {
+        b->dropped++;
+        return;
+    }
+
+    e = &b->ev[b->count++];
+    e->name = name;
+    e->ph = ph;
+    e->ns = now_ns();
+}
+
+void bstrace_begin(const char *name)
+{
+    record(name, 'B');
+}
+
+void bstrace_end(const char *name)
+{
+    record(name, 'E');
+}
+
+void bstrace_thread(const char *name)
+{
+    bstrace_buf *b = thread_buf();
+
+    if(b)
+        b->thread = name;
+}
+
+int bstrace_dump(const char *path)
+{
+    FILE *f = fopen(path, "w");
+    bstrace_buf *b;
+    uint64_t t0 = UINT64_MAX;
+    uint32_t i;
+    int first = 1;
+
+    if(f == NULL)
+        return -1;
+
+    /* timestamps start at the first event of any thread */
+    for(b = atomic_load(&g_bufs); b; b = b->next)
+        if(b->count && b->ev[0].ns < t0)
+            t0 = b->ev[0].ns;
+
+    fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+
+    for(b = atomic_load(&g_bufs); b; b = b->next)
+    {
+        if(b->thread)
+        {
+            fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, "
+                    "\"args\": {\"name\": \"%s\"}}", first ? "" : ",\n", b->tid, b->thread);
+            first = 0;
+        }
+
+        if(b->dropped)
+        {
+            fprintf(f, "%s{\"name\": \"dropped %u events\", \"ph\": \"i\", \"s\": \"t\", \"pid\": 1, "
+                    "\"tid\": %u, \"ts\": %.3f}", first ? "" : ",\n", b->dropped, b->tid,
+                    (b->ev[b->count - 1].ns - t0) / 1e3);
+            first = 0;
+        }
+
+        for(i = 0; i < b->count; i++)
+        {
+            fprintf(f, "%s{\"name\": \"%s\", \"ph\": \"%c\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f}",
+                    first ? "" : ",\n", b->ev[i].name, b->ev[i].ph, b->tid, (b->ev[i].ns - t0) / 1e3);
+            first = 0;
+        }
+    }
+
+    fprintf(f, "\n]}\n");
+
+    return fclose(f) ? -1 : 0;
+}
+
+#endif /* BSTRACE */
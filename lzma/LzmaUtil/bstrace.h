@@ -0,0 +1,42 @@
+/* bstrace.h -- timeline trace of diff and apply
+ *
+ * Built with BSTRACE, TRACE_BEGIN/TRACE_END record spans into a buffer of
+ * the calling thread (no locks; a thread's buffer is linked into a global
+ * list once, with a CAS), and bstrace_dump() writes them all as Chrome
+ * trace JSON for chrome://tracing or Perfetto. Without BSTRACE the macros
+ * are empty. Names must be string literals, only the pointer is kept.
+ */
+
+#ifndef BSTRACE_H
+#define BSTRACE_H
+
+#if defined(BSTRACE)
+
+/* events per thread, later ones are dropped and counted */
+#ifndef BSTRACE_EVENTS
+#define BSTRACE_EVENTS (1 << 16)
+#endif
+
+void bstrace_begin(const char *name);
+void bstrace_end(const char *name);
+
+// Names the calling thread in the trace
+void bstrace_thread(const char *name);
+
+// Writes every thread's events to |path|; call once the other threads are
+// done. Returns 0 or -1.
+int bstrace_dump(const char *path);
+
+#define TRACE_BEGIN(name)   bstrace_begin(name)
+#define TRACE_END(name)     bstrace_end(name)
+#define TRACE_THREAD(name)  bstrace_thread(name)
+
+#else
+
+#define TRACE_BEGIN(name)
+#define TRACE_END(name)
+#define TRACE_THREAD(name)
+
+#endif
+
+#endif
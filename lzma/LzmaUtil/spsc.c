@@ -0,0 +1,164 @@
+/* spsc.c -- lock-free single-producer/single-consumer byte queue */
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "../Threads.h"
+#include "bsmem.h"
+#include "spsc.h"
+
+struct spsc_t
+{
+    uint8_t *base;
+    size_t mask;
+
+    /* only the producer writes tail, only the consumer writes head; both
+       run freely and the difference is the fill level */
+    atomic_size_t head;
+    atomic_size_t tail;
+    atomic_int closed;
+    atomic_int aborted;
+
+    CAutoResetEvent notEmpty;
+    CAutoResetEvent notFull;
+};
+
+spsc_t *spsc_init(size_t size)
+{
+    spsc_t *q;
+    size_t n = 1;
+
+    while(n < size)
+        n <<= 1;
+
+    q = bsmem_calloc(BSMEM_RINGBUFFER, sizeof(spsc_t));
+    if(q == NULL)
+        return NULL;
+
+    Event_Construct(&q->notEmpty);
+    Event_Construct(&q->notFull);
+
+    q->base = bsmem_alloc(BSMEM_RINGBUFFER, n);
+    q->mask = n - 1;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->closed, 0);
+    atomic_init(&q->aborted, 0);
+
+    if(q->base == NULL ||
+            AutoResetEvent_CreateNotSignaled(&q->notEmpty) != 0 ||
+            AutoResetEvent_CreateNotSignaled(&q->notFull) != 0)
+    {
+        spsc_free(q);
+        return NULL;
+    }
+
+    return q;
+}
+
+void spsc_free(spsc_t *q)
+{
+    if(q == NULL)
+        return;
+
+    if(Event_IsCreated(&q->notEmpty))
+        Event_Close(&q->notEmpty);
+
+    if(Event_IsCreated(&q->notFull))
+        Event_Close(&q->notFull);
+
+    bsmem_free(q->base);
+    bsmem_free(q);
+}
+
+size_t spsc_write_span(spsc_t *q, uint8_t **p)
+{
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    size_t head, n;
+
+    for(;;)
+    {
+        if(atomic_load_explicit(&q->aborted, memory_order_relaxed))
+            return 0;
+
+        head = atomic_load_explicit(&q->head, memory_order_acquire);
+        if(tail - head <= q->mask)
+            break;
+
+        /* a missed signal leaves the event set, so the recheck is enough */
+        Event_Wait(&q->notFull);
+    }
+
+    n = q->mask + 1 - (tail - head);
+    if(n > q->mask + 1 - (tail & q->mask))
+        n = q->mask + 1 - (tail & q->mask);
+
+    *p = q->base + (tail & q->mask);
+
+    return n;
+}
+
+void spsc_commit(spsc_t *q, size_t n)
+{
+    atomic_fetch_add_explicit(&q->tail, n, memory_order_release);
+    Event_Set(&q->notEmpty);
+}
+
+void spsc_close(spsc_t *q)
+{
+    atomic_store_explicit(&q->closed, 1, memory_order_release);
+    Event_Set(&q->notEmpty);
+}
+
+size_t spsc_read_span(spsc_t *q, const uint8_t **p)
+{
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t tail, n;
+
+    for(;;)
+    {
+        if(atomic_load_explicit(&q->aborted, memory_order_relaxed))
+            return 0;
+
+        tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+        if(tail != head)
+            break;
+
+        /* closed is published after the last commit, recheck tail once */
+        if(atomic_load_explicit(&q->closed, memory_order_acquire))
+        {
+            if(atomic_load_explicit(&q->tail, memory_order_acquire) == head)
+                return 0;
+
+            continue;
+        }
+
+        Event_Wait(&q->notEmpty);
+    }
+
+    n = tail - head;
+    if(n > q->mask + 1 - (head & q->mask))
+        n = q->mask + 1 - (head & q->mask);
+
+    *p = q->base + (head & q->mask);
+
+    return n;
+}
+
+void spsc_release(spsc_t *q, size_t n)
+{
+    atomic_fetch_add_explicit(&q->head, n, memory_order_release);
+    Event_Set(&q->notFull);
+}
+
+void spsc_abort(spsc_t *q)
+{
+    atomic_store_explicit(&q->aborted, 1, memory_order_release);
+    Event_Set(&q->notEmpty);
+    Event_Set(&q->notFull);
+}
+
+int spsc_aborted(const spsc_t *q)
+{
+    return atomic_load_explicit((atomic_int *)&q->aborted, memory_order_acquire);
+}
@@ -0,0 +1,47 @@
+/* spsc.h -- lock-free single-producer/single-consumer byte queue
+ *
+ * It may be filled from one thread while it is drained from another.
+ * Both sides work on contiguous spans of the ring so data is copied in
+ * and out at most once. The head and tail indices are atomics; an
+ * auto-reset event per side is only touched to sleep when the queue is
+ * full or empty.
+ */
+
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct spsc_t spsc_t;
+
+// Create a queue of at least |size| bytes (rounded up to a power of two)
+// Returns NULL if allocation failed. Free with |spsc_free|.
+spsc_t *spsc_init(size_t size);
+
+// Safe to call with NULL.
+void spsc_free(spsc_t *q);
+
+// Producer: waits for free space and returns a contiguous span of it in
+// |p|. Returns 0 if the queue was aborted.
+size_t spsc_write_span(spsc_t *q, uint8_t **p);
+
+// Producer: publishes |n| bytes of the last span
+void spsc_commit(spsc_t *q, size_t n);
+
+// Producer: no more data will follow
+void spsc_close(spsc_t *q);
+
+// Consumer: waits for data and returns a contiguous span of it in |p|.
+// Returns 0 once the queue is closed and drained, or aborted.
+size_t spsc_read_span(spsc_t *q, const uint8_t **p);
+
+// Consumer: hands |n| bytes of the last span back to the producer
+void spsc_release(spsc_t *q, size_t n);
+
+// Either side: wakes the other one and makes all further waits fail
+void spsc_abort(spsc_t *q);
+
+int spsc_aborted(const spsc_t *q);
+
+#endif /* SPSC_H */
@@ -0,0 +1,711 @@
+/* bench.c -- bsdiff/bspatch benchmarks
+ *
+ * By default builds a patch in memory, then applies it with a range of
+ * transfer and buffer sizes and prints the throughput of each run.
+ *
+ * -j[file] runs the corpus suite instead: reproducible firmware, text,
+ * random, zero-padded flash and append-only log images, each diffed and
+ * applied with the time spent per phase, peak RSS and patch ratio, written
+ * as JSON (to bench.json by default) so runs of different versions can be
+ * compared.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <time.h>
+#include <sys/resource.h>
+#endif
+
+#include "../lzma/LzmaUtil/LzmaUtil.h"
+#include "../lzma/Threads.h"
+
+#define BENCH_SIZE (8 << 20)
+#define SUITE_SIZE (1 << 20)
+#define BENCH_THREADS 4
+
+static const ISzAlloc g_alloc = { bsAlloc, bsFree };
+
+typedef struct
+{
+    uint8_t *data;
+    size_t size;
+    size_t pos;
+} membuf_t;
+
+void err(int exitcode, const char *fmt, ...)
+{
+    va_list valist;
+    va_start(valist, fmt);
+    vprintf(fmt, valist);
+    va_end(valist);
+    exit(exitcode);
+}
+
+static double now_sec(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER f, c;
+    QueryPerformanceFrequency(&f);
+    QueryPerformanceCounter(&c);
+    return (double)c.QuadPart / (double)f.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+static uint32_t rnd(uint32_t *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 17;
+    *s ^= *s << 5;
+    return *s;
+}
+
+static void make_code(uint8_t *p, size_t size, uint32_t *seed)
+{
+    size_t i;
+
+    for(i = 0; i + 4 <= size; i += 4)
+    {
+        uint32_t op = rnd(seed);
+        p[i] = (uint8_t)(0xe0 | (op & 0x0f));
+        p[i + 1] = (uint8_t)(op >> 8);
+        p[i + 2] = (uint8_t)((op >> 16) & 0x3);
+        p[i + 3] = 0x00;
+    }
+
+    for(; i < size; i++)
+        p[i] = 0;
+}
+
+/* firmware-like: a small instruction vocabulary with random operands,
+   new inserts a block and patches operands every few KB */
+static void make_corpus(uint8_t *pold, uint8_t *pnew, size_t size)
+{
+    uint32_t seed = 0x12345678;
+    size_t i, shift = 4096;
+
+    make_code(pold, size, &seed);
+
+    memcpy(pnew, pold, size / 2);
+    for(i = 0; i < shift; i++)
+        pnew[size / 2 + i] = (uint8_t)rnd(&seed);
+    memcpy(pnew + size / 2 + shift, pold + size / 2, size / 2 - shift);
+
+    for(i = 0; i < size; i += 4093)
+        pnew[i] += 1;
+}
+
+static int mem_write(struct bsdiff_stream *stream, const void *buffer, int size)
+{
+    membuf_t *m = stream->opaque;
+
+    if(m->pos + size > m->size)
+        return -1;
+
+    memcpy(m->data + m->pos, buffer, size);
+    m->pos += size;
+
+    return 0;
+}
+
+static int mem_rpatch(struct bspatch_stream *stream, void *buffer, int length)
+{
+    membuf_t *m = stream->opaque_r;
+
+    if(m->pos + length > m->size)
+        length = (int)(m->size - m->pos);
+
+    memcpy(buffer, m->data + m->pos, length);
+    m->pos += length;
+
+    return 0;
+}
+
+static int mem_read(struct bspatch_stream *stream, void *buffer, int length)
+{
+    return decodeGetData(stream, buffer, length) == length ? 0 : -1;
+}
+
+static int mem_out(struct bspatch_stream *stream, const void *buffer, int length)
+{
+    membuf_t *m = stream->opaque_w;
+
+    if(m->pos + length > m->size)
+        return -1;
+
+    memcpy(m->data + m->pos, buffer, length);
+    m->pos += length;
+
+    return 0;
+}
+
+typedef struct
+{
+    const uint8_t *pold;
+    const uint8_t *pnew;
+    const uint8_t *patch;
+    size_t patchsize;
+    size_t size;
+    size_t transfer;
+    int pipelined;
+    int result;
+} apply_t;
+
+/* one complete apply with its own decoder, verified against new */
+static int apply(const apply_t *a)
+{
+    struct bspatch_stream stream;
+    decode_t dec;
+    membuf_t in, out;
+    int res = -1;
+
+    in.data = (uint8_t *)a->patch + HEADER_SIZE;
+    in.size = a->patchsize - HEADER_SIZE;
+    in.pos = 0;
+    out.size = a->size;
+    out.pos = 0;
+    out.data = malloc(a->size);
+    if(out.data == NULL)
+        return -1;
+
+    memset(&stream, 0, sizeof(stream));
+    stream.read = mem_read;
+    stream.borrow = decodeBorrow;
+    stream.rpatch = mem_rpatch;
+    stream.opaque_r = &in;
+    stream.opaque_dec = &dec;
+    stream.write = mem_out;
+    stream.opaque_w = &out;
+    stream.rold = bspatch_rold_mem;
+    stream.opaque_old = (void *)a->pold;
+    stream.transfer_size = (int)a->transfer;
+
+    if(decodeInit(&dec, (uint8_t *)a->patch, HEADER_SIZE, (uint32_t)in.size,
+                  a->transfer, a->transfer) == SZ_OK)
+    {
+        if((a->pipelined ? bspatch_mt : bspatch)(&stream, (int32_t)a->size, (int32_t)a->size) == 0 &&
+                out.pos == a->size && memcmp(out.data, a->pnew, a->size) == 0)
+            res = 0;
+
+        decodeUninit(&dec);
+    }
+
+    free(out.data);
+
+    return res;
+}
+
+static THREAD_FUNC_DECL apply_thread(void *param)
+{
+    apply_t *a = param;
+
+    a->result = apply(a);
+
+    return THREAD_FUNC_RET_ZERO;
+}
+
+/* time spent per phase of one diff and apply, in seconds */
+typedef struct
+{
+    double sort;
+    double scan;
+    double encode;
+    double decode;
+    double rold;
+    double write;
+    double apply;
+} phases_t;
+
+/* the suite runs one job at a time, its callbacks add up here */
+static phases_t g_phases;
+static double g_start;
+
+/* sorting ends where the first scan report comes in */
+static int phase_progress(struct bsdiff_stream *stream, int phase, uint64_t done, uint64_t total, uint64_t out)
+{
+    UNUSED_VAR(stream);
+    UNUSED_VAR(done);
+    UNUSED_VAR(total);
+    UNUSED_VAR(out);
+
+    if(phase == BSDIFF_PHASE_SCAN && g_phases.sort == 0)
+        g_phases.sort = now_sec() - g_start;
+
+    return 0;
+}
+
+/* patch layout as written by lzma_encode: props, 8 byte unpack size, data;
+   |timed| fills the sort, scan and encode times of g_phases */
+static size_t make_patch(const uint8_t *pold, size_t oldsize, const uint8_t *pnew, size_t size,
+                         uint8_t **patch, int timed)
+{
+    struct bsdiff_stream stream;
+    membuf_t raw;
+    CLzmaEncProps props;
+    SizeT propsSize = LZMA_PROPS_SIZE;
+    SizeT packed;
+    uint8_t *out;
+    int i;
+
+    raw.size = size + size / 3 + 1024;
+    raw.data = malloc(raw.size);
+    raw.pos = 0;
+
+    memset(&stream, 0, sizeof(stream));
+    stream.malloc = malloc;
+    stream.free = free;
+    stream.write = mem_write;
+    stream.opaque = &raw;
+    stream.progress = timed ? phase_progress : NULL;
+
+    g_start = now_sec();
+
+    if(raw.data == NULL || bsdiff(pold, (int32_t)oldsize, pnew, (int32_t)size, &stream))
+        err(1, "bsdiff failed\n");
+
+    if(timed)
+        g_phases.scan = now_sec() - g_start - g_phases.sort;
+
+    packed = raw.pos + raw.pos / 3 + 128;
+    out = malloc(HEADER_SIZE + packed);
+    if(out == NULL)
+        err(1, "malloc failed\n");
+
+    LzmaEncProps_Init(&props);
+    props.reduceSize = raw.pos;
+
+    g_start = now_sec();
+
+    if(LzmaEncode(out + HEADER_SIZE, &packed, raw.data, raw.pos, &props, out, &propsSize,
+                  0, NULL, &g_alloc, &g_alloc) != SZ_OK)
+        err(1, "lzma failed\n");
+
+    if(timed)
+        g_phases.encode = now_sec() - g_start;
+
+    for(i = 0; i < 8; i++)
+        out[LZMA_PROPS_SIZE + i] = (uint8_t)((uint64_t)raw.pos >> (8 * i));
+
+    free(raw.data);
+    *patch = out;
+
+    return HEADER_SIZE + packed;
+}
+
+static int timed_read(struct bspatch_stream *stream, void *buffer, int length)
+{
+    double t = now_sec();
+    int res = mem_read(stream, buffer, length);
+
+    g_phases.decode += now_sec() - t;
+    return res;
+}
+
+static int timed_borrow(struct bspatch_stream *stream, const void **buffer, int length)
+{
+    double t = now_sec();
+    int res = decodeBorrow(stream, buffer, length);
+
+    g_phases.decode += now_sec() - t;
+    return res;
+}
+
+static int timed_rold(struct bspatch_stream *stream, uint32_t offset, const void **buffer, int length)
+{
+    double t = now_sec();
+    int res = bspatch_rold_mem(stream, offset, buffer, length);
+
+    g_phases.rold += now_sec() - t;
+    return res;
+}
+
+static int timed_write(struct bspatch_stream *stream, const void *buffer, int length)
+{
+    double t = now_sec();
+    int res = mem_out(stream, buffer, length);
+
+    g_phases.write += now_sec() - t;
+    return res;
+}
+
+/* apply() with every stream callback timed, fills the rest of g_phases */
+static int apply_timed(const uint8_t *pold, const uint8_t *pnew, size_t newsize,
+                       const uint8_t *patch, size_t patchsize, size_t oldsize)
+{
+    struct bspatch_stream stream;
+    decode_t dec;
+    membuf_t in, out;
+    int res = -1;
+
+    in.data = (uint8_t *)patch + HEADER_SIZE;
+    in.size = patchsize - HEADER_SIZE;
+    in.pos = 0;
+    out.size = newsize;
+    out.pos = 0;
+    out.data = malloc(newsize);
+    if(out.data == NULL)
+        return -1;
+
+    memset(&stream, 0, sizeof(stream));
+    stream.read = timed_read;
+    stream.borrow = timed_borrow;
+    stream.rpatch = mem_rpatch;
+    stream.opaque_r = &in;
+    stream.opaque_dec = &dec;
+    stream.write = timed_write;
+    stream.opaque_w = &out;
+    stream.rold = timed_rold;
+    stream.opaque_old = (void *)pold;
+    stream.transfer_size = 64 << 10;
+
+    g_start = now_sec();
+
+    if(decodeInit(&dec, (uint8_t *)patch, HEADER_SIZE, (uint32_t)in.size, 64 << 10, 64 << 10) == SZ_OK)
+    {
+        if(bspatch(&stream, (int32_t)oldsize, (int32_t)newsize) == 0 &&
+                out.pos == newsize && memcmp(out.data, pnew, newsize) == 0)
+            res = 0;
+
+        decodeUninit(&dec);
+    }
+
+    g_phases.apply = now_sec() - g_start;
+
+    free(out.data);
+
+    return res;
+}
+
+/* peak resident set since the last rss_reset(), in KB; Linux resets it
+   through clear_refs, elsewhere it is the peak of the whole run */
+static void rss_reset(void)
+{
+#ifdef __linux__
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+
+    if(f)
+    {
+        fputs("5", f);
+        fclose(f);
+    }
+#endif
+}
+
+static unsigned long rss_peak_kb(void)
+{
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS pmc;
+
+    if(!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+        return 0;
+
+    return (unsigned long)(pmc.PeakWorkingSetSize >> 10);
+#elif defined(__linux__)
+    char line[128];
+    unsigned long kb = 0;
+    FILE *f = fopen("/proc/self/status", "r");
+
+    if(f == NULL)
+        return 0;
+
+    while(fgets(line, sizeof(line), f))
+        if(sscanf(line, "VmHWM: %lu", &kb) == 1)
+            break;
+
+    fclose(f);
+    return kb;
+#else
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+    return (unsigned long)(ru.ru_maxrss >> 10);
+#else
+    return (unsigned long)ru.ru_maxrss;
+#endif
+#endif
+}
+
+/* Suite corpora. Each fills old and new (at most size + size / 4 bytes)
+   from a fixed seed and returns their sizes. */
+
+static void corpus_firmware(uint8_t *pold, size_t *oldsize, uint8_t *pnew, size_t *newsize, size_t size)
+{
+    make_corpus(pold, pnew, size);
+    *oldsize = *newsize = size;
+}
+
+/* lines of words; new replaces a word now and then, inserts and drops lines */
+static void corpus_text(uint8_t *pold, size_t *oldsize, uint8_t *pnew, size_t *newsize, size_t size)
+{
+    static const char *const words[] = {
+        "the", "patch", "old", "new", "image", "block", "flash", "update", "boot", "loader",
+        "error", "config", "value", "buffer", "device", "return", "status", "table", "index", "size"
+    };
+    uint32_t seed = 0x7e57da7a;
+    size_t i = 0, o = 0, n = 0;
+
+    while(i + 16 < size)
+    {
+        const char *w = words[rnd(&seed) % 20];
+        size_t len = strlen(w);
+
+        memcpy(pold + i, w, len);
+        i += len;
+        pold[i++] = (uint8_t)(rnd(&seed) % 9 == 0 ? '\n' : ' ');
+    }
+
+    while(i < size)
+        pold[i++] = '\n';
+
+    *oldsize = size;
+
+    while(o < size)
+    {
+        uint32_t r = rnd(&seed) % 4096;
+        size_t line = 0;
+
+        while(o + line < size && pold[o + line++] != '\n')
+            ;
+
+        if(r < 8)
+        {
+            /* dropped line */
+        }
+        else if(r < 16 && n + 2 * line <= size + size / 4)
+        {
+            memcpy(pnew + n, pold + o, line);
+            memcpy(pnew + n + line, pold + o, line);
+            n += 2 * line;
+        }
+        else if(n + line <= size + size / 4)
+        {
+            memcpy(pnew + n, pold + o, line);
+            if(r < 64 && line > 4)
+                pnew[n + rnd(&seed) % (line - 1)] ^= 0x20;
+            n += line;
+        }
+
+        o += line;
+    }
+
+    *newsize = n;
+}
+
+/* nothing in common, the worst case for both sides */
+static void corpus_random(uint8_t *pold, size_t *oldsize, uint8_t *pnew, size_t *newsize, size_t size)
+{
+    uint32_t seed = 0x0ddba11;
+    size_t i;
+
+    for(i = 0; i < size; i++)
+        pold[i] = (uint8_t)rnd(&seed);
+
+    for(i = 0; i < size; i++)
+        pnew[i] = (uint8_t)rnd(&seed);
+
+    *oldsize = *newsize = size;
+}
+
+/* a flash partition: code, then zeros to the end; new has a bit more code */
+static void corpus_padded(uint8_t *pold, size_t *oldsize, uint8_t *pnew, size_t *newsize, size_t size)
+{
+    uint32_t seed = 0x5eed;
+    size_t used = size / 8 * 5, grown = size / 8 * 6, i;
+
+    memset(pold, 0, size);
+    memset(pnew, 0, size);
+
+    make_code(pold, used, &seed);
+    memcpy(pnew, pold, used);
+    make_code(pnew + used, grown - used, &seed);
+
+    for(i = 0; i < used; i += 8191)
+        pnew[i] += 1;
+
+    *oldsize = *newsize = size;
+}
+
+/* a log that only grows: new is old plus a quarter more records */
+static void corpus_log(uint8_t *pold, size_t *oldsize, uint8_t *pnew, size_t *newsize, size_t size)
+{
+    uint32_t seed = 0x106106;
+    size_t n = 0;
+
+    while(n + 64 < size + size / 4)
+    {
+        n += (size_t)sprintf((char *)pnew + n, "%08u I app: request %u took %u ms\n",
+                             (unsigned)(n / 37), rnd(&seed) % 100000, rnd(&seed) % 1000);
+    }
+
+    *newsize = n;
+    *oldsize = n * 4 / 5;
+    memcpy(pold, pnew, *oldsize);
+}
+
+typedef struct
+{
+    const char *name;
+    void (*make)(uint8_t *pold, size_t *oldsize, uint8_t *pnew, size_t *newsize, size_t size);
+} corpus_t;
+
+static const corpus_t g_corpora[] = {
+    { "firmware", corpus_firmware },
+    { "text", corpus_text },
+    { "random", corpus_random },
+    { "padded", corpus_padded },
+    { "log", corpus_log },
+};
+
+static int run_suite(size_t size, const char *path)
+{
+    FILE *f;
+    size_t k, oldsize, newsize, patchsize;
+    uint8_t *pold, *pnew, *patch;
+
+    pold = malloc(size + size / 4);
+    pnew = malloc(size + size / 4);
+    if(pold == NULL || pnew == NULL)
+        err(1, "malloc failed\n");
+
+    /* decodeInit talks on stdout, so the report goes to its own file */
+    f = fopen(path, "w");
+    if(f == NULL)
+        err(1, "cannot open %s\n", path);
+
+    fprintf(f, "{\n  \"size\": %u,\n  \"cases\": [\n", (unsigned)size);
+
+    for(k = 0; k < sizeof(g_corpora) / sizeof(g_corpora[0]); k++)
+    {
+        g_corpora[k].make(pold, &oldsize, pnew, &newsize, size);
+
+        memset(&g_phases, 0, sizeof(g_phases));
+        rss_reset();
+
+        patchsize = make_patch(pold, oldsize, pnew, newsize, &patch, 1);
+
+        if(apply_timed(pold, pnew, newsize, patch, patchsize, oldsize))
+            err(1, "mismatch in %s\n", g_corpora[k].name);
+
+        fprintf(f, "    { \"corpus\": \"%s\", \"old\": %u, \"new\": %u, \"patch\": %u, \"ratio\": %.6f,\n"
+               "      \"sort_ms\": %.3f, \"scan_ms\": %.3f, \"lzma_encode_ms\": %.3f,\n"
+               "      \"lzma_decode_ms\": %.3f, \"old_read_ms\": %.3f, \"write_ms\": %.3f, \"apply_ms\": %.3f,\n"
+               "      \"peak_rss_kb\": %lu }%s\n",
+               g_corpora[k].name, (unsigned)oldsize, (unsigned)newsize, (unsigned)patchsize,
+               (double)patchsize / newsize,
+               g_phases.sort * 1e3, g_phases.scan * 1e3, g_phases.encode * 1e3,
+               g_phases.decode * 1e3, g_phases.rold * 1e3, g_phases.write * 1e3, g_phases.apply * 1e3,
+               rss_peak_kb(), k + 1 < sizeof(g_corpora) / sizeof(g_corpora[0]) ? "," : "");
+
+        free(patch);
+    }
+
+    fprintf(f, "  ]\n}\n");
+    fclose(f);
+
+    free(pnew);
+    free(pold);
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    static const size_t sizes[] = { 256, 1 << 10, 4 << 10, 16 << 10, 64 << 10, 256 << 10, 1 << 20, 4 << 20 };
+    size_t size = BENCH_SIZE, k;
+    uint8_t *pold, *pnew;
+    apply_t a, par[BENCH_THREADS];
+    CThread threads[BENCH_THREADS];
+    double t;
+    const char *suite = NULL;
+
+    /* bench [-j[file]] [size] */
+    if(argc > 1 && strncmp(argv[1], "-j", 2) == 0)
+    {
+        suite = argv[1][2] ? argv[1] + 2 : "bench.json";
+        size = SUITE_SIZE;
+        argv++;
+        argc--;
+    }
+
+    if(argc > 1)
+        size = strtoul(argv[1], NULL, 0) & ~(size_t)3;
+
+    if(suite)
+        return run_suite(size, suite);
+
+    pold = malloc(size);
+    pnew = malloc(size);
+    if(pold == NULL || pnew == NULL)
+        err(1, "malloc failed\n");
+
+    make_corpus(pold, pnew, size);
+
+    a.pold = pold;
+    a.pnew = pnew;
+    a.size = size;
+    a.patchsize = make_patch(pold, size, pnew, size, (uint8_t **)&a.patch, 0);
+
+    printf("image %u bytes, patch %u bytes\n", (unsigned)size, (unsigned)a.patchsize);
+    printf("%10s %10s %10s\n", "buffer", "MB/s", "piped MB/s");
+
+    for(k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++)
+    {
+        double tp;
+
+        a.transfer = sizes[k];
+        a.pipelined = 0;
+
+        t = now_sec();
+        if(apply(&a))
+            err(1, "mismatch at buffer %u\n", (unsigned)sizes[k]);
+        t = now_sec() - t;
+
+        a.pipelined = 1;
+
+        tp = now_sec();
+        if(apply(&a))
+            err(1, "pipelined mismatch at buffer %u\n", (unsigned)sizes[k]);
+        tp = now_sec() - tp;
+
+        printf("%10u %10.1f %10.1f\n", (unsigned)sizes[k], size / t / 1e6, size / tp / 1e6);
+    }
+
+    /* the same patch applied concurrently, each thread with its own decoder */
+    a.transfer = 64 << 10;
+    a.pipelined = 0;
+    t = now_sec();
+
+    for(k = 0; k < BENCH_THREADS; k++)
+    {
+        par[k] = a;
+        Thread_CONSTRUCT(&threads[k])
+        if(Thread_Create(&threads[k], apply_thread, &par[k]) != 0)
+            err(1, "thread failed\n");
+    }
+
+    for(k = 0; k < BENCH_THREADS; k++)
+    {
+        Thread_Wait_Close(&threads[k]);
+        if(par[k].result)
+            err(1, "mismatch in thread %u\n", (unsigned)k);
+    }
+
+    t = now_sec() - t;
+    printf("%u threads %10.1f MB/s total\n", BENCH_THREADS, BENCH_THREADS * size / t / 1e6);
+
+    free((void *)a.patch);
+    free(pnew);
+    free(pold);
+
+    return 0;
+}
@@ -0,0 +1,43 @@
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+CONFIG -= qt
+
+DEFINES += LZMAUTIL_ENCODER LZMAUTIL_DECODER
+
+# peak RSS for the -j suite
+win32: LIBS += -lpsapi
+
+SOURCES += \
+    ../lzma/7zFile.c \
+    ../lzma/7zStream.c \
+    ../lzma/Alloc.c \
+    ../lzma/CpuArch.c \
+    ../lzma/LzFind.c \
+    ../lzma/LzFindMt.c \
+    ../lzma/LzFindOpt.c \
+    ../lzma/LzmaDec.c \
+    ../lzma/LzmaEnc.c \
+    ../lzma/LzmaUtil/LzmaUtil.c \
+    ../lzma/LzmaUtil/bsmem.c \
+    ../lzma/LzmaUtil/bstrace.c \
+    ../lzma/LzmaUtil/spsc.c \
+    ../lzma/Threads.c \
+    ../win-bsdiff/bsdiff.c \
+    ../win-bspatch/bsadd.c \
+    ../win-bspatch/bspatch.c \
+    ../win-bspatch/bspatch_mt.c \
+        bench.c \
+
+HEADERS += \
+    ../lzma/7zTypes.h \
+    ../lzma/CpuArch.h \
+    ../lzma/LzmaDec.h \
+    ../lzma/LzmaEnc.h \
+    ../lzma/LzmaUtil/LzmaUtil.h \
+    ../lzma/LzmaUtil/bsmem.h \
+    ../lzma/LzmaUtil/bstrace.h \
+    ../lzma/LzmaUtil/spsc.h \
+    ../win-bsdiff/bsdiff.h \
+    ../win-bspatch/bsadd.h \
+    ../win-bspatch/bspatch.h
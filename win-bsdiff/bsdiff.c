@@ -24,17 +24,59 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+/* glibc declares SEEK_DATA/SEEK_HOLE (-S) for GNU sources only */
+#if !defined(_WIN32) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include "bsdiff.h"
+#include "../lzma/LzmaUtil/bshdr.h"
+#include "../lzma/LzmaUtil/bsmem.h"
+#include "../lzma/LzmaUtil/bstrace.h"
 
 #define MIN(x,y) (((x)<(y)) ? (x) : (y))
+#define MAX(x,y) (((x)>(y)) ? (x) : (y))
+
+/* BSDIFF_STATS: the counters of the running bsdiff() call, per thread so
+   the helpers below need no extra argument; without it all of this is gone */
+#if defined(BSDIFF_STATS)
+static _Thread_local struct bsdiff_stats *t_stats;
+static _Thread_local uint32_t t_depth;
+
+static void stat_hist(uint64_t *hist, int32_t len)
+{
+    int b = 0;
+
+    while(len > 0 && b < BSDIFF_HIST_BUCKETS - 1)
+    {
+        len >>= 1;
+        b++;
+    }
+
+    hist[b]++;
+}
+
+#define STAT_ADD(field, n)      do { if(t_stats) t_stats->field += (n); } while(0)
+#define STAT_HIST(field, len)   do { if(t_stats) stat_hist(t_stats->field, len); } while(0)
+#define STAT_ENTER()            do { if(t_stats && ++t_depth > t_stats->split_depth) t_stats->split_depth = t_depth; } while(0)
+#define STAT_LEAVE()            do { if(t_stats) t_depth--; } while(0)
+#else
+#define STAT_ADD(field, n)
+#define STAT_HIST(field, len)
+#define STAT_ENTER()
+#define STAT_LEAVE()
+#endif
 
 static void split(int32_t *I, int32_t *V, int32_t start, int32_t len, int32_t h)
 {
     int32_t i, j, k, x, tmp, jj, kk;
 
+    STAT_ENTER();
+
     if(len < 16)
     {
         for(k = start; k < start + len; k += j)
@@ -61,6 +103,7 @@ static void split(int32_t *I, int32_t *V, int32_t start, int32_t len, int32_t h)
             if(j == 1) I[k] = -1;
         };
 
+        STAT_LEAVE();
         return;
     };
 
@@ -116,12 +159,15 @@ static void split(int32_t *I, int32_t *V, int32_t start, int32_t len, int32_t h)
     if(jj == kk - 1) I[jj] = -1;
 
     if(start + len > kk) split(I, V, kk, start + len - kk, h);
+
+    STAT_LEAVE();
 }
 
-static void qsufsort(int32_t *I, int32_t *V, const uint8_t *pold, int32_t oldsize)
+static int qsufsort(int32_t *I, int32_t *V, const uint8_t *pold, int32_t oldsize,
+                    struct bsdiff_stream *stream)
 {
     int32_t buckets[256];
-    int32_t i, h, len;
+    int32_t i, h, len, sorted;
 
     for(i = 0; i < 256; i++) buckets[i] = 0;
 
@@ -147,12 +193,14 @@ static void qsufsort(int32_t *I, int32_t *V, const uint8_t *pold, int32_t oldsiz
 
     for(h = 1; I[0] != -(oldsize + 1); h += h)
     {
-        len = 0;
+        len = 0; sorted = 0;
+        STAT_ADD(sort_passes, 1);
 
         for(i = 0; i < oldsize + 1;)
         {
             if(I[i] < 0)
             {
+                sorted -= I[i];
                 len -= I[i];
                 i -= I[i];
             }
@@ -168,9 +216,15 @@ static void qsufsort(int32_t *I, int32_t *V, const uint8_t *pold, int32_t oldsiz
         };
 
         if(len) I[i - len] = -len;
+
+        if(stream->progress &&
+                stream->progress(stream, BSDIFF_PHASE_SORT, sorted, oldsize + 1, 0))
+            return BSDIFF_CANCELLED;
     };
 
     for(i = 0; i < oldsize + 1; i++) I[V[i]] = i;
+
+    return 0;
 }
 
 static int32_t matchlen(const uint8_t *pold, int32_t oldsize, const uint8_t *pnew, int32_t newsize)
@@ -180,6 +234,8 @@ static int32_t matchlen(const uint8_t *pold, int32_t oldsize, const uint8_t *pne
     for(i = 0; (i < oldsize) && (i < newsize); i++)
         if(pold[i] != pnew[i]) break;
 
+    STAT_ADD(compared_bytes, i < oldsize && i < newsize ? i + 1 : i);
+
     return i;
 }
 
@@ -207,6 +263,11 @@ static int32_t search(const int32_t *I, const uint8_t *pold, int32_t oldsize,
 
     x = st + (en - st) / 2;
 
+#if defined(BSDIFF_STATS)
+    /* memcmp stops one past the common prefix, as matchlen counts it */
+    matchlen(pold + I[x], oldsize - I[x], pnew, newsize);
+#endif
+
     if(memcmp(pold + I[x], pnew, MIN(oldsize - I[x], newsize)) < 0)
     {
         return search(I, pold, oldsize, pnew, newsize, x, en, pos);
@@ -276,16 +337,23 @@ static int bsdiff_internal(const struct bsdiff_request req)
     int32_t oldscore, scsc;
     int32_t s, Sf, lenf, Sb, lenb;
     int32_t overlap, Ss, lens;
-    int32_t i;
+    int32_t i, report;
     uint8_t *buffer;
     uint8_t buf[8 * 3];
+    int result = -1;
 
+    bsmem_tag(BSMEM_RANK);
     if((V = req.stream->malloc((req.oldsize + 1) * sizeof(int32_t))) == NULL) return -1;
 
     I = req.I;
 
-    qsufsort(I, V, req.old, req.oldsize);
+    TRACE_BEGIN("sort");
+    i = qsufsort(I, V, req.old, req.oldsize, req.stream);
     req.stream->free(V);
+    TRACE_END("sort");
+
+    if(i)
+        return i;
 
     buffer = req.buffer;
 
@@ -293,14 +361,31 @@ static int bsdiff_internal(const struct bsdiff_request req)
     scan = 0; len = 0; pos = 0;
     lastscan = 0; lastpos = 0; lastoffset = 0;
 
+    /* with no callback the threshold is never reached */
+    report = req.stream->progress ? 0 : INT32_MAX;
+
+    TRACE_BEGIN("scan");
+
     while(scan < req.newsize)
     {
         oldscore = 0;
 
         for(scsc = scan += len; scan < req.newsize; scan++)
         {
+            if(scan >= report)
+            {
+                if(req.stream->progress(req.stream, BSDIFF_PHASE_SCAN, scan, req.newsize, 0))
+                {
+                    result = BSDIFF_CANCELLED;
+                    goto out;
+                }
+
+                report = scan + BSDIFF_PROGRESS_STEP;
+            }
+
             len = search(I, req.old, req.oldsize, req.new + scan, req.newsize - scan,
                          0, req.oldsize, &pos);
+            STAT_ADD(search_calls, 1);
 
             for(; scsc < scan + len; scsc++)
                 if((scsc + lastoffset < req.oldsize) &&
@@ -375,6 +460,12 @@ static int bsdiff_internal(const struct bsdiff_request req)
                 lenb -= lens;
             };
 
+            STAT_ADD(tuples, 1);
+            STAT_ADD(diff_bytes, lenf);
+            STAT_ADD(extra_bytes, (scan - lenb) - (lastscan + lenf));
+            STAT_HIST(diff_hist, lenf);
+            STAT_HIST(extra_hist, (scan - lenb) - (lastscan + lenf));
+
             offtout(lenf, buf);
 
             offtout((scan - lenb) - (lastscan + lenf), buf + 8);
@@ -383,21 +474,21 @@ static int bsdiff_internal(const struct bsdiff_request req)
 
             /* Write control data */
             if(writedata(req.stream, buf, sizeof(buf)))
-                return -1;
+                goto out;
 
             /* Write diff data */
             for(i = 0; i < lenf; i++)
                 buffer[i] = req.new[lastscan + i] - req.old[lastpos + i];
 
             if(writedata(req.stream, buffer, lenf))
-                return -1;
+                goto out;
 
             /* Write extra data */
             for(i = 0; i < (scan - lenb) - (lastscan + lenf); i++)
                 buffer[i] = req.new[lastscan + lenf + i];
 
             if(writedata(req.stream, buffer, (scan - lenb) - (lastscan + lenf)))
-                return -1;
+                goto out;
 
             lastscan = scan - lenb;
             lastpos = pos - lenb;
@@ -405,7 +496,16 @@ static int bsdiff_internal(const struct bsdiff_request req)
         };
     };
 
-    return 0;
+    result = 0;
+
+out:
+    TRACE_END("scan");
+
+    if(result == 0 && req.stream->progress &&
+            req.stream->progress(req.stream, BSDIFF_PHASE_SCAN, req.newsize, req.newsize, 0))
+        return BSDIFF_CANCELLED;
+
+    return result;
 }
 
 int bsdiff(const uint8_t *pold, int32_t oldsize, const uint8_t *pnew, int32_t newsize, struct bsdiff_stream *stream)
@@ -413,9 +513,12 @@ int bsdiff(const uint8_t *pold, int32_t oldsize, const uint8_t *pnew, int32_t ne
     int result;
     struct bsdiff_request req;
 
+    /* tags for a bsmem_malloc stream, nothing for any other */
+    bsmem_tag(BSMEM_SUFFIX);
     if((req.I = stream->malloc((oldsize + 1) * sizeof(int32_t))) == NULL)
         return -1;
 
+    bsmem_tag(BSMEM_DIFF);
     if((req.buffer = stream->malloc(newsize + 1)) == NULL)
     {
         stream->free(req.I);
@@ -428,164 +531,2169 @@ int bsdiff(const uint8_t *pold, int32_t oldsize, const uint8_t *pnew, int32_t ne
     req.newsize = newsize;
     req.stream = stream;
 
+#if defined(BSDIFF_STATS)
+    t_stats = stream->stats;
+    t_depth = 0;
+#endif
+
     result = bsdiff_internal(req);
 
+#if defined(BSDIFF_STATS)
+    t_stats = NULL;
+#endif
+
     stream->free(req.buffer);
     stream->free(req.I);
 
     return result;
 }
 
+size_t bsdiff_mem_estimate(int32_t oldsize, int32_t newsize)
+{
+    return 2 * ((size_t)oldsize + 1) * sizeof(int32_t) + (size_t)newsize + 1;
+}
 
-//#define BSDIFF_EXECUTABLE
 
-#if defined(BSDIFF_EXECUTABLE)
+/* in-place: bsdiff() runs into a collector that keeps only the control
+   tuples, the data bytes are recomputed from old and new when writing */
+typedef struct
+{
+    int32_t newpos;
+    int32_t oldpos;
+    int32_t len;
+    int32_t type;
+} bsdiff_op;
 
-#include <stdarg.h>
-#include <stdio.h>
-#include "../lzma/LzmaUtil/LzmaUtil.h"
+/* in-place: part of an op's range given up to a literal, which breaks the
+   cycle through the op that overwrites the old bytes it read */
+typedef struct
+{
+    int32_t off;
+    int32_t len;
+    int32_t next;   /* of the same op, in the order its pieces are written */
+} bsdiff_cut;
 
-//#define errx err
-void err(int exitcode, const char *fmt, ...)
+typedef struct
 {
-    va_list valist;
-    va_start(valist, fmt);
-    vprintf(fmt, valist);
-    va_end(valist);
-    exit(exitcode);
+    struct bsdiff_stream *outer;
+    bsdiff_op *ops;
+    int32_t count;
+    int32_t cap;
+    int32_t oldsize;
+    int32_t newpos;
+    int32_t oldpos;
+    uint8_t ctrl[24];
+    int32_t ctrlLen;
+    int64_t skip;
+} bsdiff_collect;
+
+static int add_op(bsdiff_collect *c, int32_t newpos, int32_t oldpos, int32_t len, int32_t type)
+{
+    bsdiff_op *op;
+
+    if(len <= 0)
+        return 0;
+
+    /* neighbouring literals are one op */
+    op = c->count ? &c->ops[c->count - 1] : NULL;
+    if(op && type == BSDIFF_OP_LITERAL && op->type == BSDIFF_OP_LITERAL &&
+            op->newpos + op->len == newpos)
+    {
+        op->len += len;
+        return 0;
+    }
+
+    if(c->count == c->cap)
+    {
+        int32_t cap = c->cap ? c->cap * 2 : 1024;
+        bsdiff_op *p;
+
+        bsmem_tag(BSMEM_DIFF);
+        p = c->outer->malloc(cap * sizeof(bsdiff_op));
+
+        if(p == NULL)
+            return -1;
+
+        if(c->count)
+            memcpy(p, c->ops, c->count * sizeof(bsdiff_op));
+
+        c->outer->free(c->ops);
+        c->ops = p;
+        c->cap = cap;
+    }
+
+    op = &c->ops[c->count++];
+    op->newpos = newpos;
+    op->oldpos = oldpos;
+    op->len = len;
+    op->type = type;
+
+    return 0;
 }
 
-static int lzma_write(struct bsdiff_stream *stream, const void *buffer, int size)
+/* one control tuple: the part of the diff window outside old is literal */
+static int add_tuple(bsdiff_collect *c, int32_t x, int32_t y, int32_t z)
 {
-    memcpy(stream->opaque + stream->size, buffer, size);
-    stream->size += size;
+    int32_t n = c->newpos, o = c->oldpos, lo, hi;
+
+    lo = o < 0 ? -o : 0;
+    hi = c->oldsize - o;
+    if(lo > x) lo = x;
+    if(hi > x) hi = x;
+    if(hi < lo) hi = lo;
+
+    if(add_op(c, n, 0, lo, BSDIFF_OP_LITERAL) ||
+            add_op(c, n + lo, o + lo, hi - lo, BSDIFF_OP_FORWARD) ||
+            add_op(c, n + hi, 0, x - hi, BSDIFF_OP_LITERAL) ||
+            add_op(c, n + x, 0, y, BSDIFF_OP_LITERAL))
+        return -1;
+
+    c->newpos += x + y;
+    c->oldpos += x + z;
 
     return 0;
 }
 
-static int read_finfo(const char *f, unsigned char **p, int32_t *size)
+static int collect_write(struct bsdiff_stream *stream, const void *buffer, int size)
 {
-    FILE *fs;
-    int32_t len;
-    unsigned char *pf = NULL;
+    bsdiff_collect *c = stream->opaque;
+    const uint8_t *p = buffer;
+    int n;
 
-    /* Allocate oldsize+1 bytes instead of oldsize bytes to ensure
-    	that we never try to malloc(0) and get a NULL pointer */
-    fs = fopen(f, "rb");
+    while(size > 0)
+    {
+        if(c->skip > 0)
+        {
+            n = c->skip < size ? (int)c->skip : size;
+            c->skip -= n;
+        }
+        else
+        {
+            n = MIN(24 - c->ctrlLen, size);
+            memcpy(c->ctrl + c->ctrlLen, p, n);
+            c->ctrlLen += n;
 
-    if(fs == NULL)errx(1, "Open failed :%s", f);
+            if(c->ctrlLen == 24)
+            {
+                int32_t x = bshdr_get64(c->ctrl), y = bshdr_get64(c->ctrl + 8);
 
-    if(fseek(fs, 0, SEEK_END) != 0)errx(1, "Seek failed :%s", f);
+                if(add_tuple(c, x, y, bshdr_get64(c->ctrl + 16)))
+                    return -1;
 
-    len = ftell(fs);
+                c->skip = (int64_t)x + y;
+                c->ctrlLen = 0;
+            }
+        }
 
-    if(size)
-        *size = len;
+        p += n;
+        size -= n;
+    }
 
-    if(p)
-    {
-        pf = (unsigned char *)malloc(len + 1);
+    return 0;
+}
 
-        if(pf == NULL)	errx(1, "Malloc failed :%s", f);
+static int collect_progress(struct bsdiff_stream *stream, int phase, uint64_t done, uint64_t total, uint64_t out)
+{
+    struct bsdiff_stream *outer = ((bsdiff_collect *)stream->opaque)->outer;
 
-        fseek(fs, 0, SEEK_SET);
+    return outer->progress(outer, phase, done, total, out);
+}
 
-        if(fread(pf, 1, len, fs) == 0)	errx(1, "Read failed :%s", f);
-        
-        *p = pf;
-    }
-    
-    if(fclose(fs) == -1)	errx(1, "Close failed :%s", f);
+/* index of the first op ending after pos; ops are sorted by newpos */
+static int32_t op_find(const bsdiff_op *ops, int32_t count, int32_t pos)
+{
+    int32_t lo = 0, hi = count;
+
+    while(lo < hi)
+    {
+        int32_t mid = lo + (hi - lo) / 2;
 
+        if(ops[mid].newpos + ops[mid].len <= pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
 
-    return len;
+    return lo;
 }
 
-static void set_header(unsigned char *header, int32_t oldsize, int32_t newsize, int32_t patchsize)
+static int write_op(struct bsdiff_stream *stream, const bsdiff_op *op)
 {
-    /* Header is
-    	0	8	 "BSDIFF40"
-    	8	8	length of old file
-    	16	8	length of new file
-    	24	8	length of patch file */
+    uint8_t rec[32];
 
-    memcpy(header, "BSDIFF40", 8);
-    offtout(oldsize, header + 8);
-    offtout(newsize, header + 16);
-    offtout(patchsize, header + 24);
+    offtout(op->newpos, rec);
+    offtout(op->oldpos, rec + 8);
+    offtout(op->len, rec + 16);
+    offtout(op->type, rec + 24);
+
+    return writedata(stream, rec, sizeof(rec)) < 0 ? -1 : 0;
 }
 
-static int patch_write(const char *fp, unsigned char *data, int32_t size, int32_t offset)
+static int write_diff(struct bsdiff_stream *stream, const bsdiff_op *op,
+                      const uint8_t *pold, const uint8_t *pnew)
 {
-    FILE *fs;
-    /* Create and write the temp patch file */
-    if(offset == -1)
+    uint8_t buf[4096];
+    int32_t i, k, n;
+
+    for(k = 0; k < op->len; k += n)
     {
-        if((fs = fopen(fp, "wb+")) == NULL)
-            errx(1, "Open failed (%s)", fp);
+        n = MIN(op->len - k, (int32_t)sizeof(buf));
+
+        if(op->type == BSDIFF_OP_BACKWARD)
+        {
+            /* k counts from the end of the range */
+            for(i = 0; i < n; i++)
+            {
+                int32_t at = op->len - 1 - k - i;
+                buf[i] = pnew[op->newpos + at] - pold[op->oldpos + at];
+            }
+        }
+        else
+        {
+            for(i = 0; i < n; i++)
+                buf[i] = pnew[op->newpos + k + i] - pold[op->oldpos + k + i];
+        }
+
+        if(writedata(stream, buf, n) < 0)
+            return -1;
     }
-    else
+
+    return 0;
+}
+
+/* an op moving up is written from its end, so are its pieces */
+static int op_up(const bsdiff_op *op)
+{
+    return op->oldpos < op->newpos;
+}
+
+/* writes |part| bytes of |op| from |off| as an op of their own */
+static int write_part(struct bsdiff_stream *stream, const bsdiff_op *op, int32_t off, int32_t len,
+                      const uint8_t *pold, const uint8_t *pnew)
+{
+    bsdiff_op part;
+
+    if(len == 0)
+        return 0;
+
+    part.newpos = op->newpos + off;
+    part.oldpos = op->oldpos + off;
+    part.len = len;
+    part.type = BSDIFF_OP_FORWARD;
+
+    /* a range moving up is copied from its end */
+    if(part.oldpos < part.newpos && part.oldpos + len > part.newpos)
+        part.type = BSDIFF_OP_BACKWARD;
+
+    return write_op(stream, &part) || write_diff(stream, &part, pold, pnew) ? -1 : 0;
+}
+
+/* writes |op| without its cuts, which go to |lits| */
+static int write_pieces(struct bsdiff_stream *stream, const bsdiff_op *op, const bsdiff_cut *cuts,
+                        int32_t c, const uint8_t *pold, const uint8_t *pnew,
+                        bsdiff_op *lits, int32_t *nlits)
+{
+    int32_t pos = 0, end = op->len;
+
+    for(; c >= 0; c = cuts[c].next)
     {
-        if((fs = fopen(fp, "rb+")) == NULL)
-            errx(1, "Open failed (%s)", fp);
-        
-        if(fseek(fs, offset, SEEK_SET) != 0)
-            errx(1, "offset failed (%s)", fp);
+        if(op_up(op) ? write_part(stream, op, cuts[c].off + cuts[c].len, end - cuts[c].off - cuts[c].len, pold, pnew) :
+                       write_part(stream, op, pos, cuts[c].off - pos, pold, pnew))
+            return -1;
+
+        if(op_up(op))
+            end = cuts[c].off;
+        else
+            pos = cuts[c].off + cuts[c].len;
+
+        lits[*nlits].newpos = op->newpos + cuts[c].off;
+        lits[*nlits].oldpos = 0;
+        lits[*nlits].len = cuts[c].len;
+        lits[*nlits].type = BSDIFF_OP_LITERAL;
+        (*nlits)++;
     }
 
-    if(fwrite(data, size, 1, fs) != 1)
-        errx(1, "fwrite failed (%s)", fp);
+    return write_part(stream, op, pos, end - pos, pold, pnew);
+}
 
-    if(fclose(fs))
-        errx(1, "fclose failed (%s)", fp);
+static int by_newpos(const void *a, const void *b)
+{
+    const bsdiff_op *x = a, *y = b;
 
-    return 0;
+    return x->newpos < y->newpos ? -1 : x->newpos > y->newpos;
 }
 
-int main(int argc, char *argv[])
+int bsdiff_inplace(const uint8_t *pold, int32_t oldsize, const uint8_t *pnew, int32_t newsize, struct bsdiff_stream *stream)
 {
-    const char *tmp_patch = "tmp_patch";
-    unsigned char header[32];
-    unsigned char *pold, *pnew, *ppatch;
-    int32_t oldsize, newsize, patchsize;
-    int32_t len;
+    bsdiff_collect c;
+    struct bsdiff_stream cs;
+    bsdiff_op *ops, *lits = NULL, lit;
+    bsdiff_cut *cuts = NULL;
+    int32_t *indeg = NULL, *first = NULL, *edges = NULL, *queue = NULL;
+    int32_t *src = NULL, *rfirst = NULL, *redges = NULL, *via = NULL, *mark = NULL, *cut = NULL;
+    int32_t count, i, j, e, head, tail, pending, ncuts = 0, nlits = 0, scan = 0, stamp = 0;
+    int result = -1;
+
+    memset(&c, 0, sizeof(c));
+    c.outer = stream;
+    c.oldsize = oldsize;
+
+    cs = *stream;
+    cs.opaque = &c;
+    cs.write = collect_write;
+    if(stream->progress)
+        cs.progress = collect_progress;
+
+    if(bsdiff(pold, oldsize, pnew, newsize, &cs))
+    {
+        stream->free(c.ops);
+        return -1;
+    }
 
-    struct bsdiff_stream stream;
+    ops = c.ops;
+    count = c.count;
 
-    if(argc != 4) errx(1, "usage: %s oldfile newfile patchfile\n", argv[0]);
+    TRACE_BEGIN("inplace_order");
 
-    read_finfo(argv[1], &pold, &oldsize);
-    read_finfo(argv[2], &pnew, &newsize);
+    /* edge a -> b when a reads old bytes that b overwrites, so a goes first.
+       Writes are disjoint and sorted, each read range finds its writers by
+       binary search. */
+    bsmem_tag(BSMEM_DIFF);
+    indeg = stream->malloc((count + 1) * sizeof(int32_t));
+    first = stream->malloc((count + 2) * sizeof(int32_t));
+    queue = stream->malloc((count + 1) * sizeof(int32_t));
+    if(indeg == NULL || first == NULL || queue == NULL)
+        goto out;
 
-    len = LZMA_PROPS_SIZE + newsize + newsize / 3 + 128;
-    ppatch = (unsigned char *)malloc(len);
-    assert(ppatch != NULL);
+    memset(indeg, 0, (count + 1) * sizeof(int32_t));
+    first[0] = 0;
 
-    stream.malloc = malloc;
-    stream.free = free;
-    stream.write = lzma_write;
-    stream.opaque = ppatch;
-    stream.size = 0;
+    for(i = 0; i < count; i++)
+    {
+        e = 0;
+        if(ops[i].type != BSDIFF_OP_LITERAL)
+        {
+            for(j = op_find(ops, count, ops[i].oldpos);
+                    j < count && ops[j].newpos < ops[i].oldpos + ops[i].len; j++)
+                if(j != i && ops[j].type != BSDIFF_OP_LITERAL)
+                    e++;
+        }
+        first[i + 1] = first[i] + e;
+    }
 
-    if(bsdiff(pold, oldsize, pnew, newsize, &stream))
-        errx(1, "bsdiff error !!!");
+    /* per edge its reader, per op the edges into it; every edge is cut at
+       most once, so |cuts| never needs to grow */
+    edges = stream->malloc((first[count] + 1) * sizeof(int32_t));
+    src = stream->malloc((first[count] + 1) * sizeof(int32_t));
+    redges = stream->malloc((first[count] + 1) * sizeof(int32_t));
+    cuts = stream->malloc((first[count] + 1) * sizeof(bsdiff_cut));
+    lits = stream->malloc((count + first[count] + 1) * sizeof(bsdiff_op));
+    rfirst = stream->malloc((count + 2) * sizeof(int32_t));
+    via = stream->malloc((count + 1) * sizeof(int32_t));
+    mark = stream->malloc((count + 1) * sizeof(int32_t));
+    cut = stream->malloc((count + 1) * sizeof(int32_t));
+    if(edges == NULL || src == NULL || redges == NULL || cuts == NULL || lits == NULL ||
+            rfirst == NULL || via == NULL || mark == NULL || cut == NULL)
+        goto out;
+
+    for(i = 0; i < count; i++)
+    {
+        if(ops[i].type == BSDIFF_OP_LITERAL)
+            continue;
+
+        e = first[i];
+        for(j = op_find(ops, count, ops[i].oldpos);
+                j < count && ops[j].newpos < ops[i].oldpos + ops[i].len; j++)
+        {
+            if(j != i && ops[j].type != BSDIFF_OP_LITERAL)
+            {
+                src[e] = i;
+                edges[e++] = j;
+                indeg[j]++;
+            }
+        }
+    }
 
-    patch_write(tmp_patch, ppatch, stream.size, -1);
+    rfirst[0] = 0;
+    for(i = 0; i < count; i++)
+    {
+        rfirst[i + 1] = rfirst[i] + indeg[i];
+        via[i] = rfirst[i];
+        mark[i] = 0;
+        cut[i] = -1;
+    }
 
-    free(pold);
-    free(pnew);
-    free(ppatch);
+    for(e = 0; e < first[count]; e++)
+        redges[via[edges[e]]++] = e;
 
-    if(lzma_encode(argv[3], tmp_patch))
-        errx(1, "lzma error !!!");
+    /* Kahn's order. An edge is gone (-1) once its reader is written or the
+       edge is cut. When only cycles are left, the cheapest edge of one is
+       cut: the bytes of the reader that the other op overwrites become a
+       literal, the rest of the reader stays a diff. */
+    head = tail = 0;
+    pending = 0;
+    for(i = 0; i < count; i++)
+    {
+        if(ops[i].type == BSDIFF_OP_LITERAL)
+            continue;
 
-    read_finfo(argv[3], &ppatch, &patchsize);
-    set_header(header, oldsize, newsize, patchsize);
-    
-    patch_write(argv[3], header, sizeof(header), -1);
-    patch_write(argv[3], ppatch, patchsize, sizeof(header));
-    
-    free(ppatch);
+        via[i] = rfirst[i];
+
+        if(indeg[i] == 0)
+            queue[tail++] = i;
+        else
+            pending++;
+    }
+
+    while(head < tail || pending > 0)
+    {
+        int32_t a, x, y, best, ov, bestov, off, *link;
+
+        if(head < tail)
+        {
+            a = queue[head++];
+
+            if(write_pieces(stream, &ops[a], cuts, cut[a], pold, pnew, lits, &nlits))
+                goto out;
+
+            for(e = first[a]; e < first[a + 1]; e++)
+            {
+                if((j = edges[e]) >= 0 && --indeg[j] == 0)
+                {
+                    queue[tail++] = j;
+                    pending--;
+                }
+
+                edges[e] = -1;
+            }
+
+            continue;
+        }
+
+        /* every op left waits for another: walking back along the edges
+           that hold each one up has to come round to an op seen before */
+        while(ops[scan].type == BSDIFF_OP_LITERAL || indeg[scan] == 0)
+            scan++;
+
+        stamp++;
+        for(x = scan; mark[x] != stamp; x = src[redges[via[x]]])
+        {
+            mark[x] = stamp;
+
+            /* gone edges stay gone, the search resumes where it stopped */
+            while(edges[redges[via[x]]] < 0)
+                via[x]++;
+        }
+
+        /* the cycle through x, and its edge with the fewest bytes in common */
+        best = -1;
+        bestov = 0;
+        y = x;
+        do
+        {
+            e = redges[via[y]];
+            a = src[e];
+            ov = MIN(ops[a].oldpos + ops[a].len, ops[y].newpos + ops[y].len) - MAX(ops[a].oldpos, ops[y].newpos);
+
+            if(best < 0 || ov < bestov)
+            {
+                best = e;
+                bestov = ov;
+            }
+
+            y = a;
+        }
+        while(y != x);
+
+        /* the reader gives up those bytes, kept in writing order */
+        a = src[best];
+        y = edges[best];
+        off = MAX(ops[a].oldpos, ops[y].newpos) - ops[a].oldpos;
+
+        for(link = &cut[a];
+                *link >= 0 && (op_up(&ops[a]) ? cuts[*link].off > off : cuts[*link].off < off);
+                link = &cuts[*link].next)
+            ;
+
+        cuts[ncuts].off = off;
+        cuts[ncuts].len = bestov;
+        cuts[ncuts].next = *link;
+        *link = ncuts++;
+
+        edges[best] = -1;
+        if(--indeg[y] == 0)
+        {
+            queue[tail++] = y;
+            pending--;
+        }
+    }
+
+    /* literals last, neighbours merged */
+    for(i = 0; i < count; i++)
+        if(ops[i].type == BSDIFF_OP_LITERAL)
+            lits[nlits++] = ops[i];
+
+    qsort(lits, nlits, sizeof(*lits), by_newpos);
+
+    lit.len = 0;
+    for(i = 0; i <= nlits; i++)
+    {
+        if(i < nlits && lit.len && lit.newpos + lit.len == lits[i].newpos)
+        {
+            lit.len += lits[i].len;
+            continue;
+        }
+
+        if(lit.len && (write_op(stream, &lit) || writedata(stream, pnew + lit.newpos, lit.len) < 0))
+            goto out;
+
+        if(i < nlits)
+            lit = lits[i];
+        lit.oldpos = 0;
+    }
+
+    result = 0;
+
+out:
+    TRACE_END("inplace_order");
+    stream->free(cut);
+    stream->free(mark);
+    stream->free(via);
+    stream->free(rfirst);
+    stream->free(lits);
+    stream->free(cuts);
+    stream->free(redges);
+    stream->free(src);
+    stream->free(edges);
+    stream->free(queue);
+    stream->free(first);
+    stream->free(indeg);
+    stream->free(c.ops);
+
+    return result;
+}
+
+
+/* composition: the first patch as a map of the middle image, each piece
+   either diff bytes over old, extra bytes or a fill */
+typedef struct
+{
+    int32_t mid;        /* start in the middle image */
+    int32_t len;
+    int32_t old;        /* diff: position in old, extra and fill: -1 */
+    int32_t fill;       /* data is one byte standing for all len */
+    const uint8_t *data;
+} compose_seg;
+
+/* diff bytes over a fill that leave a run this long stay a fill */
+#define COMPOSE_MIN_FILL 64
+
+/* the composed patch, one tuple held back until the next diff says where
+   old continues */
+typedef struct
+{
+    struct bsdiff_stream *stream;
+    uint8_t *buf;       /* diff bytes, then extra bytes */
+    int32_t start;      /* old position of the diff bytes */
+    int32_t diff;
+    int32_t extra;
+} compose_out;
+
+/* parses a raw patch of |newsize| bytes; with |segs| NULL only counts */
+static int32_t compose_map(const uint8_t *p, size_t size, int32_t newsize, compose_seg *segs)
+{
+    int32_t newpos = 0, oldpos = 0, count = 0, ctrl[3], len[2], i, fill;
+    size_t pos = 0;
+
+    while(newpos < newsize)
+    {
+        if(size - pos < 24)
+            return -1;
+
+        for(i = 0; i <= 2; i++)
+            if((ctrl[i] = bshdr_get64(p + pos + 8 * i)) == BSHDR_BAD)
+                return -1;
+        pos += 24;
+
+        /* extra of -n: a fill of n, one byte in the stream */
+        fill = ctrl[1] < 0;
+        len[0] = ctrl[0];
+        len[1] = fill ? -ctrl[1] : ctrl[1];
+
+        if(ctrl[0] < 0 || len[1] < 0 || ctrl[0] > newsize - newpos ||
+                len[1] > newsize - newpos - ctrl[0] ||
+                (size_t)ctrl[0] + (fill ? 1 : len[1]) > size - pos)
+            return -1;
+
+        for(i = 0; i <= 1; i++)
+        {
+            if(len[i] == 0)
+                continue;
+
+            if(segs)
+            {
+                segs[count].mid = newpos;
+                segs[count].len = len[i];
+                segs[count].old = i == 0 ? oldpos : -1;
+                segs[count].fill = i == 1 && fill;
+                segs[count].data = p + pos;
+            }
+
+            count++;
+            newpos += len[i];
+            pos += i == 1 && fill ? 1 : len[i];
+        }
+
+        oldpos += ctrl[0] + ctrl[2];
+    }
+
+    return count;
+}
+
+static int compose_flush(compose_out *o, int32_t next)
+{
+    uint8_t ctrl[24];
+
+    offtout(o->diff, ctrl);
+    offtout(o->extra, ctrl + 8);
+    offtout(next - (o->start + o->diff), ctrl + 16);
+
+    if(writedata(o->stream, ctrl, sizeof(ctrl)) ||
+            writedata(o->stream, o->buf, o->diff + o->extra))
+        return -1;
+
+    o->start = next;
+    o->diff = 0;
+    o->extra = 0;
+
+    return 0;
+}
+
+/* |len| copies of |byte|, as a fill tuple after whatever is held back */
+static int compose_fill(compose_out *o, uint8_t byte, int32_t len)
+{
+    uint8_t ctrl[25];
+
+    if((o->diff || o->extra) && compose_flush(o, o->start + o->diff))
+        return -1;
+
+    offtout(0, ctrl);
+    offtout(-len, ctrl + 8);
+    offtout(0, ctrl + 16);
+    ctrl[24] = byte;
+
+    return writedata(o->stream, ctrl, sizeof(ctrl)) ? -1 : 0;
+}
+
+/* the last segment starting at or before |mid| */
+static const compose_seg *compose_find(const compose_seg *segs, int32_t count, int32_t mid)
+{
+    int32_t lo = 0, hi = count - 1, m;
+
+    while(lo < hi)
+    {
+        m = lo + (hi - lo + 1) / 2;
+        if(segs[m].mid <= mid)
+            lo = m;
+        else
+            hi = m - 1;
+    }
+
+    return &segs[lo];
+}
+
+int bsdiff_compose(const uint8_t *first, size_t firstsize, int32_t midsize,
+                   const uint8_t *second, size_t secondsize, int32_t newsize,
+                   struct bsdiff_stream *stream)
+{
+    compose_seg *segs = NULL;
+    const compose_seg *seg;
+    compose_out o;
+    const uint8_t *b;
+    int32_t count, newpos = 0, oldpos = 0, ctrl[3], extra, i, j, n, at;
+    size_t pos = 0;
+    int result = -1, fill;
+
+    if((count = compose_map(first, firstsize, midsize, NULL)) < 0)
+        return -1;
+
+    TRACE_BEGIN("compose");
+
+    bsmem_tag(BSMEM_DIFF);
+    segs = stream->malloc((count + 1) * sizeof(*segs));
+    o.buf = stream->malloc(newsize + 1);
+    o.stream = stream;
+    o.start = 0;
+    o.diff = 0;
+    o.extra = 0;
+
+    if(segs == NULL || o.buf == NULL)
+        goto out;
+
+    compose_map(first, firstsize, midsize, segs);
+
+    while(newpos < newsize)
+    {
+        if(secondsize - pos < 24)
+            goto out;
+
+        for(i = 0; i <= 2; i++)
+            if((ctrl[i] = bshdr_get64(second + pos + 8 * i)) == BSHDR_BAD)
+                goto out;
+        pos += 24;
+
+        fill = ctrl[1] < 0;
+        extra = fill ? -ctrl[1] : ctrl[1];
+
+        if(ctrl[0] < 0 || extra < 0 || ctrl[0] > newsize - newpos ||
+                extra > newsize - newpos - ctrl[0] ||
+                (size_t)ctrl[0] + (fill ? 1 : extra) > secondsize - pos)
+            goto out;
+
+        /* diff bytes of the second patch land on whatever made that part
+           of the middle image */
+        b = second + pos;
+        for(j = 0; j < ctrl[0]; j += n)
+        {
+            at = oldpos + j;
+            n = ctrl[0] - j;
+            seg = NULL;
+
+            if(at < 0)
+                n = MIN(n, -at);
+            else if(at < midsize && count > 0)
+            {
+                seg = compose_find(segs, count, at);
+                n = MIN(n, seg->mid + seg->len - at);
+            }
+
+            if(seg && seg->old >= 0)
+            {
+                /* diff over diff: still a diff against old */
+                if(o.extra || o.start + o.diff != seg->old + (at - seg->mid))
+                    if(compose_flush(&o, seg->old + (at - seg->mid)))
+                        goto out;
+
+                for(i = 0; i < n; i++)
+                    o.buf[o.diff + i] = b[j + i] + seg->data[at - seg->mid + i];
+                o.diff += n;
+            }
+            else if(seg && seg->fill && n >= COMPOSE_MIN_FILL && memcmp(b + j, b + j + 1, n - 1) == 0)
+            {
+                /* one diff byte all over a fill: still a fill */
+                if(compose_fill(&o, (uint8_t)(b[j] + seg->data[0]), n))
+                    goto out;
+            }
+            else
+            {
+                /* over extra bytes, a fill or outside the middle image: literal */
+                for(i = 0; i < n; i++)
+                    o.buf[o.diff + o.extra + i] = b[j + i] +
+                        (seg ? seg->data[seg->fill ? 0 : at - seg->mid + i] : 0);
+                o.extra += n;
+            }
+        }
+
+        if(fill)
+        {
+            if(extra && compose_fill(&o, second[pos + ctrl[0]], extra))
+                goto out;
+        }
+        else
+        {
+            memcpy(o.buf + o.diff + o.extra, second + pos + ctrl[0], extra);
+            o.extra += extra;
+        }
+
+        pos += ctrl[0] + (fill ? 1 : extra);
+        newpos += ctrl[0] + extra;
+        oldpos += ctrl[0] + ctrl[2];
+    }
+
+    if(compose_flush(&o, o.start + o.diff))
+        goto out;
+
+    result = 0;
+
+out:
+    TRACE_END("compose");
+    stream->free(o.buf);
+    stream->free(segs);
+
+    return result;
+}
+
+//#define BSDIFF_EXECUTABLE
+
+#if defined(BSDIFF_EXECUTABLE)
+
+#include <stdarg.h>
+#include <stdio.h>
+#include "../lzma/LzmaUtil/LzmaUtil.h"
+#include "../lzma/LzmaUtil/bsaes.h"
+#include "../lzma/LzmaUtil/bsbundle.h"
+#include "../lzma/LzmaUtil/bsseek.h"
+#include "../lzma/LzmaUtil/bsseg.h"
+#include "../lzma/Sha256.h"
+#include "../lzma/Threads.h"
+#ifdef _WIN32
+#include <windows.h>
+#include <bcrypt.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/* -S finds holes with lseek; without it there is no -S */
+#if defined(SEEK_HOLE) && defined(SEEK_DATA)
+#define BSDIFF_SPARSE
+#endif
+
+//#define errx err
+void err(int exitcode, const char *fmt, ...)
+{
+    va_list valist;
+    va_start(valist, fmt);
+    vprintf(fmt, valist);
+    va_end(valist);
+    exit(exitcode);
+}
+
+/* the raw patch in memory, grows as bsdiff writes */
+typedef struct
+{
+    unsigned char *data;
+    uint32_t cap;
+} patchbuf_t;
+
+static int lzma_write(struct bsdiff_stream *stream, const void *buffer, int size)
+{
+    patchbuf_t *b = stream->opaque;
+
+    if(stream->size + size > b->cap)
+    {
+        uint32_t cap = b->cap * 2 > stream->size + size ? b->cap * 2 : stream->size + size;
+        unsigned char *p = bsmem_realloc(b->data, cap);
+
+        if(p == NULL)
+            return -1;
+
+        b->data = p;
+        b->cap = cap;
+    }
+
+    memcpy(b->data + stream->size, buffer, size);
+    stream->size += size;
+
+    return 0;
+}
+
+static int print_progress(struct bsdiff_stream *stream, int phase, uint64_t done, uint64_t total, uint64_t out)
+{
+    static const char *const names[] = { "sort", "scan", "lzma" };
+
+    UNUSED_VAR(stream);
+    UNUSED_VAR(out);
+
+    fprintf(stderr, "\r%s %3u%%", names[phase], total ? (unsigned)(done * 100 / total) : 100);
+    return 0;
+}
+
+#if defined(BSDIFF_STATS)
+static void print_stats(const struct bsdiff_stats *st)
+{
+    int b, last = 0;
+
+    printf("search %llu calls, %llu bytes compared\n", (unsigned long long)st->search_calls,
+           (unsigned long long)st->compared_bytes);
+    printf("sort %u passes, split depth %u\n", st->sort_passes, st->split_depth);
+    printf("tuples %llu, diff %llu bytes, extra %llu bytes\n", (unsigned long long)st->tuples,
+           (unsigned long long)st->diff_bytes, (unsigned long long)st->extra_bytes);
+
+    for(b = 0; b < BSDIFF_HIST_BUCKETS; b++)
+        if(st->diff_hist[b] || st->extra_hist[b])
+            last = b;
+
+    printf("%12s %12s %12s\n", "length <", "diff", "extra");
+    for(b = 0; b <= last; b++)
+        printf("%12lu %12llu %12llu\n", b ? 1UL << b : 1UL,
+               (unsigned long long)st->diff_hist[b], (unsigned long long)st->extra_hist[b]);
+}
+#endif
+
+#define READ_CHUNK (1 << 20)
+
+/* |sha|, if given, hashes the file chunk by chunk as it comes in */
+static int read_finfo(const char *f, unsigned char **p, int32_t *size, CSha256 *sha)
+{
+    FILE *fs;
+    int32_t len, pos;
+    unsigned char *pf = NULL;
+
+    /* Allocate oldsize+1 bytes instead of oldsize bytes to ensure
+    	that we never try to malloc(0) and get a NULL pointer */
+    fs = fopen(f, "rb");
+
+    if(fs == NULL)errx(1, "Open failed :%s", f);
+
+    if(fseek(fs, 0, SEEK_END) != 0)errx(1, "Seek failed :%s", f);
+
+    len = ftell(fs);
+
+    if(size)
+        *size = len;
+
+    if(p)
+    {
+        pf = (unsigned char *)bsmem_alloc(BSMEM_IMAGE, len + 1);
+
+        if(pf == NULL)	errx(1, "Malloc failed :%s", f);
+
+        fseek(fs, 0, SEEK_SET);
+
+        TRACE_BEGIN("read");
+        for(pos = 0; pos < len; )
+        {
+            size_t n = fread(pf + pos, 1, MIN(len - pos, READ_CHUNK), fs);
+
+            if(n == 0)	errx(1, "Read failed :%s", f);
+
+            if(sha)
+                Sha256_Update(sha, pf + pos, n);
+
+            pos += (int32_t)n;
+        }
+        TRACE_END("read");
+        
+        *p = pf;
+    }
+    
+    if(fclose(fs) == -1)	errx(1, "Close failed :%s", f);
+
+
+    return len;
+}
+
+/* runs of this many equal bytes or more are fills with -f */
+#define FILL_MIN_RUN 1024
+
+/* -S/-f: a hole of a sparse file or a run of one byte, left out of the image */
+typedef struct
+{
+    int32_t pos;    /* in the file */
+    int32_t len;
+    int32_t at;     /* in the image, where the data after it starts */
+    unsigned char byte;
+} hole_t;
+
+static void add_hole(hole_t **holes, int32_t *count, int32_t *cap, int32_t pos, int32_t len,
+                     int32_t at, unsigned char byte)
+{
+    if(*count == *cap)
+    {
+        *cap = *cap ? *cap * 2 : 64;
+        *holes = *holes ? bsmem_realloc(*holes, *cap * sizeof(hole_t)) :
+                          bsmem_alloc(BSMEM_OTHER, *cap * sizeof(hole_t));
+        if(*holes == NULL)
+            errx(1, "Malloc failed\n");
+    }
+
+    (*holes)[*count].pos = pos;
+    (*holes)[*count].len = len;
+    (*holes)[*count].at = at;
+    (*holes)[*count].byte = byte;
+    (*count)++;
+}
+
+#if defined(BSDIFF_SPARSE)
+/* hashes |len| zero bytes */
+static void sha_zeros(CSha256 *sha, int32_t len)
+{
+    static const unsigned char zeros[4096];
+
+    for(; len > 0; len -= MIN(len, (int32_t)sizeof(zeros)))
+        Sha256_Update(sha, zeros, MIN(len, (int32_t)sizeof(zeros)));
+}
+#endif
+
+/* read_finfo for sparse files: only the data extents SEEK_DATA/SEEK_HOLE
+   report are read, holes stay zero pages nobody touches. Given |holes|,
+   the image holds only the data, |holes| says where the rest was and
+   |datasize| how much data there is. Without SEEK_HOLE it is read_finfo
+   and finds no holes. */
+static void read_sparse(const char *f, unsigned char **p, int32_t *size, int32_t *datasize,
+                        CSha256 *sha, hole_t **holes, int32_t *count)
+{
+#if defined(BSDIFF_SPARSE)
+    unsigned char *pf;
+    off_t len, pos = 0, data, end;
+    int32_t used = 0, cap = 0;
+    int fd;
+
+    if((fd = open(f, O_RDONLY)) < 0)
+        errx(1, "Open failed :%s", f);
+
+    if((len = lseek(fd, 0, SEEK_END)) < 0 || len >= INT32_MAX)
+        errx(1, "Seek failed :%s", f);
+
+    pf = holes ? bsmem_alloc(BSMEM_IMAGE, len + 1) : bsmem_calloc(BSMEM_IMAGE, len + 1);
+    if(pf == NULL)
+        errx(1, "Malloc failed :%s", f);
+
+    if(holes)
+    {
+        *holes = NULL;
+        *count = 0;
+    }
+
+    TRACE_BEGIN("read");
+    while(pos < len)
+    {
+        /* ENXIO: nothing but a hole up to the end */
+        if((data = lseek(fd, pos, SEEK_DATA)) < 0)
+        {
+            if(errno != ENXIO)
+                errx(1, "Seek failed :%s", f);
+
+            data = len;
+        }
+
+        if(data > pos)
+        {
+            if(sha)
+                sha_zeros(sha, (int32_t)(data - pos));
+
+            if(holes)
+                add_hole(holes, count, &cap, (int32_t)pos, (int32_t)(data - pos), used, 0);
+        }
+
+        if(data == len)
+            break;
+
+        if((end = lseek(fd, data, SEEK_HOLE)) < 0)
+            errx(1, "Seek failed :%s", f);
+
+        /* compacted, data lands after the data before it */
+        for(pos = data; pos < end; )
+        {
+            unsigned char *dst = pf + (holes ? used : (int32_t)pos);
+            ssize_t n = pread(fd, dst, MIN(end - pos, READ_CHUNK), pos);
+
+            if(n <= 0)
+                errx(1, "Read failed :%s", f);
+
+            if(sha)
+                Sha256_Update(sha, dst, n);
+
+            pos += n;
+            used += (int32_t)n;
+        }
+    }
+    TRACE_END("read");
+
+    close(fd);
+
+    *p = pf;
+    *size = (int32_t)len;
+    if(datasize)
+        *datasize = holes ? used : (int32_t)len;
+#else
+    read_finfo(f, p, size, sha);
+
+    if(datasize)
+        *datasize = *size;
+
+    if(holes)
+    {
+        *holes = NULL;
+        *count = 0;
+    }
+#endif
+}
+
+/* reads |size| bytes of |f| to |dst|, hashing them into both digests */
+static void read_member(const char *f, unsigned char *dst, uint32_t size, CSha256 *a, CSha256 *b)
+{
+    FILE *fs;
+    uint32_t pos;
+
+    if((fs = fopen(f, "rb")) == NULL)
+        errx(1, "Open failed :%s", f);
+
+    for(pos = 0; pos < size; )
+    {
+        size_t n = fread(dst + pos, 1, MIN(size - pos, READ_CHUNK), fs);
+
+        if(n == 0)
+            errx(1, "Read failed :%s", f);
+
+        Sha256_Update(a, dst + pos, n);
+        Sha256_Update(b, dst + pos, n);
+        pos += (uint32_t)n;
+    }
+
+    /* the file must not have grown since the scan */
+    if(fgetc(fs) != EOF)
+        errx(1, "File changed :%s", f);
+
+    fclose(fs);
+}
+
+typedef struct
+{
+    uint8_t sha[SHA256_DIGEST_SIZE];
+    uint32_t size;
+    const char *path;
+} digest_t;
+
+static int by_digest(const void *a, const void *b)
+{
+    const digest_t *x = a, *y = b;
+    int c = memcmp(x->sha, y->sha, SHA256_DIGEST_SIZE);
+
+    return c ? c : (x->size > y->size) - (x->size < y->size);
+}
+
+static uint32_t tree_size(const bsbundle_t *b)
+{
+    uint64_t total = 0;
+    size_t i;
+
+    for(i = 0; i < b->count; i++)
+        total += b->e[i].size;
+
+    if(total >= INT32_MAX)
+        errx(1, "Tree too large for one bundle\n");
+
+    return (uint32_t)total;
+}
+
+/* -b: old tree as one corpus, new files as one image. New files equal to
+   some old file (unchanged, renamed or copied) only get a manifest line. */
+static void read_tree(const char *olddir, const char *newdir, bsbundle_t *manifest,
+                      unsigned char **pold, int32_t *oldsize, unsigned char **pnew, int32_t *newsize,
+                      bshdr_t *hdr)
+{
+    char path[FILENAME_MAX];
+    bsbundle_t scan;
+    digest_t *digests, key, *hit;
+    CSha256 all, one;
+    uint32_t size, pos;
+    size_t i, count;
+
+    bsbundle_init(manifest);
+    bsbundle_init(&scan);
+
+    if(bsbundle_scan(manifest, olddir, BSBUNDLE_OLD))
+        errx(1, "Scan failed :%s", olddir);
+
+    if(bsbundle_scan(&scan, newdir, BSBUNDLE_NEW))
+        errx(1, "Scan failed :%s", newdir);
+
+    count = manifest->count;
+    size = tree_size(manifest);
+    *pold = bsmem_alloc(BSMEM_IMAGE, size + 1);
+    digests = bsmem_alloc(BSMEM_OTHER, (count + 1) * sizeof(*digests));
+
+    if(*pold == NULL || digests == NULL)
+        errx(1, "Malloc failed\n");
+
+    TRACE_BEGIN("read_tree");
+
+    Sha256_Init(&all);
+    for(i = 0, pos = 0; i < count; i++)
+    {
+        bsbundle_path(path, sizeof(path), olddir, manifest->e[i].path);
+
+        Sha256_Init(&one);
+        read_member(path, *pold + pos, manifest->e[i].size, &all, &one);
+        Sha256_Final(&one, digests[i].sha);
+
+        digests[i].size = manifest->e[i].size;
+        digests[i].path = manifest->e[i].path;
+        pos += manifest->e[i].size;
+    }
+    Sha256_Final(&all, hdr->oldsha);
+
+    *oldsize = (int32_t)size;
+    qsort(digests, count, sizeof(*digests), by_digest);
+
+    size = tree_size(&scan);
+    if((*pnew = bsmem_alloc(BSMEM_IMAGE, size + 1)) == NULL)
+        errx(1, "Malloc failed\n");
+
+    /* read each new file onto the end of the image and take it back off
+       if its content is already in old */
+    Sha256_Init(&all);
+    for(i = 0, pos = 0; i < scan.count; i++)
+    {
+        CSha256 keep = all;
+        const bsbundle_entry_t *e = &scan.e[i];
+
+        bsbundle_path(path, sizeof(path), newdir, e->path);
+
+        Sha256_Init(&one);
+        read_member(path, *pnew + pos, e->size, &all, &one);
+        Sha256_Final(&one, key.sha);
+        key.size = e->size;
+
+        hit = bsearch(&key, digests, count, sizeof(*digests), by_digest);
+
+        if(bsbundle_add(manifest, hit ? BSBUNDLE_COPY : BSBUNDLE_NEW, e->size, e->path,
+                        hit ? hit->path : NULL))
+            errx(1, "Malloc failed\n");
+
+        if(hit)
+            all = keep;
+        else
+            pos += e->size;
+    }
+    Sha256_Final(&all, hdr->newsha);
+
+    TRACE_END("read_tree");
+
+    *newsize = (int32_t)pos;
+
+    bsmem_free(digests);
+    bsbundle_free(&scan);
+}
+
+static int patch_write(const char *fp, unsigned char *data, int32_t size, int32_t offset)
+{
+    FILE *fs;
+    /* Create and write the temp patch file */
+    if(offset == -1)
+    {
+        if((fs = fopen(fp, "wb+")) == NULL)
+            errx(1, "Open failed (%s)", fp);
+    }
+    else
+    {
+        if((fs = fopen(fp, "rb+")) == NULL)
+            errx(1, "Open failed (%s)", fp);
+        
+        if(fseek(fs, offset, SEEK_SET) != 0)
+            errx(1, "offset failed (%s)", fp);
+    }
+
+    TRACE_BEGIN("write");
+    /* a bundle of nothing but copies has an empty raw patch */
+    if(size > 0 && fwrite(data, size, 1, fs) != 1)
+        errx(1, "fwrite failed (%s)", fp);
+    TRACE_END("write");
+
+    if(fclose(fs))
+        errx(1, "fclose failed (%s)", fp);
+
+    return 0;
+}
+
+#define AES_THREADS 4
+
+typedef struct
+{
+    const uint8_t *key;
+    unsigned keySize;
+    const uint8_t *nonce;
+    uint8_t *data;
+    uint64_t pos;
+    size_t size;
+} aes_job_t;
+
+static THREAD_FUNC_DECL aes_thread(void *param)
+{
+    aes_job_t *j = param;
+    bsaes_t a;
+
+    TRACE_THREAD("encrypt");
+    TRACE_BEGIN("encrypt");
+    bsaes_init(&a, j->key, j->keySize, j->nonce);
+    bsaes_code(&a, j->pos, j->data + j->pos, j->size);
+    TRACE_END("encrypt");
+
+    return THREAD_FUNC_RET_ZERO;
+}
+
+/* CTR blocks are independent, so each thread takes a contiguous slice */
+static void encrypt_payload(uint8_t *data, size_t size, const uint8_t *key, unsigned keySize,
+                            const uint8_t *nonce)
+{
+    aes_job_t jobs[AES_THREADS];
+    CThread threads[AES_THREADS];
+    size_t slice = (size / AES_THREADS + BSAES_CHUNK - 1) & ~(size_t)(BSAES_CHUNK - 1);
+    int n;
+
+    for(n = 0; n < AES_THREADS; n++)
+    {
+        jobs[n].key = key;
+        jobs[n].keySize = keySize;
+        jobs[n].nonce = nonce;
+        jobs[n].data = data;
+        jobs[n].pos = (uint64_t)slice * n;
+        jobs[n].size = jobs[n].pos >= size ? 0 : MIN(slice, size - (size_t)jobs[n].pos);
+
+        Thread_CONSTRUCT(&threads[n])
+        if(Thread_Create(&threads[n], aes_thread, &jobs[n]) != 0)
+            aes_thread(&jobs[n]);
+    }
+
+    for(n = 0; n < AES_THREADS; n++)
+        if(Thread_WasCreated(&threads[n]))
+            Thread_Wait_Close(&threads[n]);
+}
+
+static void read_key(const char *f, uint8_t *key, unsigned *keySize)
+{
+    FILE *fs = fopen(f, "rb");
+    size_t n;
+
+    if(fs == NULL)errx(1, "Open failed :%s", f);
+
+    n = fread(key, 1, 33, fs);
+    fclose(fs);
+
+    if(n != 16 && n != 24 && n != 32)
+        errx(1, "Key must be 16, 24 or 32 bytes :%s", f);
+
+    *keySize = (unsigned)n;
+}
+
+static void random_nonce(uint8_t *nonce)
+{
+#ifdef _WIN32
+    if(BCryptGenRandom(NULL, nonce, BSAES_NONCE_SIZE, BCRYPT_USE_SYSTEM_PREFERRED_RNG) != 0)
+        errx(1, "No random source\n");
+#else
+    FILE *fs = fopen("/dev/urandom", "rb");
+
+    if(fs == NULL || fread(nonce, BSAES_NONCE_SIZE, 1, fs) != 1)
+        errx(1, "No random source\n");
+
+    fclose(fs);
+#endif
+}
+
+/* what shapes the payload once the raw patch is there */
+typedef struct
+{
+    int autotune;
+    uint32_t budget;
+    uint32_t dictSize;
+    uint32_t segsize;
+    uint32_t blocksize;     /* -x: seekable patch, 0 for a plain one */
+    uint8_t key[32];
+    unsigned keySize;
+} encode_opts_t;
+
+/* -S: file position of image position |at|, and in |next| where the
+   next hole after it sits in the image */
+static int32_t hole_map(const hole_t *holes, int32_t count, int32_t at, int32_t *next)
+{
+    int32_t lo = 0, hi = count, mid;
+
+    /* the first hole past |at| */
+    while(lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+
+        if(holes[mid].at <= at)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if(next)
+        *next = lo < count ? holes[lo].at : INT32_MAX;
+
+    return lo ? holes[lo - 1].pos + holes[lo - 1].len + at - holes[lo - 1].at : at;
+}
+
+/* -f: runs of |minrun| or more equal bytes cut out of the image as holes
+   of that byte, on top of the |holes| it already has (-S) */
+static void strip_runs(unsigned char *p, int32_t *size, hole_t **holes, int32_t *count, int32_t minrun)
+{
+    hole_t *out = NULL;
+    int32_t i = 0, j, k = 0, stop, keep = 0, used = 0, n = 0, cap = 0;
+
+    TRACE_BEGIN("strip_runs");
+    for(;;)
+    {
+        /* what was kept so far moves down before anything is cut */
+        if((k < *count && (*holes)[k].at == i) || i == *size)
+        {
+            memmove(p + used, p + keep, i - keep);
+            used += i - keep;
+            keep = i;
+        }
+
+        while(k < *count && (*holes)[k].at == i)
+        {
+            add_hole(&out, &n, &cap, (*holes)[k].pos, (*holes)[k].len, used, (*holes)[k].byte);
+            k++;
+        }
+
+        if(i == *size)
+            break;
+
+        /* a run ends where a hole starts */
+        stop = k < *count ? (*holes)[k].at : *size;
+        for(j = i + 1; j < stop && p[j] == p[i]; j++)
+            ;
+
+        if(j - i >= minrun)
+        {
+            unsigned char byte = p[i];
+
+            memmove(p + used, p + keep, i - keep);
+            used += i - keep;
+            keep = j;
+
+            add_hole(&out, &n, &cap, hole_map(*holes, *count, i, NULL), j - i, used, byte);
+        }
+
+        i = j;
+    }
+    TRACE_END("strip_runs");
+
+    bsmem_free(*holes);
+    *holes = out;
+    *count = n;
+    *size = used;
+}
+
+/* -S/-f: the raw patch of the data of old and new made a patch of the
+   files. New's holes and runs go back in as fill tuples, diff runs are split where old has
+   a hole and every seek is recomputed for old as it is on disk. */
+static unsigned char *expand_holes(const unsigned char *raw, int32_t rawsize,
+                                   const hole_t *oldholes, int32_t oldcount,
+                                   const hole_t *newholes, int32_t newcount, int32_t *size)
+{
+    int32_t pos = 0, newpos = 0, oldpos = 0, filepos = 0, k = 0;
+    unsigned char ctrl[25];
+    struct bsdiff_stream o;
+    patchbuf_t out;
+
+    out.cap = rawsize + (newcount + oldcount + 1) * sizeof(ctrl) + 128;
+    if((out.data = bsmem_alloc(BSMEM_IMAGE, out.cap)) == NULL)
+        errx(1, "Malloc failed\n");
+
+    memset(&o, 0, sizeof(o));
+    o.opaque = &out;
+
+    TRACE_BEGIN("expand_holes");
+    for(;;)
+    {
+        const uint8_t *dp, *ep;
+        int32_t d = 0, e = 0, sk = 0;
+
+        if(pos < rawsize)
+        {
+            if(rawsize - pos < 24)
+                errx(1, "bsdiff error !!!");
+
+            d = bshdr_get64(raw + pos);
+            e = bshdr_get64(raw + pos + 8);
+            sk = bshdr_get64(raw + pos + 16);
+
+            if(d < 0 || e < 0 || d > rawsize - pos - 24 || e > rawsize - pos - 24 - d)
+                errx(1, "bsdiff error !!!");
+        }
+
+        dp = raw + pos + 24;
+        ep = dp + d;
+
+        for(;;)
+        {
+            int32_t room, next, start, dd, ee, whole, skip;
+
+            /* every hole of new that starts here */
+            while(k < newcount && newholes[k].at == newpos)
+            {
+                offtout(0, ctrl);
+                offtout(-newholes[k].len, ctrl + 8);
+                offtout(0, ctrl + 16);
+                ctrl[24] = newholes[k].byte;
+
+                if(lzma_write(&o, ctrl, sizeof(ctrl)))
+                    errx(1, "Malloc failed\n");
+
+                k++;
+            }
+
+            if(pos == rawsize)
+                break;
+
+            /* a piece stops at the next hole of new, its diff at the next of old */
+            room = k < newcount ? newholes[k].at - newpos : INT32_MAX;
+            start = hole_map(oldholes, oldcount, oldpos, &next);
+
+            dd = MIN(d, room);
+            if(next != INT32_MAX && dd > next - oldpos)
+                dd = next - oldpos;
+
+            ee = dd == d ? MIN(e, room - dd) : 0;
+            whole = dd == d && ee == e;
+
+            /* only the very first diff can find old somewhere else */
+            if(dd > 0 && filepos != start)
+            {
+                offtout(0, ctrl);
+                offtout(0, ctrl + 8);
+                offtout(start - filepos, ctrl + 16);
+
+                if(lzma_write(&o, ctrl, 24))
+                    errx(1, "Malloc failed\n");
+
+                filepos = start;
+            }
+
+            oldpos += dd + (whole ? sk : 0);
+            skip = hole_map(oldholes, oldcount, oldpos, NULL) - (filepos + dd);
+
+            offtout(dd, ctrl);
+            offtout(ee, ctrl + 8);
+            offtout(skip, ctrl + 16);
+
+            if(lzma_write(&o, ctrl, 24) || lzma_write(&o, dp, dd) || lzma_write(&o, ep, ee))
+                errx(1, "Malloc failed\n");
+
+            filepos += dd + skip;
+            d -= dd;
+            e -= ee;
+            dp += dd;
+            ep += ee;
+            newpos += dd + ee;
+
+            if(whole)
+                break;
+        }
+
+        if(pos == rawsize)
+            break;
+
+        pos = (int32_t)(ep - raw);
+    }
+    TRACE_END("expand_holes");
+
+    *size = (int32_t)o.size;
+
+    return out.data;
+}
+
+/* -x: the raw patch cut at every |blocksize| bytes of new and each block
+   compressed on its own behind the index (bsseek.h). BSDIFF_CANCELLED
+   if the progress callback stops it. */
+static int seekable_payload(const unsigned char *raw, int32_t rawsize, int32_t newsize,
+                            uint32_t blocksize, const CLzmaEncProps *props,
+                            struct bsdiff_stream *stream, unsigned char **payload, int32_t *size)
+{
+    uint32_t count = bsseek_count(newsize, blocksize), i = 0;
+    uint8_t *cut = bsmem_alloc(BSMEM_DIFF, bsseek_max_raw(blocksize));
+    int32_t pos = 0, newpos = 0, oldpos = 0, start = 0, end;
+    size_t len = 0, last = 0;
+    struct bsdiff_stream o;
+    patchbuf_t out;
+
+    out.cap = count * BSSEEK_ENTRY_SIZE + rawsize / 2 + 128;
+    out.data = bsmem_alloc(BSMEM_IMAGE, out.cap);
+
+    if(cut == NULL || out.data == NULL)
+        errx(1, "Malloc failed\n");
+
+    /* the index is filled in as the blocks go out */
+    memset(&o, 0, sizeof(o));
+    o.opaque = &out;
+    o.size = count * BSSEEK_ENTRY_SIZE;
+    memset(out.data, 0, o.size);
+
+    end = (int32_t)blocksize < newsize ? (int32_t)blocksize : newsize;
+
+    TRACE_BEGIN("seekable");
+    while(newpos < newsize)
+    {
+        const uint8_t *dp, *ep;
+        int32_t d, e, sk, fill;
+
+        if(rawsize - pos < 24)
+            errx(1, "bsdiff error !!!");
+
+        d = bshdr_get64(raw + pos);
+        e = bshdr_get64(raw + pos + 8);
+        sk = bshdr_get64(raw + pos + 16);
+
+        /* a fill (-S) is cut like extra, each piece with its byte */
+        if((fill = e < 0) != 0)
+            e = -e;
+
+        if(d < 0 || e < 0 || d > rawsize - pos - 24 || (fill ? 1 : e) > rawsize - pos - 24 - d ||
+                d > newsize - newpos || e > newsize - newpos - d)
+            errx(1, "bsdiff error !!!");
+
+        dp = raw + pos + 24;
+        ep = dp + d;
+        pos += 24 + d + (fill ? 1 : e);
+
+        for(;;)
+        {
+            int32_t room = end - newpos;
+            int32_t dd = d < room ? d : room;
+            int32_t ee = e < room - dd ? e : room - dd;
+            int whole = dd == d && ee == e;
+
+            if(dd + ee > 0)
+            {
+                if(len == 0)
+                    start = oldpos;
+
+                last = len;
+                offtout(dd, cut + len);
+                offtout(fill ? -ee : ee, cut + len + 8);
+                offtout(whole ? sk : 0, cut + len + 16);
+                memcpy(cut + len + 24, dp, dd);
+
+                if(!fill)
+                    memcpy(cut + len + 24 + dd, ep, ee);
+                else if(ee)
+                    cut[len + 24 + dd] = *ep;
+
+                len += 24 + dd + (fill ? ee != 0 : ee);
+            }
+            /* a tuple that builds nothing only moves old: onto the tuple
+               before it, or into the block's start */
+            else if(len)
+                offtout(bshdr_get64(cut + last + 16) + sk, cut + last + 16);
+
+            d -= dd;
+            e -= ee;
+            dp += dd;
+            ep += fill ? 0 : ee;
+            newpos += dd + ee;
+            oldpos += dd + (whole ? sk : 0);
+
+            if(newpos == end)
+            {
+                size_t packed;
+                uint8_t *block = lzma_block_encode(cut, len, props, &packed);
+
+                if(block == NULL || lzma_write(&o, block, (int)packed))
+                    errx(1, "lzma error !!!");
+
+                bsseek_entry(out.data + i++ * BSSEEK_ENTRY_SIZE, (uint32_t)packed, start);
+                bsmem_free(block);
+
+                if(stream->progress &&
+                        stream->progress(stream, BSDIFF_PHASE_LZMA, newpos, newsize, o.size))
+                {
+                    TRACE_END("seekable");
+                    bsmem_free(cut);
+                    bsmem_free(out.data);
+                    return BSDIFF_CANCELLED;
+                }
+
+                len = 0;
+                end = newsize - end > (int32_t)blocksize ? end + (int32_t)blocksize : newsize;
+
+                if(newpos == newsize)
+                    break;
+            }
+
+            if(whole)
+                break;
+        }
+    }
+    TRACE_END("seekable");
+
+    bsmem_free(cut);
+    *payload = out.data;
+    *size = (int32_t)o.size;
+
+    return 0;
+}
+
+/* LZMA-encodes the raw patch (freed here), encrypts and frames it and
+   writes header, manifest |block| if any and payload to |out|. The caller
+   fills in sizes, digests and the INPLACE/BUNDLE/SHA256 flags. */
+static void write_patch(const char *out, unsigned char *ppatch, int32_t rawsize, bshdr_t *hdr,
+                        const uint8_t *block, size_t blocksize, const encode_opts_t *o,
+                        struct bsdiff_stream *stream)
+{
+    const char *tmp_patch = "tmp_patch";
+    unsigned char header[BSHDR_SIZE_MAX];
+    CLzmaEncProps props;
+    int32_t patchsize;
+    size_t hdrlen;
+
+    if(o->autotune)
+    {
+        autotune_result_t tuned;
+
+        if(lzma_autotune(ppatch, rawsize, o->budget, &props, &tuned) != SZ_OK)
+            errx(1, "Malloc failed\n");
+
+        printf("autotune lc %d lp %d pb %d fb %d (%u -> %u, %u trials)\n", props.lc, props.lp,
+               props.pb, props.fb, (unsigned)tuned.defaultSize, (unsigned)tuned.bestSize,
+               (unsigned)tuned.trials);
+    }
+    else
+        LzmaEncProps_Init(&props);
+
+    if(o->dictSize)
+        props.dictSize = o->dictSize;
+
+    if(o->blocksize)
+    {
+        unsigned char *payload;
+
+        if(seekable_payload(ppatch, rawsize, hdr->newsize, o->blocksize, &props, stream,
+                            &payload, &patchsize))
+            errx(1, "lzma error !!!");
+
+        bsmem_free(ppatch);
+        ppatch = payload;
+    }
+    else
+    {
+        patch_write(tmp_patch, ppatch, rawsize, -1);
+        bsmem_free(ppatch);
+
+        TRACE_BEGIN("lzma_encode");
+        if(lzma_encode(out, tmp_patch, &props, stream))
+            errx(1, "lzma error !!!");
+        TRACE_END("lzma_encode");
+
+        read_finfo(out, &ppatch, &patchsize, NULL);
+    }
+
+    if(stream->progress)
+        fputc('\n', stderr);
+
+    /* encrypt before framing, the segment CRCs check what is shipped */
+    if(o->keySize)
+    {
+        bsaes_prepare();
+        random_nonce(hdr->nonce);
+        encrypt_payload(ppatch, patchsize, o->key, o->keySize, hdr->nonce);
+    }
+
+    if(o->segsize)
+    {
+        unsigned char *framed = bsmem_alloc(BSMEM_IMAGE, bsseg_framed_size(patchsize, o->segsize));
+
+        if(framed == NULL)
+            errx(1, "Malloc failed\n");
+
+        bsseg_frame(framed, ppatch, patchsize, o->segsize);
+        patchsize = bsseg_framed_size(patchsize, o->segsize);
+
+        bsmem_free(ppatch);
+        ppatch = framed;
+    }
+
+    hdr->patchsize = patchsize;
+    hdr->flags |= (o->segsize ? BSHDR_CRC32 : 0) | (o->keySize ? BSHDR_AES : 0) |
+                  (o->blocksize ? BSHDR_SEEKABLE : 0);
+    hdr->segsize = o->segsize;
+    hdr->blocksize = o->blocksize;
+    hdr->manifestsize = (uint32_t)blocksize;
+
+    hdrlen = bshdr_write(hdr, header);
+    
+    patch_write(out, header, (int32_t)hdrlen, -1);
+
+    /* the manifest sits between header and payload */
+    if(block)
+    {
+        patch_write(out, (unsigned char *)block, (int32_t)blocksize, (int32_t)hdrlen);
+        hdrlen += blocksize;
+    }
+
+    patch_write(out, ppatch, patchsize, (int32_t)hdrlen);
+    
+    bsmem_free(ppatch);
+}
+
+typedef struct
+{
+    const uint8_t *p;
+    size_t left;
+} memsrc_t;
+
+static int read_mem(void *ctx, void *buf, int count)
+{
+    memsrc_t *m = ctx;
+
+    if((size_t)count > m->left)
+        return -1;
+
+    memcpy(buf, m->p, count);
+    m->p += count;
+    m->left -= count;
+
+    return 0;
+}
+
+/* --compose: the raw (decoded) stream of a plain patch file */
+static unsigned char *read_raw(const char *f, const encode_opts_t *o, bshdr_t *hdr, size_t *rawsize)
+{
+    unsigned char *file, *data, *raw;
+    uint64_t unpackSize = 0;
+    int32_t size, hdrlen;
+    uint32_t segsize, datasize;
+    SizeT outLen, inLen;
+    ELzmaStatus status;
+    memsrc_t src;
+    bsseg_t seg;
+    int i;
+
+    read_finfo(f, &file, &size, NULL);
+
+    hdrlen = bshdr_read(hdr, file, size);
+    if(hdrlen < 0 || hdrlen > size || hdr->patchsize > (uint32_t)(size - hdrlen))
+        errx(1, "Corrupt patch :%s\n", f);
+
+    if(hdr->flags & (BSHDR_INPLACE | BSHDR_BUNDLE | BSHDR_SEEKABLE))
+        errx(1, "Only plain patches can be composed :%s\n", f);
+
+    /* payload without its CRCs, checked on the way */
+    segsize = (hdr->flags & BSHDR_CRC32) ? hdr->segsize : 0;
+    datasize = bsseg_data_size(hdr->patchsize, segsize);
+
+    if(datasize < HEADER_SIZE || (data = bsmem_alloc(BSMEM_PATCH_IN, datasize)) == NULL)
+        errx(1, "Corrupt patch :%s\n", f);
+
+    src.p = file + hdrlen;
+    src.left = hdr->patchsize;
+    if(bsseg_init(&seg, segsize, datasize, 0, read_mem, &src))
+        errx(1, "Malloc failed\n");
+
+    if(bsseg_read(&seg, data, datasize))
+        errx(1, "Corrupt patch :%s\n", f);
+
+    bsseg_free(&seg);
+    bsmem_free(file);
+
+    if(hdr->flags & BSHDR_AES)
+    {
+        bsaes_t aes;
+
+        if(o->keySize == 0 || bsaes_init(&aes, o->key, o->keySize, hdr->nonce))
+            errx(1, "Patch is encrypted, it needs -k<keyfile> :%s\n", f);
+
+        bsaes_code(&aes, 0, data, datasize);
+    }
+
+    for(i = 0; i < 8; i++)
+        unpackSize |= (uint64_t)data[LZMA_PROPS_SIZE + i] << (8 * i);
+
+    if(unpackSize >= INT32_MAX || (raw = bsmem_alloc(BSMEM_IMAGE, (size_t)unpackSize + 1)) == NULL)
+        errx(1, "Corrupt patch :%s\n", f);
+
+    outLen = (SizeT)unpackSize;
+    inLen = datasize - HEADER_SIZE;
+
+    TRACE_BEGIN("lzma_decode");
+    if(LzmaDecode(raw, &outLen, data + HEADER_SIZE, &inLen, data, LZMA_PROPS_SIZE, LZMA_FINISH_END,
+                  &status, bsmem_isz(BSMEM_DICTIONARY)) != SZ_OK || outLen != unpackSize)
+        errx(1, "Corrupt patch :%s\n", f);
+    TRACE_END("lzma_decode");
+
+    bsmem_free(data);
+    *rawsize = outLen;
+
+    return raw;
+}
+
+/* --compose: folds patches v1->v2, v2->v3 ... into v1->vN, one pair at a time */
+static unsigned char *compose_chain(char *files[], int count, const encode_opts_t *o,
+                                    struct bsdiff_stream *stream, bshdr_t *hdr, int32_t *rawsize)
+{
+    unsigned char *first, *second;
+    size_t firstsize, secondsize;
+    patchbuf_t raw;
+    bshdr_t next;
+    uint32_t fill;
+    int i;
+
+    if(o->keySize)
+        bsaes_prepare();
+
+    first = read_raw(files[0], o, hdr, &firstsize);
+    fill = hdr->flags & BSHDR_FILL;
+
+    for(i = 1; i < count; i++)
+    {
+        second = read_raw(files[i], o, &next, &secondsize);
+        fill |= next.flags & BSHDR_FILL;
+
+        if(next.oldsize != hdr->newsize || ((hdr->flags & next.flags & BSHDR_SHA256) &&
+                memcmp(hdr->newsha, next.oldsha, sizeof(next.oldsha)) != 0))
+            errx(1, "Patch does not start where the previous one ends :%s\n", files[i]);
+
+        raw.cap = (uint32_t)secondsize + 24;
+        raw.data = bsmem_alloc(BSMEM_IMAGE, raw.cap);
+        if(raw.data == NULL)
+            errx(1, "Malloc failed\n");
+
+        stream->opaque = &raw;
+        stream->size = 0;
+
+        if(bsdiff_compose(first, firstsize, hdr->newsize, second, secondsize, next.newsize, stream))
+            errx(1, "Corrupt patch :%s\n", files[i]);
+
+        bsmem_free(first);
+        bsmem_free(second);
+
+        first = raw.data;
+        firstsize = stream->size;
+
+        /* digests survive only if every link has them */
+        hdr->newsize = next.newsize;
+        memcpy(hdr->newsha, next.newsha, sizeof(next.newsha));
+        hdr->flags &= next.flags;
+    }
+
+    /* fills of any link may come through */
+    hdr->flags = (hdr->flags & BSHDR_SHA256) | fill;
+    *rawsize = (int32_t)firstsize;
+
+    return first;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned char *pold, *pnew, *ppatch;
+    int32_t oldsize, newsize;
+    patchbuf_t raw;
+    bshdr_t hdr;
+    CSha256 sha;
+    encode_opts_t opts;
+#if defined(BSTRACE)
+    const char *trace = NULL;
+#endif
+
+    struct bsdiff_stream stream;
+#if defined(BSDIFF_STATS)
+    struct bsdiff_stats stats;
+#endif
+    CLzmaEncProps props;
+    int inplace = 0, memreport = 0, bundle = 0, compose = 0, sparse = 0;
+    int32_t minrun = 0;
+    int32_t olddata, datasize, rawsize, noldholes = 0, nholes = 0;
+    hole_t *oldholes = NULL, *holes = NULL;
+    bsbundle_t manifest;
+    uint8_t *block = NULL;
+    size_t blocksize = 0;
+
+    memset(&opts, 0, sizeof(opts));
+    memset(&hdr, 0, sizeof(hdr));
+    opts.segsize = BSSEG_SIZE;
+
+    memset(&stream, 0, sizeof(stream));
+    stream.malloc = bsmem_malloc;
+    stream.free = bsmem_free;
+    stream.write = lzma_write;
+
+    while(argc > 4 && argv[1][0] == '-')
+    {
+        /* -a[ms]: autotune lc/lp/pb/fb against the diff stream within a time budget */
+        if(argv[1][1] == 'a')
+        {
+            opts.autotune = 1;
+            opts.budget = (uint32_t)strtoul(argv[1] + 2, NULL, 10);
+        }
+        /* -p: report progress on stderr */
+        else if(argv[1][1] == 'p')
+            stream.progress = print_progress;
+        /* -i: patch that bspatch applies over the old file in place */
+        else if(argv[1][1] == 'i')
+            inplace = 1;
+        /* -b: old and new are directories, the patch is a bundle (bsbundle.h) */
+        else if(argv[1][1] == 'b')
+            bundle = 1;
+        /* -s<n>: CRC32 segment size, -s0 for none */
+        else if(argv[1][1] == 's')
+        {
+            opts.segsize = (uint32_t)strtoul(argv[1] + 2, NULL, 0);
+            if(opts.segsize && opts.segsize < BSSEG_MIN_SIZE)
+                opts.segsize = BSSEG_MIN_SIZE;
+        }
+        /* -S: holes of sparse files are not diffed, new's become fill tuples (BSHDR_FILL) */
+        else if(argv[1][1] == 'S')
+        {
+#if defined(BSDIFF_SPARSE)
+            sparse = 1;
+#else
+            errx(1, "-S needs SEEK_DATA/SEEK_HOLE, this build cannot find holes\n");
+#endif
+        }
+        /* -f[n]: runs of n or more equal bytes (padding, erased flash) are
+           not diffed either and become fill tuples */
+        else if(argv[1][1] == 'f')
+        {
+            minrun = (int32_t)strtoul(argv[1] + 2, NULL, 0);
+            if(minrun == 0)
+                minrun = FILL_MIN_RUN;
+            else if(minrun < 64)
+                minrun = 64;
+        }
+        /* -x[n]: seekable patch, independent blocks of n bytes of new (bsseek.h) */
+        else if(argv[1][1] == 'x')
+        {
+            opts.blocksize = (uint32_t)strtoul(argv[1] + 2, NULL, 0);
+            if(opts.blocksize == 0)
+                opts.blocksize = BSSEEK_BLOCK;
+            else if(opts.blocksize < BSSEEK_MIN_BLOCK)
+                opts.blocksize = BSSEEK_MIN_BLOCK;
+        }
+        /* -d<n>: dictionary size, bounds the decoder's RAM */
+        else if(argv[1][1] == 'd')
+            opts.dictSize = (uint32_t)strtoul(argv[1] + 2, NULL, 0);
+        /* -k<file>: encrypt the payload with the AES key in file; with
+           --compose also the key of the input patches */
+        else if(argv[1][1] == 'k')
+            read_key(argv[1] + 2, opts.key, &opts.keySize);
+        /* -M: estimate memory up front, report what was allocated at the end */
+        else if(argv[1][1] == 'M')
+            memreport = 1;
+        /* --compose: merge consecutive patches into one */
+        else if(strcmp(argv[1], "--compose") == 0)
+            compose = 1;
+#if defined(BSTRACE)
+        /* -T<file>: Chrome trace of the run */
+        else if(argv[1][1] == 'T')
+            trace = argv[1] + 2;
+#endif
+        else
+            break;
+
+        argv++;
+        argc--;
+    }
+
+    if(argc != 4 && !(compose && argc > 4))
+        errx(1, "usage: %s [-a[ms]] [-p] [-i] [-b] [-S] [-f[n]] [-x[n]] [-d<n>] [-s<n>] [-k<keyfile>] [-M] oldfile newfile patchfile\n"
+                "       %s [-a[ms]] [-x[n]] [-d<n>] [-s<n>] [-k<keyfile>] --compose patch1 patch2 [...] patchfile\n",
+             argv[0], argv[0]);
+
+    TRACE_THREAD("main");
+
+    if(bundle && inplace)
+        errx(1, "A bundle cannot be applied in place\n");
+
+    if(opts.blocksize && (bundle || inplace))
+        errx(1, "Only plain patches can be seekable\n");
+
+    if((sparse || minrun) && (bundle || inplace))
+        errx(1, "Only plain patches can fill holes\n");
+
+    Sha256Prepare();
+
+    if(compose)
+    {
+        ppatch = compose_chain(argv + 1, argc - 2, &opts, &stream, &hdr, &newsize);
+        write_patch(argv[argc - 1], ppatch, newsize, &hdr, NULL, 0, &opts, &stream);
+        goto done;
+    }
+
+    if(bundle)
+    {
+        read_tree(argv[1], argv[2], &manifest, &pold, &oldsize, &pnew, &newsize, &hdr);
+        olddata = oldsize;
+        datasize = newsize;
+    }
+    else
+    {
+        /* holes are not read; with -S old and new are only their data */
+        Sha256_Init(&sha);
+        read_sparse(argv[1], &pold, &oldsize, &olddata, &sha, sparse ? &oldholes : NULL, &noldholes);
+        Sha256_Final(&sha, hdr.oldsha);
+
+        Sha256_Init(&sha);
+        read_sparse(argv[2], &pnew, &newsize, &datasize, &sha, sparse ? &holes : NULL, &nholes);
+        Sha256_Final(&sha, hdr.newsha);
+
+        if(minrun)
+        {
+            strip_runs(pold, &olddata, &oldholes, &noldholes, minrun);
+            strip_runs(pnew, &datasize, &holes, &nholes, minrun);
+        }
+    }
+
+    raw.cap = LZMA_PROPS_SIZE + datasize + datasize / 3 + 128;
+
+    if(memreport)
+    {
+        size_t images = (size_t)olddata + datasize + raw.cap;
+        size_t diff = bsdiff_mem_estimate(olddata, datasize);
+
+        LzmaEncProps_Init(&props);
+        if(opts.dictSize)
+            props.dictSize = opts.dictSize;
+
+        /* images and diff arrays overlap, the encoder runs after both are freed */
+        printf("estimate: images %zu, diff %zu, encode %zu bytes\n", images, diff,
+               lzma_encode_mem_estimate(&props, raw.cap));
+    }
+    raw.data = (unsigned char *)bsmem_alloc(BSMEM_IMAGE, raw.cap);
+    assert(raw.data != NULL);
+
+    stream.opaque = &raw;
+    stream.size = 0;
+#if defined(BSDIFF_STATS)
+    memset(&stats, 0, sizeof(stats));
+    stream.stats = &stats;
+#endif
+
+    if((inplace ? bsdiff_inplace : bsdiff)(pold, olddata, pnew, datasize, &stream))
+        errx(1, "bsdiff error !!!");
+
+    ppatch = raw.data;
+    rawsize = stream.size;
+
+    if(noldholes || nholes)
+    {
+        ppatch = expand_holes(raw.data, rawsize, oldholes, noldholes, holes, nholes, &rawsize);
+        bsmem_free(raw.data);
+        bsmem_free(oldholes);
+        bsmem_free(holes);
+    }
+
+    if(stream.progress)
+        fputc('\n', stderr);
+
+#if defined(BSDIFF_STATS)
+    print_stats(&stats);
+#endif
+
+    bsmem_free(pold);
+    bsmem_free(pnew);
+
+    if(bundle)
+    {
+        if((block = bsbundle_pack(&manifest, &blocksize)) == NULL)
+            errx(1, "Malloc failed\n");
+
+        bsbundle_free(&manifest);
+    }
+
+    hdr.oldsize = oldsize;
+    hdr.newsize = newsize;
+    hdr.flags = BSHDR_SHA256 | (inplace ? BSHDR_INPLACE : 0) | (bundle ? BSHDR_BUNDLE : 0) |
+                (nholes ? BSHDR_FILL : 0);
+
+    write_patch(argv[3], ppatch, rawsize, &hdr, block, blocksize, &opts, &stream);
+
+    bsmem_free(block);
+
+done:
+    if(memreport)
+        bsmem_report(stdout);
+
+#if defined(BSTRACE)
+    if(trace && bstrace_dump(trace))
+        errx(1, "Trace write failed :%s", trace);
+#endif
 
     return 0;
 }
@@ -31,6 +31,37 @@
 # include <stddef.h>
 # include <stdint.h>
 
+/* progress phases, in the order they are reported */
+enum
+{
+    BSDIFF_PHASE_SORT,  /* done = suffixes in final order, total = oldsize + 1 */
+    BSDIFF_PHASE_SCAN,  /* done = bytes of new consumed, total = newsize */
+    BSDIFF_PHASE_LZMA   /* done = bytes in, total = payload size, out = bytes out */
+};
+
+#define BSDIFF_PROGRESS_STEP (1 << 16)
+#define BSDIFF_CANCELLED (-2)
+
+#if defined(BSDIFF_STATS)
+/* histogram bucket 0 counts zero lengths, bucket b lengths in [2^(b-1), 2^b) */
+#define BSDIFF_HIST_BUCKETS 32
+
+/* what bsdiff() did, for tuning; only with BSDIFF_STATS, compiled out
+   otherwise. Counts add up over calls, zero the struct to start over. */
+struct bsdiff_stats
+{
+    uint64_t search_calls;      /* search() from the scan loop */
+    uint64_t compared_bytes;    /* looked at by matchlen() and search()'s memcmp */
+    uint32_t split_depth;       /* deepest split() recursion */
+    uint32_t sort_passes;       /* passes of qsufsort's h doubling loop */
+    uint64_t tuples;            /* control tuples written */
+    uint64_t diff_bytes;
+    uint64_t extra_bytes;
+    uint64_t diff_hist[BSDIFF_HIST_BUCKETS];    /* lenf of each tuple */
+    uint64_t extra_hist[BSDIFF_HIST_BUCKETS];   /* extra length of each tuple */
+};
+#endif
+
 struct bsdiff_stream
 {
 	void* opaque;
@@ -39,6 +70,14 @@ struct bsdiff_stream
 	void* (*malloc)(size_t size);
 	void (*free)(void* ptr);
 	int (*write)(struct bsdiff_stream* stream, const void* buffer, int size);
+
+    /* optional, may be NULL; return non-zero to cancel the job */
+    int (*progress)(struct bsdiff_stream* stream, int phase, uint64_t done, uint64_t total, uint64_t out);
+
+#if defined(BSDIFF_STATS)
+    /* optional, may be NULL; filled in by bsdiff() */
+    struct bsdiff_stats* stats;
+#endif
 };
 
 #define errx err
@@ -46,4 +85,35 @@ void err(int exitcode, const char *fmt, ...);
 
 int bsdiff(const uint8_t* old, int32_t oldsize, const uint8_t* new, int32_t newsize, struct bsdiff_stream* stream);
 
+/* Bytes bsdiff() takes through stream->malloc at its peak: suffix and rank
+   arrays over old plus the diff buffer over new */
+size_t bsdiff_mem_estimate(int32_t oldsize, int32_t newsize);
+
+/* Composes two raw patch streams, old -> mid and mid -> new, into one old
+   -> new stream written to |stream|: tuples of the second are mapped
+   through the first, diff bytes over diff bytes are summed, anything over
+   extra bytes becomes extra. Fills (BSHDR_FILL) of the second stay fills,
+   as do runs left over fills of the first. Only stream->malloc/free/write
+   are used. */
+int bsdiff_compose(const uint8_t* first, size_t firstsize, int32_t midsize,
+                   const uint8_t* second, size_t secondsize, int32_t newsize,
+                   struct bsdiff_stream* stream);
+
+/* in-place op types: copy with add front to back, back to front (diff bytes
+   stored reversed), or literal new bytes */
+enum
+{
+    BSDIFF_OP_FORWARD,
+    BSDIFF_OP_BACKWARD,
+    BSDIFF_OP_LITERAL
+};
+
+/* Writes an op stream that rebuilds new on top of old without a second
+   image: records of newpos, oldpos, len and type (8 bytes each) followed by
+   len data bytes. Ops are ordered so none overwrites a range a later op
+   still reads; where reads and writes form a cycle, the bytes one op reads
+   and the next overwrites (the fewest on the cycle) become a literal and the
+   rest of that op stays a copy. Literals come last. */
+int bsdiff_inplace(const uint8_t* old, int32_t oldsize, const uint8_t* new, int32_t newsize, struct bsdiff_stream* stream);
+
 #endif
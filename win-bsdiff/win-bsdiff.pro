@@ -4,11 +4,22 @@ CONFIG -= app_bundle
 CONFIG -= qt
 
 DEFINES += BSDIFF_EXECUTABLE
+# search/sort/tuple counters printed after the diff (struct bsdiff_stats)
+# DEFINES += BSDIFF_STATS
+# Chrome trace JSON of a run, -T<file> (bstrace.h)
+# DEFINES += BSTRACE
+
+win32: LIBS += -lbcrypt
 
 SOURCES += \
+    ../lzma/7zCrc.c \
+    ../lzma/7zCrcOpt.c \
     ../lzma/7zFile.c \
     ../lzma/7zStream.c \
     ../lzma/Alloc.c \
+    ../lzma/Aes.c \
+    ../lzma/AesOpt.c \
+    ../lzma/CpuArch.c \
     ../lzma/LzFind.c \
     ../lzma/LzFindMt.c \
     ../lzma/LzFindOpt.c \
@@ -16,14 +27,24 @@ SOURCES += \
     ../lzma/LzmaEnc.c \
     ../lzma/LzmaLib.c \
     ../lzma/LzmaUtil/LzmaUtil.c \
-    ../lzma/LzmaUtil/ringbuffer.c \
+    ../lzma/LzmaUtil/bsaes.c \
+    ../lzma/LzmaUtil/bsbundle.c \
+    ../lzma/LzmaUtil/bshdr.c \
+    ../lzma/LzmaUtil/bsmem.c \
+    ../lzma/LzmaUtil/bsseek.c \
+    ../lzma/LzmaUtil/bsseg.c \
+    ../lzma/LzmaUtil/bstrace.c \
+    ../lzma/Sha256.c \
+    ../lzma/Sha256Opt.c \
     ../lzma/Threads.c \
         bsdiff.c \
 
 HEADERS += \
+    ../lzma/7zCrc.h \
     ../lzma/7zFile.h \
     ../lzma/7zVersion.h \
     ../lzma/Alloc.h \
+    ../lzma/Aes.h \
     ../lzma/CpuArch.h \
     ../lzma/LzFind.h \
     ../lzma/LzFindMt.h \
@@ -32,5 +53,12 @@ HEADERS += \
     ../lzma/LzmaEnc.h \
     ../lzma/LzmaLib.h \
     ../lzma/LzmaUtil/LzmaUtil.h \
-    ../lzma/LzmaUtil/ringbuffer.h \
+    ../lzma/LzmaUtil/bsaes.h \
+    ../lzma/LzmaUtil/bsbundle.h \
+    ../lzma/LzmaUtil/bshdr.h \
+    ../lzma/LzmaUtil/bsmem.h \
+    ../lzma/LzmaUtil/bsseek.h \
+    ../lzma/LzmaUtil/bsseg.h \
+    ../lzma/LzmaUtil/bstrace.h \
+    ../lzma/Sha256.h \
     ../lzma/Threads.h
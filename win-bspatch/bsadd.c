@@ -0,0 +1,113 @@
+/* bsadd.c -- vectorized byte add for the bspatch apply loop
+ *
+ * The kernel is chosen once at run time through the CPU checks in
+ * lzma/CpuArch.c: AVX2 or SSE2 on x86, NEON on ARM64, plain C elsewhere.
+ */
+
+#include "../lzma/CpuArch.h"
+#include "bsadd.h"
+
+#if defined(MY_CPU_X86_OR_AMD64) && \
+    (defined(__GNUC__) || defined(__clang__) || defined(_MSC_VER))
+#define BSADD_USE_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define BSADD_USE_AVX2
+#include <immintrin.h>
+#if !defined(__AVX2__)
+#define ATTRIB_AVX2 __attribute__((__target__("avx2")))
+#endif
+#elif defined(_MSC_VER) && (_MSC_VER >= 1800)
+#define BSADD_USE_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+#ifndef ATTRIB_AVX2
+#define ATTRIB_AVX2
+#endif
+
+#if defined(MY_CPU_ARM64) && defined(__ARM_NEON)
+#define BSADD_USE_NEON
+#include <arm_neon.h>
+#endif
+
+static void bsadd_c(uint8_t *dst, const uint8_t *diff, const uint8_t *old, size_t n)
+{
+    size_t i;
+
+    for(i = 0; i < n; i++)
+        dst[i] = (uint8_t)(diff[i] + old[i]);
+}
+
+#ifdef BSADD_USE_SSE2
+static void bsadd_sse2(uint8_t *dst, const uint8_t *diff, const uint8_t *old, size_t n)
+{
+    size_t i = 0;
+
+    for(; i + 16 <= n; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(const void *)(diff + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(const void *)(old + i));
+        _mm_storeu_si128((__m128i *)(void *)(dst + i), _mm_add_epi8(a, b));
+    }
+
+    bsadd_c(dst + i, diff + i, old + i, n - i);
+}
+#endif
+
+#ifdef BSADD_USE_AVX2
+ATTRIB_AVX2
+static void bsadd_avx2(uint8_t *dst, const uint8_t *diff, const uint8_t *old, size_t n)
+{
+    size_t i = 0;
+
+    for(; i + 32 <= n; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(const void *)(diff + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(const void *)(old + i));
+        _mm256_storeu_si256((__m256i *)(void *)(dst + i), _mm256_add_epi8(a, b));
+    }
+
+    bsadd_c(dst + i, diff + i, old + i, n - i);
+}
+#endif
+
+#ifdef BSADD_USE_NEON
+static void bsadd_neon(uint8_t *dst, const uint8_t *diff, const uint8_t *old, size_t n)
+{
+    size_t i = 0;
+
+    for(; i + 16 <= n; i += 16)
+        vst1q_u8(dst + i, vaddq_u8(vld1q_u8(diff + i), vld1q_u8(old + i)));
+
+    bsadd_c(dst + i, diff + i, old + i, n - i);
+}
+#endif
+
+bsadd_func g_bsadd = bsadd_c;
+
+void bsadd_init(void)
+{
+    bsadd_func f = bsadd_c;
+
+#ifdef BSADD_USE_SSE2
+#ifdef MY_CPU_AMD64
+    f = bsadd_sse2;
+#else
+    if(CPU_IsSupported_SSE2())
+        f = bsadd_sse2;
+#endif
+#endif
+
+#ifdef BSADD_USE_AVX2
+    if(CPU_IsSupported_AVX2())
+        f = bsadd_avx2;
+#endif
+
+#ifdef BSADD_USE_NEON
+    f = bsadd_neon;
+#endif
+
+    g_bsadd = f;
+}
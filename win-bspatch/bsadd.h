@@ -0,0 +1,19 @@
+/* bsadd.h -- vectorized byte add for the bspatch apply loop */
+
+#ifndef BSADD_H
+# define BSADD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* dst[i] = diff[i] + old[i] (mod 256); dst may alias diff */
+typedef void (*bsadd_func)(uint8_t *dst, const uint8_t *diff, const uint8_t *old, size_t n);
+
+extern bsadd_func g_bsadd;
+
+/* picks the widest kernel the CPU supports, safe to call repeatedly */
+void bsadd_init(void);
+
+#define bsadd(dst, diff, old, n) g_bsadd(dst, diff, old, n)
+
+#endif
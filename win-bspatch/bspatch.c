@@ -27,155 +27,617 @@
 #include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "bspatch.h"
+#include "bsadd.h"
+#include "../lzma/LzmaUtil/bshdr.h"
+#include "../lzma/LzmaUtil/bsmem.h"
+#include "../lzma/LzmaUtil/bstrace.h"
+
+int bspatch_rold_mem(struct bspatch_stream* stream, uint32_t offset, const void** buffer, int length)
+{
+    (void)length;
+    *buffer = (const uint8_t *)stream->opaque_old + offset;
+
+    return 0;
+}
+
+int bspatch_wold_mem(struct bspatch_stream* stream, uint32_t offset, const void* buffer, int length)
+{
+    memmove((uint8_t *)stream->opaque_old + offset, buffer, length);
+
+    return 0;
+}
+
+#if defined(BSPATCH_STATIC)
+static uint8_t g_scratch[BSPATCH_SCRATCH_SIZE];
+#endif
+
+/* transfer size for this stream, at least |min| */
+static int32_t transfer_size(struct bspatch_stream *stream, int32_t min)
+{
+    int32_t transfer = stream->transfer_size > 0 ? stream->transfer_size : BSPATCH_TRANSFER_SIZE;
+
+#if defined(BSPATCH_STATIC)
+    if(transfer > BSPATCH_TRANSFER_SIZE)
+        transfer = BSPATCH_TRANSFER_SIZE;
+#endif
+
+    return transfer < min ? min : transfer;
+}
+
+static uint8_t *scratch_alloc(size_t size)
+{
+#if defined(BSPATCH_STATIC)
+    return size <= sizeof(g_scratch) ? g_scratch : NULL;
+#else
+    return (uint8_t *)bsmem_alloc(BSMEM_SCRATCH, size);
+#endif
+}
+
+static void scratch_free(uint8_t *p)
+{
+#if defined(BSPATCH_STATIC)
+    (void)p;
+#else
+    bsmem_free(p);
+#endif
+}
+
+/* view the next |length| bytes of the patch stream, copying into |buf| only
+   when the stream cannot lend them */
+static int next_data(struct bspatch_stream *stream, uint8_t *buf, const uint8_t **p, int length)
+{
+    if(stream->borrow)
+        return stream->borrow(stream, (const void **)p, length);
+
+    if(stream->read(stream, buf, length))
+        return -1;
+
+    *p = buf;
 
-#define BSPATCH_TRANSFER_SIZE    1024
+    return length;
+}
 
-static int32_t offtin(uint8_t *buf)
+/* hands the position to stream->checkpoint once |next| has been passed */
+static int take_checkpoint(struct bspatch_stream *stream, int32_t newpos, int32_t oldpos,
+                           const int32_t *ctrl, uint32_t *next)
 {
-    int32_t y;
+    bspatch_state st;
+
+    if(stream->checkpoint == NULL || (uint32_t)newpos < *next)
+        return 0;
 
-    y = buf[7] & 0x7F;
-    y = y * 256; y += buf[6];
-    y = y * 256; y += buf[5];
-    y = y * 256; y += buf[4];
-    y = y * 256; y += buf[3];
-    y = y * 256; y += buf[2];
-    y = y * 256; y += buf[1];
-    y = y * 256; y += buf[0];
+    st.newpos = newpos;
+    st.oldpos = oldpos;
+    st.ctrl[0] = ctrl[0];
+    st.ctrl[1] = ctrl[1];
+    st.ctrl[2] = ctrl[2];
+    st.pending = 1;
 
-    if(buf[7] & 0x80) y = -y;
+    *next = newpos + stream->checkpoint_interval;
 
-    return y;
+    return stream->checkpoint(stream, &st);
 }
 
 int bspatch(struct bspatch_stream *stream, int32_t oldsize, int32_t newsize)
 {
-    uint8_t *buf, *told;
-    int32_t oldpos, newpos, len;
+    return bspatch_resume(stream, oldsize, newsize, NULL);
+}
+
+int bspatch_resume(struct bspatch_stream *stream, int32_t oldsize, int32_t newsize,
+                   const bspatch_state *from)
+{
+    uint8_t *buf, *pout;
+    const uint8_t *pold, *pdata;
+    int32_t oldpos, newpos, len, lo, hi;
     int32_t ctrl[3];
-    int32_t i;
+    int32_t i, transfer, pending;
+    uint32_t next;
+    int ret = -1;
+
+    /* buf also carries the 8 byte control fields */
+    transfer = transfer_size(stream, 8);
 
-    buf = (uint8_t*)malloc(BSPATCH_TRANSFER_SIZE + 1);
+    buf = scratch_alloc(transfer + 1);
     if(buf == NULL)
         return -1;
 
-    told = (uint8_t*)malloc(BSPATCH_TRANSFER_SIZE + 1);
-    if(told == NULL)
-        return -1;
+    bsadd_init();
+
+    TRACE_BEGIN("bspatch");
+
+    oldpos = 0; newpos = 0; pending = 0;
+
+    if(from)
+    {
+        oldpos = from->oldpos;
+        newpos = from->newpos;
+        pending = from->pending;
+        memcpy(ctrl, from->ctrl, sizeof(ctrl));
+
+        if(newpos < 0 || newpos > newsize)
+            goto out;
+    }
 
-    oldpos = 0; newpos = 0;
+    next = newpos + (stream->checkpoint_interval ? stream->checkpoint_interval : 1);
 
     while(newpos < newsize)
     {
-        /* Read control data */
-        for(i = 0; i <= 2; i++)
+        if(!pending)
         {
-            if(stream->read(stream, buf, 8))
-                return -1;
+            /* Read control data */
+            for(i = 0; i <= 2; i++)
+            {
+                if(stream->read(stream, buf, 8) || (ctrl[i] = bshdr_get64(buf)) == BSHDR_BAD)
+                    goto out;
+            };
+        }
 
-            ctrl[i] = offtin(buf);
-        };
+        pending = 0;
 
-        /* Sanity-check */
+        /* Sanity-check, a negative extra length is a fill */
         if(ctrl[0] < 0 || ctrl[0] > INT_MAX ||
-                ctrl[1] < 0 || ctrl[1] > INT_MAX ||
+                ctrl[1] < -INT_MAX || ctrl[1] > INT_MAX ||
                 newpos + ctrl[0] > newsize)
-            return -1;
-
-#if 0
-        /* Read diff string */
-        if(stream->read(stream, pnew + newpos, ctrl[0]))
-            return -1;
+            goto out;
 
-        /* Add pold data to diff string */
-        for(i = 0; i < ctrl[0]; i++)
-            if((oldpos + i >= 0) && (oldpos + i < oldsize))
-                pnew[newpos + i] += pold[oldpos + i];
+        /* Announce the old range this tuple will read */
+        if(stream->advise)
+        {
+            lo = oldpos < 0 ? 0 : oldpos;
+            hi = (oldpos + ctrl[0] > oldsize) ? oldsize : oldpos + ctrl[0];
 
-        /* Adjust pointers */
-        newpos += ctrl[0];
-        oldpos += ctrl[0];
-#endif /* 0 */
+            if(hi > lo)
+                stream->advise(stream, lo, hi - lo);
+        }
 
+        TRACE_BEGIN("diff");
         while(ctrl[0] > 0)
         {
-            if(ctrl[0] > BSPATCH_TRANSFER_SIZE)
-                len = BSPATCH_TRANSFER_SIZE;
+            if(ctrl[0] > transfer)
+                len = transfer;
             else
                 len = ctrl[0];
             
-            /* Read diff string */
-            if (stream->read(stream, buf, len))
-                return -1;
-            
-            /* Read old string */
-            if (stream->rold(stream, oldpos, told, len))
-                return -1;
+            /* The sum goes straight into the writer's buffer if it lends one */
+            pout = buf;
+            if (stream->reserve)
+            {
+                len = stream->reserve(stream, (void **)&pout, len);
+                if (len <= 0)
+                    goto out_diff;
+            }
 
-            /* Add pold data to diff string */
-            for (i = 0; i < len; i++)
+            /* Read diff string, possibly shorter if the decoder wraps */
+            len = next_data(stream, buf, &pdata, len);
+            if (len <= 0)
+                goto out_diff;
+
+            /* Only the part of the window inside old is added */
+            lo = (oldpos < 0) ? -oldpos : 0;
+            hi = oldsize - oldpos;
+            if(lo > len) lo = len;
+            if(hi > len) hi = len;
+
+            if(hi > lo)
             {
-                if ((oldpos + i >= 0) && (oldpos + i < oldsize))
+                /* Read old string */
+                if (stream->rold(stream, oldpos + lo, (const void **)&pold, hi - lo))
+                    goto out_diff;
+
+                /* Add pold data to diff string */
+                if (pout != pdata)
                 {
-                    buf[i] += told[i];
-                    //buf[i] += pold[oldpos + i];
+                    memcpy(pout, pdata, lo);
+                    memcpy(pout + hi, pdata + hi, len - hi);
                 }
+
+                bsadd(pout + lo, pdata + lo, pold, hi - lo);
             }
+            else if (pout != buf)
+                memcpy(pout, pdata, len);
+            else
+                pout = (uint8_t *)pdata;
 
-            stream->write(stream, buf, len);
+            if (stream->write(stream, pout, len))
+                goto out_diff;
             
             ctrl[0] -= len;
             oldpos += len;
             newpos += len;
+
+            if(take_checkpoint(stream, newpos, oldpos, ctrl, &next))
+                goto out_diff;
         }
 
+        TRACE_END("diff");
+
         /* Sanity-check */
-        if(newpos + ctrl[1] > newsize)
-            return -1;
+        if(newpos + (ctrl[1] < 0 ? -ctrl[1] : ctrl[1]) > newsize)
+            goto out;
+
+        /* One byte repeated, taken in one go so a checkpoint never falls
+           inside it */
+        if(ctrl[1] < 0)
+        {
+            TRACE_BEGIN("fill");
+            if(stream->read(stream, buf, 1))
+                goto out_fill;
+
+            len = -ctrl[1];
+
+            if(stream->fill)
+            {
+                if(stream->fill(stream, buf[0], len))
+                    goto out_fill;
+            }
+            else
+            {
+                memset(buf, buf[0], transfer);
+
+                for(i = len; i > 0; i -= transfer)
+                    if(stream->write(stream, buf, i > transfer ? transfer : i))
+                        goto out_fill;
+            }
+
+            ctrl[1] = 0;
+            newpos += len;
+            TRACE_END("fill");
+
+            if(take_checkpoint(stream, newpos, oldpos, ctrl, &next))
+                goto out;
+        }
 
         /* Read extra string */
-#if 0
-        if(stream->read(stream, pnew + newpos, ctrl[1]))
-            return -1;
-#endif /* 0 */
+        TRACE_BEGIN("extra");
         while(ctrl[1] > 0)
         {
-            if(ctrl[1] > BSPATCH_TRANSFER_SIZE)
-                len = BSPATCH_TRANSFER_SIZE;
+            if(ctrl[1] > transfer)
+                len = transfer;
             else
                 len = ctrl[1];
             
-            if (stream->read(stream, buf, len))
-                return -1;
+            /* Extra bytes go out straight from the patch stream */
+            len = next_data(stream, buf, &pdata, len);
+            if (len <= 0)
+                goto out_extra;
             
-            stream->write(stream, buf, len);
+            if (stream->write(stream, pdata, len))
+                goto out_extra;
+
             ctrl[1] -= len;
             newpos += len;
+
+            if(take_checkpoint(stream, newpos, oldpos, ctrl, &next))
+                goto out_extra;
         }
 
+        TRACE_END("extra");
+
         /* Adjust pointers */
-        //newpos += ctrl[1];
         oldpos += ctrl[2];
     };
-    
-    if(buf)
-        free(buf);
-    
-    if(told)
-        free(told);
+
+    ret = 0;
+
+out:
+    TRACE_END("bspatch");
+    scratch_free(buf);
+
+    return ret;
+
+    /* a failure inside a tuple closes its span first */
+out_diff:
+    TRACE_END("diff");
+    goto out;
+out_fill:
+    TRACE_END("fill");
+    goto out;
+out_extra:
+    TRACE_END("extra");
+    goto out;
+}
+
+/* bspatch_range: where the block is and the part of it that goes out */
+typedef struct
+{
+    struct bspatch_stream *outer;
+    int32_t pos;
+    int32_t from;
+    int32_t to;
+} range_t;
+
+static int range_write(struct bspatch_stream *stream, const void *buffer, int length)
+{
+    range_t *r = stream->opaque_w;
+    int32_t lo = r->from - r->pos, hi = r->to - r->pos;
+
+    r->pos += length;
+
+    if(lo < 0) lo = 0;
+    if(hi > length) hi = length;
+
+    if(hi <= lo)
+        return 0;
+
+    return r->outer->write(r->outer, (const uint8_t *)buffer + lo, hi - lo);
+}
+
+int bspatch_range(struct bspatch_stream *stream, int32_t oldsize, const bspatch_state *at,
+                  int32_t end, int32_t from, int32_t to)
+{
+    struct bspatch_stream s = *stream;
+    range_t r;
+
+    if(at->pending || from < at->newpos || from > to || to > end)
+        return -1;
+
+    r.outer = stream;
+    r.pos = at->newpos;
+    r.from = from;
+    r.to = to;
+
+    /* the block is built whole, the writer only sees the range */
+    s.write = range_write;
+    s.reserve = NULL;
+    s.fill = NULL;
+    s.checkpoint = NULL;
+    s.opaque_w = &r;
+
+    return bspatch_resume(&s, oldsize, end, at);
+}
+
+int bspatch_inplace(struct bspatch_stream *stream, int32_t oldsize, int32_t newsize)
+{
+    uint8_t *buf, *pout;
+    const uint8_t *pold, *pdata;
+    int32_t newpos, oldpos, len, type, done, at, written;
+    int32_t i, n, transfer;
+    int ret = -1;
+
+    /* buf also carries the 32 byte op record */
+    transfer = transfer_size(stream, 32);
+
+    /* one for the record or diff bytes, one for the sum */
+    buf = scratch_alloc(2 * transfer);
+    if(buf == NULL)
+        return -1;
+
+    pout = buf + transfer;
+
+    bsadd_init();
+
+    TRACE_BEGIN("bspatch_inplace");
+
+    written = 0;
+
+    while(written < newsize)
+    {
+        /* Read op record */
+        if(stream->read(stream, buf, 32))
+            goto out;
+
+        newpos = bshdr_get64(buf);
+        oldpos = bshdr_get64(buf + 8);
+        len = bshdr_get64(buf + 16);
+        type = bshdr_get64(buf + 24);
+
+        /* Sanity-check */
+        if(newpos < 0 || len <= 0 || newpos > newsize - len)
+            goto out;
+
+        if(type != BSPATCH_OP_LITERAL &&
+                (type < BSPATCH_OP_FORWARD || type > BSPATCH_OP_BACKWARD || oldpos < 0 || oldpos > oldsize - len))
+            goto out;
+
+        for(done = 0; done < len; done += n)
+        {
+            n = len - done;
+            if(n > transfer)
+                n = transfer;
+
+            n = next_data(stream, buf, &pdata, n);
+            if(n <= 0)
+                goto out;
+
+            if(type == BSPATCH_OP_LITERAL)
+            {
+                if(stream->wold(stream, newpos + done, pdata, n))
+                    goto out;
+
+                continue;
+            }
+
+            /* the sum is complete before any of it lands on old */
+            if(type == BSPATCH_OP_FORWARD)
+            {
+                at = done;
+                if(stream->rold(stream, oldpos + at, (const void **)&pold, n))
+                    goto out;
+
+                bsadd(pout, pdata, pold, n);
+            }
+            else
+            {
+                /* diff bytes run from the end of the range backwards */
+                at = len - done - n;
+                if(stream->rold(stream, oldpos + at, (const void **)&pold, n))
+                    goto out;
+
+                for(i = 0; i < n; i++)
+                    pout[n - 1 - i] = pdata[i] + pold[n - 1 - i];
+            }
+
+            if(stream->wold(stream, newpos + at, pout, n))
+                goto out;
+        }
+
+        written += len;
+    }
+
+    ret = 0;
+
+out:
+    TRACE_END("bspatch_inplace");
+    scratch_free(buf);
+
+    return ret;
+}
+
+static uint64_t inspect_tell(struct bspatch_stream *stream)
+{
+    return stream->tell ? stream->tell(stream) : 0;
+}
+
+/* consumes |len| data bytes, counting the ones that are not zero */
+static int inspect_data(struct bspatch_stream *stream, uint8_t *buf, int32_t transfer,
+                        int32_t len, int32_t *changed)
+{
+    const uint8_t *pdata;
+    int32_t i, n;
+
+    while(len > 0)
+    {
+        n = next_data(stream, buf, &pdata, len > transfer ? transfer : len);
+        if(n <= 0)
+            return -1;
+
+        if(changed)
+            for(i = 0; i < n; i++)
+                *changed += pdata[i] != 0;
+
+        len -= n;
+    }
 
     return 0;
 }
 
+int bspatch_inspect(struct bspatch_stream *stream, int32_t newsize, int inplace,
+                    int (*visit)(struct bspatch_stream *stream, const bspatch_region *region))
+{
+    bspatch_region r;
+    uint8_t *buf;
+    uint64_t at, mark;
+    int32_t newpos, oldpos, transfer, len;
+    int32_t ctrl[3];
+    int i, ret = -1;
+
+    transfer = transfer_size(stream, 32);
+
+    buf = scratch_alloc(transfer + 1);
+    if(buf == NULL)
+        return -1;
+
+    TRACE_BEGIN("bspatch_inspect");
+
+    newpos = 0; oldpos = 0;
+    at = inspect_tell(stream);
+
+    while(newpos < newsize)
+    {
+        memset(&r, 0, sizeof(r));
+
+        if(inplace)
+        {
+            if(stream->read(stream, buf, 32))
+                goto out;
+
+            r.newpos = bshdr_get64(buf);
+            r.oldpos = bshdr_get64(buf + 8);
+            len = bshdr_get64(buf + 16);
+            r.type = bshdr_get64(buf + 24);
+
+            if(r.newpos < 0 || len <= 0 || r.newpos > newsize - len ||
+                    r.type < BSPATCH_OP_FORWARD || r.type > BSPATCH_OP_LITERAL)
+                goto out;
+
+            if(r.type == BSPATCH_OP_LITERAL)
+                r.extra = len;
+            else
+                r.diff = len;
+
+            /* ops come in write order, not by address; count what is done */
+            newpos += len;
+        }
+        else
+        {
+            for(i = 0; i <= 2; i++)
+            {
+                if(stream->read(stream, buf, 8) || (ctrl[i] = bshdr_get64(buf)) == BSHDR_BAD)
+                    goto out;
+            }
+
+            r.diff = ctrl[0];
+            r.extra = ctrl[1];
+            r.seek = ctrl[2];
+            r.newpos = newpos;
+            r.oldpos = oldpos;
+            r.type = -1;
+
+            /* a fill reports its length and carries a single byte */
+            if(r.extra < 0)
+            {
+                r.extra = -r.extra;
+                r.fill = 1;
+            }
+
+            if(r.diff < 0 || r.extra < 0 || r.diff > newsize - newpos ||
+                    r.extra > newsize - newpos - r.diff)
+                goto out;
+
+            newpos += r.diff + r.extra;
+            oldpos += r.diff + r.seek;
+        }
+
+        if(inspect_data(stream, buf, transfer, r.diff, &r.changed))
+            goto out;
+
+        mark = inspect_tell(stream);
+        r.costDiff = mark - at;
+
+        if(inspect_data(stream, buf, transfer, r.fill ? 1 : r.extra, NULL))
+            goto out;
+
+        at = inspect_tell(stream);
+        r.costExtra = at - mark;
+
+        if(visit(stream, &r))
+            goto out;
+    }
+
+    ret = 0;
+
+out:
+    TRACE_END("bspatch_inspect");
+    scratch_free(buf);
+
+    return ret;
+}
 
 //#define BSPATCH_EXECUTABLE
 
 #if defined(BSPATCH_EXECUTABLE)
 
+#include <errno.h>
 #include <string.h>
 #include <stdarg.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #include "../lzma/LzmaUtil/LzmaUtil.h"
+#include "../lzma/LzmaUtil/bsaes.h"
+#include "../lzma/LzmaUtil/bsbundle.h"
+#include "../lzma/LzmaUtil/bsseek.h"
+#include "../lzma/LzmaUtil/bsseg.h"
+#include "../lzma/Sha256.h"
 
 void err(int exitcode, const char *fmt, ...)
 {
@@ -186,140 +648,1667 @@ void err(int exitcode, const char *fmt, ...)
     exit(exitcode);
 }
 
-static int read_patch(struct bspatch_stream* stream, void *buf,  int count)
+/* the patch may be a pipe (-), a read interrupted before anything arrived
+   is tried again */
+static int read_file(void *ctx, void *buf, int count)
 {
-    if(fread(buf, 1, count, stream->opaque_r) == 0)
-        return -1;
+    uint8_t *p = buf;
+    size_t n;
 
-    return 0;
-}
+    while(count > 0)
+    {
+        if((n = fread(p, 1, count, ctx)) == 0)
+        {
+            if(!ferror((FILE *)ctx) || errno != EINTR)
+                return -1;
 
-static int read_old(struct bspatch_stream* stream, uint32_t offset, void *buf,  int count)
-{
-    if(fseek(stream->opaque_old, offset, SEEK_SET) != 0)
-        return -1;
+            clearerr(ctx);
+            continue;
+        }
 
-    if(fread(buf, 1, count, stream->opaque_old) == 0)
-        return -1;
+        p += n;
+        count -= (int)n;
+    }
 
     return 0;
 }
 
-static int lzma_read(struct bspatch_stream* stream, void* buffer, int length)
+/* the patch file, or stdin for "-": then it is read front to back only */
+static FILE *open_patch(const char *f)
 {
-	int n = decodeGetData(stream, buffer, length);
-    if (n != length)
-        return -1;
+    if(strcmp(f, "-") != 0)
+        return fopen(f, "rb");
 
-	return 0;
+#ifdef _WIN32
+    if(_setmode(_fileno(stdin), _O_BINARY) == -1)
+        return NULL;
+#endif
+
+    return stdin;
 }
 
-static int data_write(struct bspatch_stream* stream, void* buffer, int length)
+/* the payload as the decoder sees it: CRC segments checked, then
+   decrypted if the patch is encrypted */
+typedef struct
 {
-    if(fwrite(buffer, 1, length, stream->opaque_w) == 0)
-		return -1;
+    bsseg_t seg;
+    bsaes_t *aes;
+} payload_t;
 
-	return 0;
+static int read_payload(payload_t *p, void *buf, int count)
+{
+    uint32_t pos = p->seg.pos;
+    int res;
+
+    TRACE_BEGIN("read_patch");
+    res = bsseg_read(&p->seg, buf, count);
+    TRACE_END("read_patch");
+
+    if(res == BSSEG_CORRUPT)
+        printf("Corrupt patch segment %u at payload offset %u\n", p->seg.index,
+               bsseg_offset(p->seg.index, p->seg.segsize));
+
+    if(res == 0 && p->aes)
+        bsaes_code(p->aes, pos, buf, count);
+
+    return res ? -1 : 0;
 }
 
-static int get_header(unsigned char *header, uint32_t *oldsize, uint32_t *newsize, uint32_t *patchsize)
+/* opaque_r is the payload_t */
+static int read_patch(struct bspatch_stream* stream, void *buf,  int count)
 {
-    uint32_t o, n, p;
-
-    /* Header format:
-        0	8	"BSDIFF40"
-        8	8	old file size
-        16	8	new file size
-        24	8	patch file size */
+    return read_payload(stream->opaque_r, buf, count);
+}
 
-    /* Check for appropriate magic */
-    if(memcmp(header, "BSDIFF40", 8) != 0)
-        errx(1, "Corrupt patch\n");
+static void read_key(const char *f, uint8_t *key, unsigned *keySize)
+{
+    FILE *fs = fopen(f, "rb");
+    size_t n;
 
-    /* Read lengths from header */
-    o = offtin(header + 8);
-    n = offtin(header + 16);
-    p = offtin(header + 24);
-    
-    printf("old %d new %d patch %d\n", o, n, p);
+    if(fs == NULL)errx(1, "Open failed :%s", f);
 
-    if((o == 0) || (n == 0) || (p == 0))
-        errx(1, "Corrupt patch\n");
+    n = fread(key, 1, 33, fs);
+    fclose(fs);
 
-    *oldsize = o;
-    *newsize = n;
-    *patchsize = p;
+    if(n != 16 && n != 24 && n != 32)
+        errx(1, "Key must be 16, 24 or 32 bytes :%s", f);
 
-    return 0;
+    *keySize = (unsigned)n;
 }
 
-int main(int argc, char *argv[])
+/* positions |seg| at payload byte |pos|; a segment is checked from its
+   start, so the part of it before |pos| is read again */
+static int seek_payload(bsseg_t *seg, FILE *f, size_t hdrlen, uint32_t pos)
 {
-    FILE *fpatch, *fold, *fnew;
-    uint32_t oldsize, newsize, patchsize;
-	struct bspatch_stream stream;
-    unsigned char header[32];
-    unsigned char dec_h[HEADER_SIZE];
+    uint8_t skip[4096];
+    uint32_t index = seg->segsize ? pos / seg->segsize : 0;
+    uint32_t n = seg->segsize ? pos - index * seg->segsize : 0;
 
-    if(argc != 4) errx(1, "usage: %s oldfile newfile patchfile\n", argv[0]);
+    if(fseek(f, hdrlen + (seg->segsize ? bsseg_offset(index, seg->segsize) : pos), SEEK_SET) != 0)
+        return -1;
 
-    /* Open patch file */
-    if((fpatch = fopen(argv[3], "rb")) == NULL)
-        errx(1, "fopen(%s)", argv[3]);
+    bsseg_seek(seg, index);
+    if(seg->segsize == 0)
+        seg->pos = pos;
 
-    if(fread(header, 1, sizeof(header), fpatch) == 0)
+    while(n > 0)
     {
-        if(feof(fpatch))
-            errx(1, "Corrupt patch\n");
+        uint32_t k = n < sizeof(skip) ? n : sizeof(skip);
 
-        errx(1, "fread(%s)", argv[3]);
+        if(bsseg_read(seg, skip, k))
+            return -1;
+
+        n -= k;
     }
 
-    get_header(header, &oldsize, &newsize, &patchsize);
+    return 0;
+}
+
+static void *map_old(const char *f, uint32_t size)
+{
+    void *p;
+#ifdef _WIN32
+    HANDLE fh, mh;
+    LARGE_INTEGER len;
 
-    /* Read decoder header */
-    if(fread(dec_h, 1, sizeof(dec_h), fpatch) == 0)
-    {
-        if(feof(fpatch))
-            errx(1, "Corrupt patch\n");
+    fh = CreateFileA(f, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                     FILE_FLAG_RANDOM_ACCESS, NULL);
+    if(fh == INVALID_HANDLE_VALUE)
+        return NULL;
 
-        errx(1, "fread(%s)", argv[3]);
+    /* a short old file would fault inside the mapping */
+    if(!GetFileSizeEx(fh, &len) || len.QuadPart < size)
+    {
+        CloseHandle(fh);
+        return NULL;
     }
 
-    /* create new file */
-    fnew = fopen(argv[2], "wb+");
-    if(fnew == NULL)errx(1, "Open failed :%s", argv[2]);
+    mh = CreateFileMappingA(fh, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(fh);
+    if(mh == NULL)
+        return NULL;
 
-    /* Open old file */
-    fold = fopen(argv[1], "rb+");
-    if(fold == NULL)errx(1, "Open failed :%s", argv[1]);
+    p = MapViewOfFile(mh, FILE_MAP_READ, 0, 0, size);
+    CloseHandle(mh);
+#else
+    int fd;
+    struct stat st;
 
-    decodeInit(dec_h, sizeof(dec_h), patchsize);
-    
-	stream.read = lzma_read;
-    stream.rpatch = read_patch;
-	stream.opaque_r = fpatch;
-    
-    stream.write = data_write;
-    stream.opaque_w = fnew;
-    
-    stream.rold = read_old;
-	stream.opaque_old = fold;
+    fd = open(f, O_RDONLY);
+    if(fd < 0)
+        return NULL;
 
-    if (bspatch(&stream, oldsize, newsize))
-		errx(1, "bspatch");
+    /* a short old file would fault inside the mapping */
+    if(fstat(fd, &st) != 0 || st.st_size < (off_t)size)
+    {
+        close(fd);
+        return NULL;
+    }
 
-    decodeUninit();
+    p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED)
+        return NULL;
 
-    if(fclose(fold) == -1)
-        errx(1, "Close failed :%s", argv[1]);
-    
+    /* access follows the control stream, not the file order */
+    madvise(p, size, MADV_RANDOM);
+#endif
+
+    return p;
+}
+
+static void unmap_old(void *p, uint32_t size)
+{
+#ifdef _WIN32
+    (void)size;
+    UnmapViewOfFile(p);
+#else
+    munmap(p, size);
+#endif
+}
+
+/* in-place: the image is mapped writable and grown to |size| */
+static void *map_image(const char *f, uint32_t oldsize, uint32_t size)
+{
+    void *p;
+#ifdef _WIN32
+    HANDLE fh, mh;
+    LARGE_INTEGER len;
+
+    fh = CreateFileA(f, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
+                     FILE_FLAG_RANDOM_ACCESS, NULL);
+    if(fh == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    if(!GetFileSizeEx(fh, &len) || len.QuadPart < oldsize)
+    {
+        CloseHandle(fh);
+        return NULL;
+    }
+
+    /* a mapping larger than the file extends it */
+    mh = CreateFileMappingA(fh, NULL, PAGE_READWRITE, 0, size, NULL);
+    CloseHandle(fh);
+    if(mh == NULL)
+        return NULL;
+
+    p = MapViewOfFile(mh, FILE_MAP_WRITE, 0, 0, size);
+    CloseHandle(mh);
+#else
+    int fd;
+    struct stat st;
+
+    fd = open(f, O_RDWR);
+    if(fd < 0)
+        return NULL;
+
+    if(fstat(fd, &st) != 0 || st.st_size < (off_t)oldsize ||
+            (st.st_size < (off_t)size && ftruncate(fd, size) != 0))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED)
+        return NULL;
+
+    madvise(p, size, MADV_RANDOM);
+#endif
+
+    return p;
+}
+
+/* flushes the image and cuts the file to the new size */
+static int unmap_image(const char *f, void *p, uint32_t size, uint32_t newsize)
+{
+#ifdef _WIN32
+    HANDLE fh;
+    LARGE_INTEGER len;
+    BOOL ok;
+
+    ok = FlushViewOfFile(p, 0);
+    UnmapViewOfFile(p);
+    (void)size;
+
+    fh = CreateFileA(f, GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+    if(fh == INVALID_HANDLE_VALUE)
+        return -1;
+
+    len.QuadPart = newsize;
+    ok = ok && SetFilePointerEx(fh, len, NULL, FILE_BEGIN) && SetEndOfFile(fh);
+    CloseHandle(fh);
+
+    return ok ? 0 : -1;
+#else
+    int ret = msync(p, size, MS_SYNC);
+
+    munmap(p, size);
+
+    if(ret == 0 && truncate(f, newsize) != 0)
+        ret = -1;
+
+    return ret;
+#endif
+}
+
+static int copy_file(const char *from, const char *to)
+{
+    FILE *fi, *fo;
+    char buf[1 << 16];
+    size_t n;
+    int ret = 0;
+
+    if((fi = fopen(from, "rb")) == NULL)
+        return -1;
+
+    if((fo = fopen(to, "wb")) == NULL)
+    {
+        fclose(fi);
+        return -1;
+    }
+
+    while((n = fread(buf, 1, sizeof(buf), fi)) > 0)
+        if(fwrite(buf, 1, n, fo) != n)
+            ret = -1;
+
+    if(ferror(fi))
+        ret = -1;
+
+    fclose(fi);
+    if(fclose(fo) != 0)
+        ret = -1;
+
+    return ret;
+}
+
+static void advise_old(struct bspatch_stream* stream, uint32_t offset, int length)
+{
+#ifdef _WIN32
+    (void)stream; (void)offset; (void)length;
+#else
+    /* madvise wants a page aligned start */
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)stream->opaque_old + offset;
+    uintptr_t aligned = start & ~(page - 1);
+
+    madvise((void *)aligned, length + (start - aligned), MADV_WILLNEED);
+#endif
+}
+
+static int lzma_read(struct bspatch_stream* stream, void* buffer, int length)
+{
+    int n = decodeGetData(stream, buffer, length);
+    if (n != length)
+        return -1;
+
+    return 0;
+}
+
+#define WRITE_BUF_SIZE (1 << 20)
+#define WRITE_BUF_ALIGN 4096
+
+/* collects output into large aligned blocks so the file sees few big writes */
+typedef struct
+{
+    FILE *f;
+    uint8_t *buf;
+    size_t size;
+    size_t used;
+    CSha256 *sha;   /* optional, hashes everything flushed */
+    int hole;       /* skipped over zeros, the file size needs setting */
+    int skip;       /* fill byte seeked over: 0, or 0xFF over erased flash (-e) */
+} writer_t;
+
+static int writer_init(writer_t *w, FILE *f, size_t size)
+{
+    w->f = f;
+    w->size = size ? (size + WRITE_BUF_ALIGN - 1) & ~(size_t)(WRITE_BUF_ALIGN - 1) : WRITE_BUF_SIZE;
+    w->used = 0;
+    w->sha = NULL;
+    w->hole = 0;
+    w->skip = 0;
+    w->buf = bsmem_alloc_aligned(BSMEM_WRITER, w->size, WRITE_BUF_ALIGN);
+    if(w->buf == NULL)
+        return -1;
+
+    /* stdio buffering on top would only add a copy */
+    setvbuf(f, NULL, _IONBF, 0);
+
+    return 0;
+}
+
+static int writer_flush(writer_t *w)
+{
+    if(w->sha)
+        Sha256_Update(w->sha, w->buf, w->used);
+
+    TRACE_BEGIN("write");
+    if(w->used && fwrite(w->buf, 1, w->used, w->f) != w->used)
+    {
+        TRACE_END("write");
+        return -1;
+    }
+    TRACE_END("write");
+
+    w->used = 0;
+
+    return 0;
+}
+
+static void writer_free(writer_t *w)
+{
+    bsmem_free(w->buf);
+}
+
+static int data_reserve(struct bspatch_stream* stream, void** buffer, int length)
+{
+    writer_t *w = stream->opaque_w;
+    size_t n;
+
+    if(w->used == w->size && writer_flush(w))
+        return -1;
+
+    n = w->size - w->used;
+    if(n > (size_t)length)
+        n = length;
+
+    *buffer = w->buf + w->used;
+
+    return (int)n;
+}
+
+static int data_write(struct bspatch_stream* stream, const void* buffer, int length)
+{
+    writer_t *w = stream->opaque_w;
+    const uint8_t *p = buffer;
+    size_t n;
+
+    /* filled in place after data_reserve */
+    if(p == w->buf + w->used)
+    {
+        w->used += length;
+        return 0;
+    }
+
+    while(length > 0)
+    {
+        if(w->used == w->size && writer_flush(w))
+            return -1;
+
+        n = w->size - w->used;
+        if(n > (size_t)length)
+            n = length;
+
+        memcpy(w->buf + w->used, p, n);
+        w->used += n;
+        p += n;
+        length -= n;
+    }
+
+	return 0;
+}
+
+/* fill tuples: long runs of the skip byte are seeked over, zeros leave a
+   hole in the file and 0xFF what erased flash already holds; anything else
+   goes through the buffer */
+static int data_fill(struct bspatch_stream* stream, int byte, int length)
+{
+    writer_t *w = stream->opaque_w;
+    size_t n;
+
+    if(byte == w->skip && length >= WRITE_BUF_ALIGN)
+    {
+        if(writer_flush(w))
+            return -1;
+
+        /* the digest still covers the run */
+        if(w->sha)
+        {
+            memset(w->buf, byte, w->size);
+
+            for(n = length; n > 0; n -= n < w->size ? n : w->size)
+                Sha256_Update(w->sha, w->buf, n < w->size ? n : w->size);
+        }
+
+        if(fseek(w->f, length, SEEK_CUR) != 0)
+            return -1;
+
+        if(byte == 0)
+            w->hole = 1;
+
+        return 0;
+    }
+
+    while(length > 0)
+    {
+        if(w->used == w->size && writer_flush(w))
+            return -1;
+
+        n = w->size - w->used;
+        if(n > (size_t)length)
+            n = length;
+
+        memset(w->buf + w->used, byte, n);
+        w->used += n;
+        length -= (int)n;
+    }
+
+    return 0;
+}
+
+/* reads the patch header, v40 or v41 (bshdr.h), into |raw|; returns its length */
+static size_t read_header(FILE *f, bshdr_t *h, unsigned char *raw)
+{
+    size_t have = 0;
+    int need = BSHDR_SIZE_V40;
+
+    while((size_t)need > have)
+    {
+        if(read_file(f, raw + have, (int)(need - have)))
+            errx(1, "Corrupt patch\n");
+
+        have = need;
+
+        need = bshdr_read(h, raw, have);
+        if(need < 0)
+            errx(1, "Corrupt patch\n");
+    }
+
+    printf("old %d new %d patch %d\n", h->oldsize, h->newsize, h->patchsize);
+
+    return have;
+}
+
+/* 0 if |size| bytes at |p| hash to |digest| */
+static int sha_check(const void *p, uint32_t size, const uint8_t *digest)
+{
+    CSha256 sha;
+    uint8_t d[SHA256_DIGEST_SIZE];
+
+    Sha256_Init(&sha);
+    Sha256_Update(&sha, p, size);
+    Sha256_Final(&sha, d);
+
+    return memcmp(d, digest, sizeof(d)) == 0 ? 0 : -1;
+}
+
+/* The new image replaces the old one in its own file. With distinct old and
+   new names old is copied first, so only new is modified. */
+static int patch_inplace(char *argv[], FILE *fpatch, payload_t *payload, unsigned char *dec_h,
+                         const bshdr_t *hdr, int verify, size_t transfer, size_t rsize)
+{
+    struct bspatch_stream stream;
+    decode_t dec;
+    void *image;
+    uint32_t oldsize = hdr->oldsize, newsize = hdr->newsize;
+    uint32_t size = oldsize > newsize ? oldsize : newsize;
+
+    if(strcmp(argv[1], argv[2]) != 0 && copy_file(argv[1], argv[2]))
+        errx(1, "Copy failed :%s", argv[2]);
+
+    image = map_image(argv[2], oldsize, size);
+    if(image == NULL)errx(1, "Map failed :%s", argv[2]);
+
+    /* nothing is overwritten yet */
+    if(verify && sha_check(image, oldsize, hdr->oldsha))
+        errx(1, "Old file does not match the patch :%s\n", argv[2]);
+
+    if(decodeInit(&dec, dec_h, HEADER_SIZE, payload->seg.datasize - HEADER_SIZE, rsize, transfer) != SZ_OK)
+        errx(1, "Corrupt patch\n");
+
+    memset(&stream, 0, sizeof(stream));
+    stream.read = lzma_read;
+    stream.borrow = decodeBorrow;
+    stream.rpatch = read_patch;
+    stream.opaque_r = payload;
+    stream.opaque_dec = &dec;
+    stream.transfer_size = (int)transfer;
+
+    stream.rold = bspatch_rold_mem;
+    stream.wold = bspatch_wold_mem;
+    stream.opaque_old = image;
+
+    if(bspatch_inplace(&stream, oldsize, newsize))
+        errx(1, "bspatch");
+
+    decodeUninit(&dec);
+
+    if((hdr->flags & BSHDR_SHA256) && sha_check(image, newsize, hdr->newsha))
+        errx(1, "New file does not match the patch :%s\n", argv[2]);
+
+    if(unmap_image(argv[2], image, size, newsize))
+        errx(1, "Write failed :%s", argv[2]);
+
+    bsseg_free(&payload->seg);
+    if(fclose(fpatch) == -1)
+        errx(1, "fclose(%s)", argv[3]);
+
+    return 0;
+}
+
+/* reads the manifest block that follows a bundle's header */
+static void read_manifest(FILE *f, const bshdr_t *hdr, bsbundle_t *b)
+{
+    uint8_t *block = bsmem_alloc(BSMEM_OTHER, hdr->manifestsize);
+
+    if(block == NULL)
+        errx(1, "Malloc failed\n");
+
+    bsbundle_init(b);
+
+    if(read_file(f, block, (int)hdr->manifestsize) ||
+            bsbundle_unpack(b, block, hdr->manifestsize))
+        errx(1, "Corrupt patch\n");
+
+    bsmem_free(block);
+}
+
+/* bundle output: the patched image cut into the manifest's new files */
+typedef struct
+{
+    const char *root;
+    const bsbundle_t *b;
+    size_t next;        /* manifest entry to look at */
+    FILE *f;
+    uint32_t left;      /* of the open file */
+    CSha256 sha;
+} tree_t;
+
+/* opens the next new file that takes bytes, creating the empty ones on the
+   way; with |last| only the empty ones, returns -1 if more files follow */
+static int tree_open(tree_t *t, int last)
+{
+    char path[FILENAME_MAX];
+
+    for(; t->next < t->b->count; t->next++)
+    {
+        const bsbundle_entry_t *e = &t->b->e[t->next];
+
+        if(e->kind != BSBUNDLE_NEW)
+            continue;
+
+        if(e->size && last)
+            return -1;
+
+        if(bsbundle_mkdirs(t->root, e->path) || bsbundle_path(path, sizeof(path), t->root, e->path) ||
+                (t->f = fopen(path, "wb")) == NULL)
+            errx(1, "Open failed :%s/%s", t->root, e->path);
+
+        if(e->size)
+        {
+            t->left = e->size;
+            t->next++;
+            return 0;
+        }
+
+        fclose(t->f);
+        t->f = NULL;
+    }
+
+    return last ? 0 : -1;
+}
+
+static int tree_write(struct bspatch_stream *stream, const void *buffer, int length)
+{
+    tree_t *t = stream->opaque_w;
+    const uint8_t *p = buffer;
+    uint32_t n;
+
+    while(length > 0)
+    {
+        if(t->f == NULL && tree_open(t, 0))
+            return -1;
+
+        n = (uint32_t)length < t->left ? (uint32_t)length : t->left;
+
+        if(fwrite(p, 1, n, t->f) != n)
+            return -1;
+
+        Sha256_Update(&t->sha, p, n);
+        p += n;
+        length -= n;
+        t->left -= n;
+
+        if(t->left == 0)
+        {
+            if(fclose(t->f) != 0)
+                return -1;
+
+            t->f = NULL;
+        }
+    }
+
+    return 0;
+}
+
+/* -b: applies a bundle from the old tree in argv[1] to a new tree in argv[2] */
+static int patch_tree(char *argv[], FILE *fpatch, payload_t *payload, unsigned char *dec_h,
+                      const bshdr_t *hdr, const bsbundle_t *b, size_t transfer, size_t rsize,
+                      int pipelined)
+{
+    char path[FILENAME_MAX], from[FILENAME_MAX];
+    struct bspatch_stream stream;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    unsigned char *pold;
+    uint32_t pos = 0;
+    decode_t dec;
+    tree_t tree;
+    size_t i;
+
+    /* copies read old files after new ones have been written */
+    if(strcmp(argv[1], argv[2]) == 0)
+        errx(1, "A bundle needs a new directory apart from the old one\n");
+
+    if(bsbundle_mkdirs(argv[2], "") != 0)
+        errx(1, "Open failed :%s", argv[2]);
+
+    if((pold = bsmem_alloc(BSMEM_IMAGE, (size_t)hdr->oldsize + 1)) == NULL)
+        errx(1, "Malloc failed\n");
+
+    /* the old corpus, in manifest order */
+    for(i = 0; i < b->count; i++)
+    {
+        const bsbundle_entry_t *e = &b->e[i];
+        FILE *f;
+
+        if(e->kind != BSBUNDLE_OLD)
+            continue;
+
+        if(e->size > hdr->oldsize - pos)
+            errx(1, "Corrupt patch\n");
+
+        if(bsbundle_path(path, sizeof(path), argv[1], e->path) || (f = fopen(path, "rb")) == NULL)
+            errx(1, "Open failed :%s/%s", argv[1], e->path);
+
+        if(fread(pold + pos, 1, e->size, f) != e->size || fgetc(f) != EOF)
+            errx(1, "Old tree does not match the patch :%s\n", path);
+
+        fclose(f);
+        pos += e->size;
+    }
+
+    if(pos != hdr->oldsize)
+        errx(1, "Corrupt patch\n");
+
+    /* copies come from the corpus files, so it is always checked: with the
+       new digest that covers every file of the new tree */
+    if((hdr->flags & BSHDR_SHA256) && sha_check(pold, hdr->oldsize, hdr->oldsha))
+        errx(1, "Old tree does not match the patch :%s\n", argv[1]);
+
+    if(decodeInit(&dec, dec_h, HEADER_SIZE, payload->seg.datasize - HEADER_SIZE, rsize, transfer) != SZ_OK)
+        errx(1, "Corrupt patch\n");
+
+    memset(&tree, 0, sizeof(tree));
+    tree.root = argv[2];
+    tree.b = b;
+    Sha256_Init(&tree.sha);
+
+    memset(&stream, 0, sizeof(stream));
+    stream.read = lzma_read;
+    stream.borrow = decodeBorrow;
+    stream.rpatch = read_patch;
+    stream.opaque_r = payload;
+    stream.opaque_dec = &dec;
+    stream.write = tree_write;
+    stream.opaque_w = &tree;
+    stream.transfer_size = (int)transfer;
+    stream.rold = bspatch_rold_mem;
+    stream.opaque_old = pold;
+
+#if defined(BSPATCH_STATIC)
+    UNUSED_VAR(pipelined);
+    if(bspatch(&stream, hdr->oldsize, hdr->newsize))
+#else
+    if(pipelined ? bspatch_mt(&stream, hdr->oldsize, hdr->newsize) :
+            bspatch(&stream, hdr->oldsize, hdr->newsize))
+#endif
+        errx(1, "bspatch");
+
+    /* every byte must have found its file */
+    if(tree.f != NULL || tree_open(&tree, 1))
+        errx(1, "Corrupt patch\n");
+
+    decodeUninit(&dec);
+    bsmem_free(pold);
+
+    if(hdr->flags & BSHDR_SHA256)
+    {
+        Sha256_Final(&tree.sha, digest);
+        if(memcmp(digest, hdr->newsha, sizeof(digest)) != 0)
+            errx(1, "New tree does not match the patch :%s\n", argv[2]);
+    }
+
+    /* unchanged, renamed and copied files come straight from old */
+    for(i = 0; i < b->count; i++)
+    {
+        const bsbundle_entry_t *e = &b->e[i];
+
+        if(e->kind != BSBUNDLE_COPY)
+            continue;
+
+        if(bsbundle_path(from, sizeof(from), argv[1], e->from) ||
+                bsbundle_path(path, sizeof(path), argv[2], e->path) ||
+                bsbundle_mkdirs(argv[2], e->path) || copy_file(from, path))
+            errx(1, "Copy failed :%s", path);
+    }
+
+    bsseg_free(&payload->seg);
+    if(fclose(fpatch) == -1)
+        errx(1, "fclose(%s)", argv[3]);
+
+    return 0;
+}
+
+/* a decoded block of a seekable patch, what bspatch_range reads from */
+typedef struct
+{
+    const uint8_t *p;
+    size_t left;
+} block_t;
+
+static int block_read(struct bspatch_stream *stream, void *buffer, int length)
+{
+    block_t *b = stream->opaque_r;
+
+    if((size_t)length > b->left)
+        return -1;
+
+    memcpy(buffer, b->p, length);
+    b->p += length;
+    b->left -= length;
+
+    return 0;
+}
+
+static int block_borrow(struct bspatch_stream *stream, const void **buffer, int length)
+{
+    block_t *b = stream->opaque_r;
+
+    if((size_t)length > b->left)
+        length = (int)b->left;
+
+    *buffer = b->p;
+    b->p += length;
+    b->left -= length;
+
+    return length;
+}
+
+/* a buffer of at least |size| bytes, the contents need not survive */
+static uint8_t *grow(uint8_t *p, size_t *cap, size_t size)
+{
+    if(size <= *cap)
+        return p;
+
+    bsmem_free(p);
+    if((p = bsmem_alloc(BSMEM_PATCH_IN, size)) == NULL)
+        errx(1, "Malloc failed\n");
+
+    *cap = size;
+
+    return p;
+}
+
+/* Seekable patch: new bytes [from, to) into newfile, decoding only the
+   blocks that cover them; the whole image is checked against its digest */
+static int patch_seekable(char *argv[], FILE *fpatch, size_t hdrlen, payload_t *payload,
+                          const bshdr_t *hdr, int verify, uint32_t from, uint32_t to,
+                          size_t transfer, size_t wsize)
+{
+    struct bspatch_stream stream;
+    bsseek_t index;
+    block_t block;
+    writer_t writer;
+    CSha256 sha;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    uint8_t *entries, *packed = NULL, *raw = NULL;
+    size_t packedCap = 0, rawCap = 0;
+    uint32_t bs = hdr->blocksize, count = bsseek_count(hdr->newsize, bs), i;
+    void *pold;
+    FILE *fnew;
+
+    if(from > to || to > hdr->newsize)
+        errx(1, "Range %u:%u is outside new (%u bytes)\n", from, to, hdr->newsize);
+
+    if((uint64_t)count * BSSEEK_ENTRY_SIZE > payload->seg.datasize)
+        errx(1, "Corrupt patch\n");
+
+    entries = bsmem_alloc(BSMEM_PATCH_IN, (size_t)count * BSSEEK_ENTRY_SIZE);
+    if(entries == NULL || read_payload(payload, entries, count * BSSEEK_ENTRY_SIZE) ||
+            bsseek_load(&index, entries, hdr->newsize, bs, payload->seg.datasize))
+        errx(1, "Corrupt patch\n");
+
+    bsmem_free(entries);
+
+    pold = map_old(argv[1], hdr->oldsize);
+    if(pold == NULL)errx(1, "Map failed :%s", argv[1]);
+
+    if(verify && sha_check(pold, hdr->oldsize, hdr->oldsha))
+        errx(1, "Old file does not match the patch :%s\n", argv[1]);
+
+    if((fnew = fopen(argv[2], "wb")) == NULL || writer_init(&writer, fnew, wsize))
+        errx(1, "Open failed :%s", argv[2]);
+
+    Sha256_Init(&sha);
+    if(from == 0 && to == hdr->newsize && (hdr->flags & BSHDR_SHA256))
+        writer.sha = &sha;
+
+    memset(&stream, 0, sizeof(stream));
+    stream.read = block_read;
+    stream.borrow = block_borrow;
+    stream.opaque_r = &block;
+
+    stream.write = data_write;
+    stream.opaque_w = &writer;
+    stream.transfer_size = (int)transfer;
+
+    stream.rold = bspatch_rold_mem;
+    stream.advise = advise_old;
+    stream.opaque_old = pold;
+
+    for(i = from / bs; from < to; i++)
+    {
+        uint32_t size = index.offset[i + 1] - index.offset[i];
+        uint32_t end = hdr->newsize - i * bs > bs ? (i + 1) * bs : hdr->newsize;
+        uint64_t rawsize;
+        bspatch_state at;
+
+        /* blocks in a row follow each other in the payload */
+        if(payload->seg.pos != index.offset[i] &&
+                seek_payload(&payload->seg, fpatch, hdrlen, index.offset[i]))
+            errx(1, "Corrupt patch\n");
+
+        packed = grow(packed, &packedCap, size);
+        if(read_payload(payload, packed, size))
+            errx(1, "Corrupt patch\n");
+
+        TRACE_BEGIN("lzma_block");
+        if(lzma_block_size(packed, size, &rawsize) || rawsize > bsseek_max_raw(bs) ||
+                lzma_block_decode(packed, size, raw = grow(raw, &rawCap, (size_t)rawsize), (size_t)rawsize))
+            errx(1, "Corrupt patch\n");
+        TRACE_END("lzma_block");
+
+        block.p = raw;
+        block.left = (size_t)rawsize;
+
+        memset(&at, 0, sizeof(at));
+        at.newpos = i * bs;
+        at.oldpos = index.oldpos[i];
+
+        if(bspatch_range(&stream, hdr->oldsize, &at, end, from, to < end ? to : end))
+            errx(1, "bspatch");
+
+        from = to < end ? to : end;
+    }
+
+    if(writer_flush(&writer))
+        errx(1, "fwrite(%s)", argv[2]);
+
+    if(writer.sha)
+    {
+        Sha256_Final(&sha, digest);
+        if(memcmp(digest, hdr->newsha, sizeof(digest)) != 0)
+            errx(1, "New file does not match the patch :%s\n", argv[2]);
+    }
+
+    bsmem_free(packed);
+    bsmem_free(raw);
+    bsseek_free(&index);
+    writer_free(&writer);
+    unmap_old(pold, hdr->oldsize);
+
+    if(fclose(fnew) == -1)
+        errx(1, "fclose(%s)", argv[2]);
+
+    bsseg_free(&payload->seg);
+    if(fclose(fpatch) == -1)
+        errx(1, "fclose(%s)", argv[3]);
+
+    return 0;
+}
+
+#define CHECKPOINT_INTERVAL (1 << 20)
+#define JOURNAL_MAGIC "BSPJ0001"
+
+/* Journal layout:
+    0	8	"BSPJ0001"
+    8	4	header length
+    12	-	header of the patch being applied
+    -	-	bspatch_state
+    -	-	SHA-256 state of the output so far
+    -	4	decoder blob size
+    -	-	decoder blob (decodeSave) */
+typedef struct
+{
+    char path[FILENAME_MAX];
+    unsigned char header[BSHDR_SIZE_MAX];
+    uint32_t hdrlen;
+    CSha256 *sha;
+} journal_t;
+
+static int sync_file(FILE *f)
+{
+    if(fflush(f) != 0)
+        return -1;
+#ifdef _WIN32
+    return _commit(_fileno(f));
+#else
+    return fsync(fileno(f));
+#endif
+}
+
+static int set_file_size(FILE *f, uint32_t size)
+{
+#ifdef _WIN32
+    return _chsize_s(_fileno(f), size) == 0 ? 0 : -1;
+#else
+    return ftruncate(fileno(f), size);
+#endif
+}
+
+/* checkpoint callback: output first, then the journal, replaced atomically
+   so a crash leaves either the old or the new checkpoint */
+static int journal_write(struct bspatch_stream *stream, const bspatch_state *st)
+{
+    journal_t *j = stream->opaque_cp;
+    writer_t *w = stream->opaque_w;
+    char tmp[FILENAME_MAX + 4];
+    uint8_t *blob;
+    uint32_t size;
+    FILE *f;
+    int ret = -1;
+
+    if(writer_flush(w))
+        return -1;
+
+    /* a trailing hole only exists once the size says so */
+    if((w->hole && set_file_size(w->f, (uint32_t)ftell(w->f))) || sync_file(w->f))
+        return -1;
+
+    size = (uint32_t)decodeSave(stream->opaque_dec, NULL);
+    blob = bsmem_alloc(BSMEM_JOURNAL, size);
+    if(blob == NULL)
+        return -1;
+
+    decodeSave(stream->opaque_dec, blob);
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", j->path);
+    if((f = fopen(tmp, "wb")) == NULL)
+        goto out;
+
+    if(fwrite(JOURNAL_MAGIC, 8, 1, f) == 1 && fwrite(&j->hdrlen, sizeof(j->hdrlen), 1, f) == 1 &&
+            fwrite(j->header, j->hdrlen, 1, f) == 1 && fwrite(st, sizeof(*st), 1, f) == 1 &&
+            fwrite(j->sha, sizeof(*j->sha), 1, f) == 1 && fwrite(&size, sizeof(size), 1, f) == 1 &&
+            fwrite(blob, size, 1, f) == 1 && sync_file(f) == 0)
+        ret = 0;
+
+    if(fclose(f) != 0)
+        ret = -1;
+
+#ifdef _WIN32
+    if(ret == 0 && !MoveFileExA(tmp, j->path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+        ret = -1;
+#else
+    if(ret == 0 && rename(tmp, j->path) != 0)
+        ret = -1;
+#endif
+
+out:
+    bsmem_free(blob);
+
+    return ret;
+}
+
+/* the last checkpoint for this patch, if there is one */
+static int journal_read(const journal_t *j, bspatch_state *st, uint8_t **blob, uint32_t *size)
+{
+    unsigned char magic[8], header[BSHDR_SIZE_MAX];
+    uint32_t hdrlen;
+    CSha256 sha;
+    FILE *f;
+
+    if((f = fopen(j->path, "rb")) == NULL)
+        return -1;
+
+    *blob = NULL;
+
+    if(fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, JOURNAL_MAGIC, 8) != 0 ||
+            fread(&hdrlen, sizeof(hdrlen), 1, f) != 1 || hdrlen != j->hdrlen ||
+            fread(header, hdrlen, 1, f) != 1 || memcmp(header, j->header, hdrlen) != 0 ||
+            fread(st, sizeof(*st), 1, f) != 1 || fread(&sha, sizeof(sha), 1, f) != 1 ||
+            fread(size, sizeof(*size), 1, f) != 1 ||
+            (*blob = bsmem_alloc(BSMEM_JOURNAL, *size)) == NULL || fread(*blob, *size, 1, f) != 1)
+    {
+        bsmem_free(*blob);
+        fclose(f);
+        return -1;
+    }
+
+    fclose(f);
+
+    /* the block function is this process's own */
+    *j->sha = sha;
+    Sha256_SetFunction(j->sha, SHA256_ALGO_DEFAULT);
+
+    return 0;
+}
+
+/* a bundle's manifest sits between header and payload; read over, not
+   seeked, so a pipe works too */
+static void skip_manifest(FILE *f, const bshdr_t *hdr)
+{
+    uint8_t skip[4096];
+    uint32_t n = (hdr->flags & BSHDR_BUNDLE) ? hdr->manifestsize : 0, k;
+
+    for(; n > 0; n -= k)
+    {
+        k = n < sizeof(skip) ? n : sizeof(skip);
+
+        if(read_file(f, skip, k))
+            errx(1, "Corrupt patch\n");
+    }
+}
+
+/* the payload after the header, through its CRC segments if it has them;
+   reads the decoder header into |dec_h| unless that is NULL */
+static void open_payload(FILE *fpatch, const bshdr_t *hdr, payload_t *payload, bsaes_t *aes,
+                         const uint8_t *key, unsigned keySize, unsigned char *dec_h)
+{
+    uint32_t segsize = (hdr->flags & BSHDR_CRC32) ? hdr->segsize : 0;
+
+    if(bsseg_init(&payload->seg, segsize, bsseg_data_size(hdr->patchsize, segsize), 0,
+                  read_file, fpatch))
+        errx(1, "Malloc failed\n");
+
+    payload->aes = NULL;
+
+    if(hdr->flags & BSHDR_AES)
+    {
+        bsaes_prepare();
+        if(keySize == 0 || bsaes_init(aes, key, keySize, hdr->nonce))
+            errx(1, "Patch is encrypted, it needs -k<keyfile>\n");
+
+        payload->aes = aes;
+    }
+
+    if(dec_h == NULL)
+        return;
+
+    if(payload->seg.datasize < HEADER_SIZE)
+        errx(1, "Corrupt patch\n");
+
+    if(read_payload(payload, dec_h, HEADER_SIZE))
+        errx(1, "Corrupt patch\n");
+}
+
+/* --inspect: decoded bytes per tell() step, the grain of the cost figures */
+#define INSPECT_GRAIN 256
+
+typedef struct
+{
+    FILE *f;
+    decode_t *dec;
+    uint32_t payload;   /* LZMA data size */
+    uint32_t tuples;
+    uint64_t diff, extra, changed, costDiff, costExtra;
+} inspect_t;
+
+static uint64_t inspect_tell_dec(struct bspatch_stream *stream)
+{
+    inspect_t *in = stream->opaque_w;
+
+    return in->payload - decodeRemaining(in->dec);
+}
+
+static int inspect_visit(struct bspatch_stream *stream, const bspatch_region *r)
+{
+    inspect_t *in = stream->opaque_w;
+
+    fprintf(in->f, "%s\n    {\"new\": %d, \"old\": %d, \"diff\": %d, \"extra\": %d, \"seek\": %d, "
+            "\"changed\": %d, \"type\": %d, \"fill\": %s, \"cost_diff\": %llu, \"cost_extra\": %llu}",
+            in->tuples ? "," : "", r->newpos, r->oldpos, r->diff, r->extra, r->seek, r->changed,
+            r->type, r->fill ? "true" : "false", (unsigned long long)r->costDiff, (unsigned long long)r->costExtra);
+
+    in->tuples++;
+    in->diff += r->diff;
+    in->extra += r->extra;
+    in->changed += r->changed;
+    in->costDiff += r->costDiff;
+    in->costExtra += r->costExtra;
+
+    return 0;
+}
+
+/* --inspect: decodes the patch without old or new and writes one JSON record
+   per control tuple with the payload bytes it took */
+static int inspect_patch(const char *f, const char *out, size_t rsize, const uint8_t *key,
+                         unsigned keySize)
+{
+    FILE *fpatch;
+    unsigned char header[BSHDR_SIZE_MAX];
+    unsigned char dec_h[HEADER_SIZE];
+    struct bspatch_stream stream;
+    payload_t payload;
+    bsaes_t aes;
+    bshdr_t hdr;
+    decode_t dec;
+    inspect_t in;
+    size_t hdrlen;
+    int inplace;
+
+    if((fpatch = open_patch(f)) == NULL)
+        errx(1, "fopen(%s)", f);
+
+    hdrlen = read_header(fpatch, &hdr, header) + hdr.manifestsize;
+    skip_manifest(fpatch, &hdr);
+
+    if(hdr.flags & BSHDR_SEEKABLE)
+        errx(1, "Seekable patches cannot be inspected\n");
+    open_payload(fpatch, &hdr, &payload, &aes, key, keySize, dec_h);
+
+    memset(&in, 0, sizeof(in));
+    in.dec = &dec;
+    in.payload = payload.seg.datasize - HEADER_SIZE;
+
+    if(decodeInit(&dec, dec_h, sizeof(dec_h), in.payload, rsize, INSPECT_GRAIN) != SZ_OK)
+        errx(1, "Corrupt patch\n");
+
+    if((in.f = fopen(out, "w")) == NULL)
+        errx(1, "fopen(%s)", out);
+
+    inplace = (hdr.flags & BSHDR_INPLACE) != 0;
+
+    fprintf(in.f, "{\n  \"oldsize\": %u,\n  \"newsize\": %u,\n  \"patchsize\": %u,\n"
+            "  \"manifest\": %u,\n  \"payload\": %u,\n  \"inplace\": %s,\n  \"encrypted\": %s,\n  \"segsize\": %u,\n"
+            "  \"regions\": [", hdr.oldsize, hdr.newsize, hdr.patchsize, hdr.manifestsize, in.payload,
+            inplace ? "true" : "false", (hdr.flags & BSHDR_AES) ? "true" : "false",
+            (hdr.flags & BSHDR_CRC32) ? hdr.segsize : 0);
+
+    memset(&stream, 0, sizeof(stream));
+    stream.read = lzma_read;
+    stream.borrow = decodeBorrow;
+    stream.rpatch = read_patch;
+    stream.opaque_r = &payload;
+    stream.opaque_dec = &dec;
+    stream.opaque_w = &in;
+    stream.tell = inspect_tell_dec;
+    stream.transfer_size = INSPECT_GRAIN;
+
+    if(bspatch_inspect(&stream, hdr.newsize, inplace, inspect_visit))
+        errx(1, "Corrupt patch\n");
+
+    /* header, framing and what the decoder read past the last tuple */
+    fprintf(in.f, "\n  ],\n  \"totals\": {\"tuples\": %u, \"diff\": %llu, \"extra\": %llu, "
+            "\"changed\": %llu, \"diff_ratio\": %.4f, \"cost_diff\": %llu, \"cost_extra\": %llu, "
+            "\"cost_other\": %llu}\n}\n", in.tuples, (unsigned long long)in.diff,
+            (unsigned long long)in.extra, (unsigned long long)in.changed,
+            in.diff + in.extra ? (double)in.diff / (in.diff + in.extra) : 0.0,
+            (unsigned long long)in.costDiff, (unsigned long long)in.costExtra,
+            (unsigned long long)(hdrlen + hdr.patchsize - in.costDiff - in.costExtra));
+
+    decodeUninit(&dec);
+    bsseg_free(&payload.seg);
+    fclose(fpatch);
+
+    if(fclose(in.f) != 0)
+        errx(1, "fwrite(%s)", out);
+
+    printf("%u tuples, diff %llu (%llu changed) for %llu bytes, extra %llu for %llu bytes\n",
+           in.tuples, (unsigned long long)in.diff, (unsigned long long)in.changed,
+           (unsigned long long)in.costDiff, (unsigned long long)in.extra,
+           (unsigned long long)in.costExtra);
+
+    return 0;
+}
+
+/* -m: what applying this patch takes in a BSPATCH_STATIC build */
+static int report_ram(const char *f, size_t transfer, size_t rsize, const uint8_t *key, unsigned keySize)
+{
+    FILE *fpatch;
+    unsigned char header[BSHDR_SIZE_MAX];
+    unsigned char dec_h[HEADER_SIZE];
+    bshdr_t hdr;
+    size_t decoder, dicSize, scratch;
+    unsigned lclp;
+    int inplace;
+
+    if((fpatch = open_patch(f)) == NULL)
+        errx(1, "fopen(%s)", f);
+
+    read_header(fpatch, &hdr, header);
+    skip_manifest(fpatch, &hdr);
+
+    if(hdr.flags & BSHDR_SEEKABLE)
+        errx(1, "-m sizes the streaming decoder, a seekable patch decodes whole blocks\n");
+
+    if(read_file(fpatch, dec_h, sizeof(dec_h)))
+        errx(1, "Corrupt patch\n");
+
+    fclose(fpatch);
+
+    /* a segment is never shorter than the decoder header, so it is whole */
+    if(hdr.flags & BSHDR_AES)
+    {
+        bsaes_t aes;
+
+        bsaes_prepare();
+
+        if(keySize == 0 || bsaes_init(&aes, key, keySize, hdr.nonce))
+            errx(1, "Patch is encrypted, it needs -k<keyfile>\n");
+
+        bsaes_code(&aes, 0, dec_h, sizeof(dec_h));
+    }
+
+    inplace = (hdr.flags & BSHDR_INPLACE) != 0;
+
+    if(rsize > hdr.patchsize - HEADER_SIZE)
+        rsize = hdr.patchsize - HEADER_SIZE;
+
+    decoder = decodeFootprint(dec_h, rsize, &dicSize, &lclp);
+    if(decoder == 0)
+        errx(1, "Corrupt patch\n");
+
+    /* as bspatch() / bspatch_inplace() size their scratch buffer */
+    scratch = inplace ? 2 * (transfer < 32 ? 32 : transfer) : transfer + 1;
+
+    printf("BSPATCH_STATIC_DIC_SIZE >= %u\n", (unsigned)dicSize);
+    printf("BSPATCH_STATIC_LCLP     >= %u\n", lclp);
+    printf("IN_BUF_SIZE              = %u\n", (unsigned)rsize);
+    printf("BSPATCH_TRANSFER_SIZE    = %u\n", (unsigned)transfer);
+    printf("decoder %u + state %u + scratch %u = %u bytes\n", (unsigned)decoder,
+           (unsigned)sizeof(CLzmaDec), (unsigned)scratch,
+           (unsigned)(decoder + sizeof(CLzmaDec) + scratch));
+
+    return 0;
+}
+
+/* -M: heap this run should take, the old image is mapped and not counted */
+static void print_estimate(const unsigned char *dec_h, const bshdr_t *hdr, size_t transfer,
+                           size_t rsize, size_t wsize, int pipelined)
+{
+    size_t decoder, scratch, writer = 0, queues = 0, segment = 0;
+    int inplace = (hdr->flags & BSHDR_INPLACE) != 0;
+
+    /* a CRC segment is held until it checks out */
+    if(hdr->flags & BSHDR_CRC32)
+        segment = (size_t)hdr->segsize + 4;
+
+    if(rsize > hdr->patchsize - HEADER_SIZE)
+        rsize = hdr->patchsize - HEADER_SIZE;
+
+    decoder = decodeFootprint(dec_h, rsize, NULL, NULL);
+    scratch = inplace ? 2 * (transfer < 32 ? 32 : transfer) : transfer + 1;
+
+    if(!inplace)
+    {
+        writer = wsize ? (wsize + WRITE_BUF_ALIGN - 1) & ~(size_t)(WRITE_BUF_ALIGN - 1) : WRITE_BUF_SIZE;
+#if defined(BSPATCH_STATIC)
+        UNUSED_VAR(pipelined);
+#else
+        if(pipelined)
+            queues = bspatch_mt_mem_estimate(transfer);
+#endif
+    }
+
+    printf("estimate: decoder %zu, segment %zu, scratch %zu, writer %zu, queues %zu bytes\n",
+           decoder, segment, scratch, writer, queues);
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *fpatch, *fnew;
+    void *pold;
+    uint32_t oldsize, newsize, patchsize;
+	struct bspatch_stream stream;
+    decode_t dec;
+    writer_t writer;
+    bshdr_t hdr;
+    payload_t payload;
+    bsaes_t aes;
+    uint8_t key[32];
+    unsigned keySize = 0;
+    CSha256 sha;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    unsigned char header[BSHDR_SIZE_MAX];
+    unsigned char dec_h[HEADER_SIZE];
+    size_t transfer = BSPATCH_TRANSFER_SIZE, rsize = IN_BUF_SIZE, wsize = WRITE_BUF_SIZE, hdrlen;
+    int pipelined = 0, ram = 0, verify = 0, resume = 0, memreport = 0, inspect = 0, tree = 0, ret;
+    int erased = 0, piped;
+    uint32_t rangeFrom = 0, rangeTo = 0;
+    int range = 0;
+    bsbundle_t bundle;
+    uint32_t interval = 0, blobsize = 0;
+    uint8_t *blob = NULL;
+    bspatch_state from;
+    journal_t journal;
+#if defined(BSTRACE)
+    const char *trace = NULL;
+#endif
+
+    /* -t<n> transfer size, -r<n> patch read size, -w<n> write buffer size,
+       -j decode/apply/write on separate threads, -m RAM report for patchfile,
+       -c[n] checkpoint every n bytes of new to newfile.journal and resume
+       from it, -v check old against the patch's digest before writing,
+       -k<file> AES key of an encrypted patch, -M memory estimate and report,
+       --inspect patchfile [report.json] cost of each region as JSON,
+       -b oldfile and newfile are directories and the patch a bundle,
+       -R<from>:<to> only new bytes [from, to) of a seekable patch,
+       -e newfile is erased flash, 0xFF fills are not written;
+       patchfile "-" reads the patch from stdin as it arrives */
+    while(argc > 2 && argv[1][0] == '-')
+    {
+        size_t v = strtoul(argv[1] + 2, NULL, 0);
+
+        if(argv[1][1] == 'j')
+            pipelined = 1;
+        else if(argv[1][1] == 'm')
+            ram = 1;
+        else if(argv[1][1] == 'v')
+            verify = 1;
+        else if(argv[1][1] == 'c')
+            interval = v > 0 ? (uint32_t)v : CHECKPOINT_INTERVAL;
+        else if(argv[1][1] == 't')
+        {
+            char *end;
+
+            transfer = strtoul(argv[1] + 2, &end, 0);
+            if(transfer == 0 || *end)
+                errx(1, "-t takes the transfer size in bytes\n");
+            if(transfer < 8)
+                transfer = 8;
+        }
+        else if(argv[1][1] == 'r')
+        {
+            char *end;
+
+            rsize = strtoul(argv[1] + 2, &end, 0);
+            if(rsize == 0 || *end)
+                errx(1, "-r takes the patch read size in bytes\n");
+        }
+        else if(argv[1][1] == 'w')
+        {
+            char *end;
+
+            wsize = strtoul(argv[1] + 2, &end, 0);
+            if(wsize == 0 || *end)
+                errx(1, "-w takes the write buffer size in bytes\n");
+        }
+        else if(argv[1][1] == 'k')
+            read_key(argv[1] + 2, key, &keySize);
+        else if(argv[1][1] == 'M')
+            memreport = 1;
+        else if(argv[1][1] == 'e')
+            erased = 1;
+        else if(argv[1][1] == 'b')
+            tree = 1;
+        else if(strcmp(argv[1], "--inspect") == 0)
+            inspect = 1;
+        else if(argv[1][1] == 'R')
+        {
+            char *end;
+
+            rangeFrom = (uint32_t)strtoul(argv[1] + 2, &end, 0);
+            if(*end != ':')
+                errx(1, "-R takes <from>:<to>\n");
+
+            rangeTo = (uint32_t)strtoul(end + 1, NULL, 0);
+            range = 1;
+        }
+#if defined(BSTRACE)
+        /* -T<file>: Chrome trace of the run */
+        else if(argv[1][1] == 'T')
+            trace = argv[1] + 2;
+#endif
+        else
+            break;
+
+        argv++;
+        argc--;
+    }
+
+    if(ram && argc == 2)
+        return report_ram(argv[1], transfer, rsize, key, keySize);
+
+    if(inspect && (argc == 2 || argc == 3))
+        return inspect_patch(argv[1], argc == 3 ? argv[2] : "inspect.json", rsize, key, keySize);
+
+    if(argc != 4) errx(1, "usage: %s [-j] [-v] [-b] [-e] [-R<from>:<to>] [-c[n]] [-t<n>] [-r<n>] [-w<n>] [-k<keyfile>] [-M] oldfile newfile patchfile\n"
+                          "       %s -m [-t<n>] [-r<n>] [-k<keyfile>] patchfile\n"
+                          "       %s --inspect [-k<keyfile>] patchfile [report.json]\n"
+                          "       patchfile - reads the patch from stdin\n", argv[0], argv[0], argv[0]);
+
+    TRACE_THREAD("main");
+
+    /* Open patch file */
+    if((fpatch = open_patch(argv[3])) == NULL)
+        errx(1, "fopen(%s)", argv[3]);
+
+    /* a pipe only goes forward: no resuming midway, no jumping to a range */
+    piped = strcmp(argv[3], "-") == 0;
+    if(piped && range)
+        errx(1, "-R seeks in the patch, it cannot come from stdin\n");
+
+    hdrlen = read_header(fpatch, &hdr, header);
+    oldsize = hdr.oldsize;
+    newsize = hdr.newsize;
+    patchsize = hdr.patchsize;
+
+    Sha256Prepare();
+
+    if(verify && !(hdr.flags & BSHDR_SHA256))
+        errx(1, "Patch has no digests to verify\n");
+
+    /* a checkpoint cuts newfile back, flash it is written over stays as it is */
+    if(erased && (interval || (hdr.flags & (BSHDR_BUNDLE | BSHDR_INPLACE | BSHDR_SEEKABLE))))
+        errx(1, "-e writes plain patches without -c only\n");
+
+    if(hdr.flags & BSHDR_BUNDLE)
+    {
+        if(!tree)
+            errx(1, "Patch is a directory bundle, it needs -b\n");
+        if(interval)
+            errx(1, "A bundle has no checkpoints, its files are patched whole\n");
+
+        read_manifest(fpatch, &hdr, &bundle);
+    }
+    else if(tree)
+        errx(1, "Patch is not a directory bundle\n");
+
+    if(hdr.flags & BSHDR_SEEKABLE)
+    {
+        if(interval)
+            errx(1, "A seekable patch has no checkpoints, its blocks stand alone\n");
+
+        open_payload(fpatch, &hdr, &payload, &aes, key, keySize, NULL);
+        ret = patch_seekable(argv, fpatch, hdrlen, &payload, &hdr, verify, range ? rangeFrom : 0,
+                             range ? rangeTo : newsize, transfer, wsize);
+        if(memreport)
+            bsmem_report(stdout);
+
+        return ret;
+    }
+    else if(range)
+        errx(1, "-R needs a seekable patch (bsdiff -x)\n");
+
+    open_payload(fpatch, &hdr, &payload, &aes, key, keySize, dec_h);
+
+    /* what is left for the decoder */
+    patchsize = payload.seg.datasize - HEADER_SIZE;
+
+    if(memreport)
+        print_estimate(dec_h, &hdr, transfer, rsize, wsize, pipelined && !interval);
+
+    if(tree)
+    {
+        ret = patch_tree(argv, fpatch, &payload, dec_h, &hdr, &bundle, transfer, rsize, pipelined);
+        bsbundle_free(&bundle);
+        if(memreport)
+            bsmem_report(stdout);
+
+        return ret;
+    }
+
+    if(hdr.flags & BSHDR_INPLACE)
+    {
+        ret = patch_inplace(argv, fpatch, &payload, dec_h, &hdr, verify, transfer, rsize);
+        if(memreport)
+            bsmem_report(stdout);
+
+        return ret;
+    }
+
+    /* hashed as it is written, continued from the journal on resume */
+    Sha256_Init(&sha);
+
+    if(interval)
+    {
+        snprintf(journal.path, sizeof(journal.path), "%s.journal", argv[2]);
+        memcpy(journal.header, header, hdrlen);
+        journal.hdrlen = (uint32_t)hdrlen;
+        journal.sha = &sha;
+        resume = journal_read(&journal, &from, &blob, &blobsize) == 0;
+
+        if(resume && piped)
+            errx(1, "Resuming seeks in the patch, give it as a file, not stdin\n");
+    }
+
+    /* create new file, or keep what the last checkpoint covers */
+    fnew = fopen(argv[2], resume || erased ? "rb+" : "wb+");
+    if(fnew == NULL)errx(1, "Open failed :%s", argv[2]);
+
+    /* erased flash (a device or an image of one) is not cut to size */
+    if(erased && (fseek(fnew, 0, SEEK_END) != 0 || ftell(fnew) < (long)newsize ||
+                  fseek(fnew, 0, SEEK_SET) != 0))
+        errx(1, "-e needs an erased newfile of at least %u bytes :%s", newsize, argv[2]);
+
+    if(resume)
+    {
+        if(fseek(fnew, 0, SEEK_END) != 0 || ftell(fnew) < from.newpos ||
+                set_file_size(fnew, from.newpos) || fseek(fnew, 0, SEEK_END) != 0)
+            errx(1, "Cannot resume :%s", argv[2]);
+
+        printf("resume at %d\n", from.newpos);
+    }
+
+    /* Map old file */
+    pold = map_old(argv[1], oldsize);
+    if(pold == NULL)errx(1, "Map failed :%s", argv[1]);
+
+    if(verify && sha_check(pold, oldsize, hdr.oldsha))
+        errx(1, "Old file does not match the patch :%s\n", argv[1]);
+
+    if(writer_init(&writer, fnew, wsize))
+        errx(1, "Malloc failed\n");
+
+    if(hdr.flags & BSHDR_SHA256)
+        writer.sha = &sha;
+
+    if(erased)
+        writer.skip = 0xFF;
+
+    /* the decoder has to hold a full transfer */
+    if(decodeInit(&dec, dec_h, sizeof(dec_h), patchsize, rsize, transfer) != SZ_OK)
+        errx(1, "Corrupt patch\n");
+
+    /* the decoder continues where it was, the patch is re-read from there */
+    if(resume)
+    {
+        if(decodeRestore(&dec, blob, blobsize) != SZ_OK ||
+                seek_payload(&payload.seg, fpatch, hdrlen, HEADER_SIZE + (patchsize - dec.patchsize)))
+            errx(1, "Corrupt journal\n");
+
+        bsmem_free(blob);
+    }
+
+    memset(&stream, 0, sizeof(stream));
+	stream.read = lzma_read;
+    stream.borrow = decodeBorrow;
+    stream.rpatch = read_patch;
+	stream.opaque_r = &payload;
+    stream.opaque_dec = &dec;
+    
+    stream.write = data_write;
+    stream.reserve = data_reserve;
+    stream.fill = data_fill;
+    stream.opaque_w = &writer;
+    stream.transfer_size = (int)transfer;
+    
+    stream.rold = bspatch_rold_mem;
+    stream.advise = advise_old;
+	stream.opaque_old = pold;
+
+    if(interval)
+    {
+        stream.checkpoint = journal_write;
+        stream.checkpoint_interval = interval;
+        stream.opaque_cp = &journal;
+    }
+
+    /* checkpoints need the sequential path */
+#if defined(BSPATCH_STATIC)
+    UNUSED_VAR(pipelined);
+    if (bspatch_resume(&stream, oldsize, newsize, resume ? &from : NULL))
+#else
+    if (pipelined && !interval ? bspatch_mt(&stream, oldsize, newsize) :
+            bspatch_resume(&stream, oldsize, newsize, resume ? &from : NULL))
+#endif
+		errx(1, "bspatch");
+
+    if(writer_flush(&writer) || (writer.hole && set_file_size(fnew, newsize)))
+        errx(1, "fwrite(%s)", argv[2]);
+
+    if(writer.sha)
+    {
+        Sha256_Final(&sha, digest);
+        if(memcmp(digest, hdr.newsha, sizeof(digest)) != 0)
+            errx(1, "New file does not match the patch :%s\n", argv[2]);
+    }
+
+    decodeUninit(&dec);
+    writer_free(&writer);
+
+    unmap_old(pold, oldsize);
+    
     if(fclose(fnew) == -1)
         errx(1, "fclose(%s)", argv[2]);
 
+    bsseg_free(&payload.seg);
     if(fclose(fpatch) == -1)
         errx(1, "fclose(%s)", argv[3]);
 
+    if(interval)
+        remove(journal.path);
+
+    if(memreport)
+        bsmem_report(stdout);
+
+#if defined(BSTRACE)
+    if(trace && bstrace_dump(trace))
+        errx(1, "Trace write failed :%s", trace);
+#endif
+
     return 0;
 }
 
@@ -31,23 +31,140 @@
 #include <stdint.h>
 
 
+/* where bspatch() stands, enough to carry on after a restart */
+typedef struct
+{
+    int32_t newpos;
+    int32_t oldpos;
+    int32_t ctrl[3];    /* what is left of the current control tuple */
+    int32_t pending;    /* ctrl holds a tuple in progress */
+} bspatch_state;
+
 struct bspatch_stream
 {
 	void* opaque_r;
 	int (*read)(struct bspatch_stream* stream, void* buffer, int length);
     int (*rpatch)(struct bspatch_stream* stream, void* buffer, int length);
 
+    /* optional: lends up to |length| bytes of the patch stream in place,
+       valid until the next read/borrow; returns the count, 0 at the end */
+    int (*borrow)(struct bspatch_stream* stream, const void** buffer, int length);
+
     void* opaque_w;
-	int (*write)(struct bspatch_stream* stream, void* buffer, int length);
+	int (*write)(struct bspatch_stream* stream, const void* buffer, int length);
+
+    /* optional: |length| copies of |byte| for a fill tuple (BSHDR_FILL);
+       a writer can leave a hole or skip erased flash. Without it the bytes
+       go through write(). */
+    int (*fill)(struct bspatch_stream* stream, int byte, int length);
 
+    /* optional: lends up to |length| bytes of the writer's own buffer so
+       bspatch can add into it; the following write() of that pointer then
+       only commits the bytes */
+    int (*reserve)(struct bspatch_stream* stream, void** buffer, int length);
+
+    /* rold hands out a pointer to |length| bytes of old at |offset|, valid
+       until the next call; advise (optional) announces the range the next
+       control tuple will read */
     void* opaque_old;
-	int (*rold)(struct bspatch_stream* stream, uint32_t offset, void* buffer, int length);
+	int (*rold)(struct bspatch_stream* stream, uint32_t offset, const void** buffer, int length);
+    void (*advise)(struct bspatch_stream* stream, uint32_t offset, int length);
+
+    /* in-place only: stores |length| bytes at |offset| of the old image,
+       the same image rold reads from */
+    int (*wold)(struct bspatch_stream* stream, uint32_t offset, const void* buffer, int length);
+
+    /* per-stream decoder state (decode_t), so patches can run side by side */
+    void* opaque_dec;
+
+    /* bytes moved per read/add/write round, 0 for BSPATCH_TRANSFER_SIZE */
+    int transfer_size;
+
+    /* optional: called by bspatch() every checkpoint_interval bytes of new,
+       right after a write; whatever was written so far plus |state| and the
+       decoder resume the job through bspatch_resume(). Non-zero aborts. */
+    void* opaque_cp;
+    int (*checkpoint)(struct bspatch_stream* stream, const bspatch_state* state);
+    uint32_t checkpoint_interval;
+
+    /* optional: compressed payload bytes consumed so far, lets
+       bspatch_inspect() charge each region what it cost */
+    uint64_t (*tell)(struct bspatch_stream* stream);
 };
 
+/* one control tuple or in-place op, as bspatch_inspect() reports it */
+typedef struct
+{
+    int32_t newpos;
+    int32_t oldpos;
+    int32_t diff;       /* new bytes added onto old */
+    int32_t extra;      /* new bytes taken from the patch as they are */
+    int32_t seek;       /* old position adjustment after the tuple */
+    int32_t changed;    /* diff bytes that are not zero, old and new differ */
+    int32_t type;       /* in-place op type, -1 for a regular tuple */
+    int32_t fill;       /* extra is one byte repeated (BSHDR_FILL) */
+    uint64_t costDiff;  /* payload bytes of control and diff, 0 without tell */
+    uint64_t costExtra; /* payload bytes of extra */
+} bspatch_region;
+
+#ifndef BSPATCH_TRANSFER_SIZE
+#define BSPATCH_TRANSFER_SIZE    1024
+#endif
+
+/* BSPATCH_STATIC: bspatch() and bspatch_inplace() work in a static buffer
+   of this size, transfer sizes above BSPATCH_TRANSFER_SIZE are clamped;
+   bspatch_mt() is not available */
+#define BSPATCH_SCRATCH_SIZE     (2 * (BSPATCH_TRANSFER_SIZE < 32 ? 32 : BSPATCH_TRANSFER_SIZE))
+
 #define errx err
 void err(int exitcode, const char *fmt, ...);
 
 int bspatch(struct bspatch_stream *stream, int32_t oldsize, int32_t newsize);
 
+/* bspatch() continuing from a checkpoint; the decoder and the output must
+   be where they were when |from| was taken */
+int bspatch_resume(struct bspatch_stream *stream, int32_t oldsize, int32_t newsize,
+                   const bspatch_state *from);
+
+/* Seekable patches (bsdiff -x, bsseek.h): applies one block, whose decoded
+   tuples stream->read/borrow return. |at| is where the block starts (new
+   position and the old position from the index, nothing pending) and |end|
+   where it stops; only new bytes [from, to) reach stream->write. */
+int bspatch_range(struct bspatch_stream *stream, int32_t oldsize, const bspatch_state *at,
+                  int32_t end, int32_t from, int32_t to);
+
+#if !defined(BSPATCH_STATIC)
+/* Same result as bspatch(), with decode, apply and write running on three
+   threads joined by lock-free queues. Needs stream->borrow; write() is
+   called from the writer thread. */
+int bspatch_mt(struct bspatch_stream *stream, int32_t oldsize, int32_t newsize);
+
+/* Bytes of queue bspatch_mt() allocates for this transfer size */
+size_t bspatch_mt_mem_estimate(size_t transfer);
+#endif
+
+/* Applies an in-place patch (bsdiff_inplace): the new image is built over
+   the old one through rold/wold, which must address at least
+   max(oldsize, newsize) bytes. Scratch memory is one transfer buffer. */
+int bspatch_inplace(struct bspatch_stream *stream, int32_t oldsize, int32_t newsize);
+
+/* Walks the patch stream without old or new: every tuple (op for an
+   in-place patch) goes to |visit|, non-zero from it stops the walk. Only
+   read/borrow and the optional tell are used. */
+int bspatch_inspect(struct bspatch_stream *stream, int32_t newsize, int inplace,
+                    int (*visit)(struct bspatch_stream *stream, const bspatch_region *region));
+
+/* in-place op types, as written by bsdiff_inplace */
+#define BSPATCH_OP_FORWARD  0
+#define BSPATCH_OP_BACKWARD 1
+#define BSPATCH_OP_LITERAL  2
+
+/* rold for an old image that is already addressable (mapped file, flash),
+   opaque_old is the base address */
+int bspatch_rold_mem(struct bspatch_stream* stream, uint32_t offset, const void** buffer, int length);
+
+/* wold counterpart of bspatch_rold_mem */
+int bspatch_wold_mem(struct bspatch_stream* stream, uint32_t offset, const void* buffer, int length);
+
 #endif
 
@@ -0,0 +1,345 @@
+/* bspatch_mt.c -- pipelined bspatch
+ *
+ * Three stages joined by single-producer/single-consumer queues:
+ *   decode: pulls the decompressed patch stream through stream->borrow
+ *   apply:  parses control tuples, advises and reads old, adds the diff
+ *           (runs on the calling thread)
+ *   write:  hands finished output to stream->write
+ * so LZMA decoding, the add loop and output I/O overlap.
+ */
+
+/* threads and heap queues, left out of the BSPATCH_STATIC profile */
+#if !defined(BSPATCH_STATIC)
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../lzma/Threads.h"
+#include "../lzma/LzmaUtil/bshdr.h"
+#include "../lzma/LzmaUtil/spsc.h"
+#include "../lzma/LzmaUtil/bstrace.h"
+#include "bspatch.h"
+#include "bsadd.h"
+
+#define BSPATCH_MT_QUEUE_SIZE (1 << 20)
+
+typedef struct
+{
+    struct bspatch_stream *stream;
+    spsc_t *in;     /* decoded patch stream */
+    spsc_t *out;    /* new file bytes */
+    size_t chunk;
+    int wresult;
+} pipeline_t;
+
+static THREAD_FUNC_DECL decode_thread(void *param)
+{
+    pipeline_t *pl = param;
+    const void *src;
+    uint8_t *dst;
+    size_t span;
+    int n;
+
+    TRACE_THREAD("decode");
+
+    for(;;)
+    {
+        TRACE_BEGIN("wait");
+        span = spsc_write_span(pl->in, &dst);
+        TRACE_END("wait");
+        if(span == 0)
+            break;
+
+        if(span > pl->chunk)
+            span = pl->chunk;
+
+        TRACE_BEGIN("decode");
+        n = pl->stream->borrow(pl->stream, &src, (int)span);
+        TRACE_END("decode");
+        if(n < 0)
+        {
+            spsc_abort(pl->in);
+            break;
+        }
+
+        if(n == 0)
+        {
+            spsc_close(pl->in);
+            break;
+        }
+
+        memcpy(dst, src, n);
+        spsc_commit(pl->in, n);
+    }
+
+    return THREAD_FUNC_RET_ZERO;
+}
+
+static THREAD_FUNC_DECL write_thread(void *param)
+{
+    pipeline_t *pl = param;
+    const uint8_t *src;
+    size_t span;
+
+    TRACE_THREAD("write");
+
+    for(;;)
+    {
+        TRACE_BEGIN("wait");
+        span = spsc_read_span(pl->out, &src);
+        TRACE_END("wait");
+        if(span == 0)
+            break;
+
+        TRACE_BEGIN("write");
+        if(pl->stream->write(pl->stream, src, (int)span))
+        {
+            TRACE_END("write");
+            pl->wresult = -1;
+            spsc_abort(pl->out);
+            break;
+        }
+        TRACE_END("write");
+
+        spsc_release(pl->out, span);
+    }
+
+    return THREAD_FUNC_RET_ZERO;
+}
+
+static int read_exact(spsc_t *q, uint8_t *buf, size_t length)
+{
+    const uint8_t *p;
+    size_t n;
+
+    while(length > 0)
+    {
+        n = spsc_read_span(q, &p);
+        if(n == 0)
+            return -1;
+
+        if(n > length)
+            n = length;
+
+        memcpy(buf, p, n);
+        spsc_release(q, n);
+        buf += n;
+        length -= n;
+    }
+
+    return 0;
+}
+
+static int apply(pipeline_t *pl, int32_t oldsize, int32_t newsize)
+{
+    struct bspatch_stream *stream = pl->stream;
+    const uint8_t *pold, *pdata;
+    uint8_t *pout;
+    uint8_t buf[8];
+    int32_t oldpos = 0, newpos = 0, len, lo, hi;
+    int32_t ctrl[3];
+    size_t n;
+    int i;
+
+    while(newpos < newsize)
+    {
+        TRACE_BEGIN("tuple");
+
+        for(i = 0; i <= 2; i++)
+        {
+            if(read_exact(pl->in, buf, 8) || (ctrl[i] = bshdr_get64(buf)) == BSHDR_BAD)
+                goto out;
+        }
+
+        if(ctrl[0] < 0 || ctrl[0] > INT_MAX ||
+                ctrl[1] < -INT_MAX || ctrl[1] > INT_MAX ||
+                newpos + ctrl[0] > newsize)
+            goto out;
+
+        if(stream->advise)
+        {
+            lo = oldpos < 0 ? 0 : oldpos;
+            hi = (oldpos + ctrl[0] > oldsize) ? oldsize : oldpos + ctrl[0];
+
+            if(hi > lo)
+                stream->advise(stream, lo, hi - lo);
+        }
+
+        while(ctrl[0] > 0)
+        {
+            len = ctrl[0] > (int32_t)pl->chunk ? (int32_t)pl->chunk : ctrl[0];
+
+            if((n = spsc_write_span(pl->out, &pout)) == 0)
+                goto out;
+            if(n < (size_t)len)
+                len = (int32_t)n;
+
+            if((n = spsc_read_span(pl->in, &pdata)) == 0)
+                goto out;
+            if(n < (size_t)len)
+                len = (int32_t)n;
+
+            lo = (oldpos < 0) ? -oldpos : 0;
+            hi = oldsize - oldpos;
+            if(lo > len) lo = len;
+            if(hi > len) hi = len;
+
+            if(hi > lo)
+            {
+                if(stream->rold(stream, oldpos + lo, (const void **)&pold, hi - lo))
+                    goto out;
+
+                memcpy(pout, pdata, lo);
+                bsadd(pout + lo, pdata + lo, pold, hi - lo);
+                memcpy(pout + hi, pdata + hi, len - hi);
+            }
+            else
+                memcpy(pout, pdata, len);
+
+            spsc_release(pl->in, len);
+            spsc_commit(pl->out, len);
+
+            ctrl[0] -= len;
+            oldpos += len;
+            newpos += len;
+        }
+
+        if(newpos + (ctrl[1] < 0 ? -ctrl[1] : ctrl[1]) > newsize)
+            goto out;
+
+        /* a fill goes into the output queue as it is; the writer thread
+           only sees bytes */
+        if(ctrl[1] < 0)
+        {
+            if(read_exact(pl->in, buf, 1))
+                goto out;
+
+            for(ctrl[1] = -ctrl[1]; ctrl[1] > 0; ctrl[1] -= len)
+            {
+                len = ctrl[1] > (int32_t)pl->chunk ? (int32_t)pl->chunk : ctrl[1];
+
+                if((n = spsc_write_span(pl->out, &pout)) == 0)
+                    goto out;
+                if(n < (size_t)len)
+                    len = (int32_t)n;
+
+                memset(pout, buf[0], len);
+                spsc_commit(pl->out, len);
+                newpos += len;
+            }
+        }
+
+        while(ctrl[1] > 0)
+        {
+            len = ctrl[1] > (int32_t)pl->chunk ? (int32_t)pl->chunk : ctrl[1];
+
+            if((n = spsc_write_span(pl->out, &pout)) == 0)
+                goto out;
+            if(n < (size_t)len)
+                len = (int32_t)n;
+
+            if((n = spsc_read_span(pl->in, &pdata)) == 0)
+                goto out;
+            if(n < (size_t)len)
+                len = (int32_t)n;
+
+            memcpy(pout, pdata, len);
+
+            spsc_release(pl->in, len);
+            spsc_commit(pl->out, len);
+
+            ctrl[1] -= len;
+            newpos += len;
+        }
+
+        oldpos += ctrl[2];
+
+        TRACE_END("tuple");
+    }
+
+    return 0;
+
+out:
+    TRACE_END("tuple");
+
+    return -1;
+}
+
+/* room for a few transfers in flight per queue */
+static size_t queue_size(size_t chunk)
+{
+    size_t qsize = BSPATCH_MT_QUEUE_SIZE;
+
+    while(qsize < chunk * 4)
+        qsize <<= 1;
+
+    return qsize;
+}
+
+size_t bspatch_mt_mem_estimate(size_t transfer)
+{
+    return 2 * queue_size(transfer ? transfer : BSPATCH_TRANSFER_SIZE);
+}
+
+int bspatch_mt(struct bspatch_stream *stream, int32_t oldsize, int32_t newsize)
+{
+    pipeline_t pl;
+    CThread dthread, wthread;
+    size_t qsize;
+    int ret = -1;
+
+    if(stream->borrow == NULL)
+        return -1;
+
+    bsadd_init();
+
+    pl.stream = stream;
+    pl.chunk = stream->transfer_size > 0 ? (size_t)stream->transfer_size : BSPATCH_TRANSFER_SIZE;
+    pl.wresult = 0;
+
+    qsize = queue_size(pl.chunk);
+
+    pl.in = spsc_init(qsize);
+    pl.out = spsc_init(qsize);
+
+    Thread_CONSTRUCT(&dthread)
+    Thread_CONSTRUCT(&wthread)
+
+    if(pl.in == NULL || pl.out == NULL)
+        goto out;
+
+    if(Thread_Create(&dthread, decode_thread, &pl) != 0)
+        goto out;
+
+    if(Thread_Create(&wthread, write_thread, &pl) != 0)
+    {
+        spsc_abort(pl.in);
+        Thread_Wait_Close(&dthread);
+        goto out;
+    }
+
+    ret = apply(&pl, oldsize, newsize);
+
+    /* the decoder may still be blocked on a full queue of trailing data */
+    spsc_abort(pl.in);
+
+    if(ret)
+        spsc_abort(pl.out);
+    else
+        spsc_close(pl.out);
+
+    Thread_Wait_Close(&dthread);
+    Thread_Wait_Close(&wthread);
+
+    if(pl.wresult)
+        ret = -1;
+
+out:
+    spsc_free(pl.in);
+    spsc_free(pl.out);
+
+    return ret;
+}
+
+#endif /* !BSPATCH_STATIC */
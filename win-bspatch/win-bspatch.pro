@@ -8,27 +8,49 @@ CONFIG -= qt
 # QMAKE_LINK += -g
 
 DEFINES += BSPATCH_EXECUTABLE
+# heap-free profile, buffers sized by BSPATCH_STATIC_DIC_SIZE, BSPATCH_STATIC_LCLP,
+# IN_BUF_SIZE and BSPATCH_TRANSFER_SIZE (see bspatch -m)
+# DEFINES += BSPATCH_STATIC
+# Chrome trace JSON of a run, -T<file> (bstrace.h)
+# DEFINES += BSTRACE
 
 SOURCES += \
 #    ../lzma/7zFile.c \
 #    ../lzma/7zStream.c \
+    ../lzma/7zCrc.c \
+    ../lzma/7zCrcOpt.c \
 #    ../lzma/Alloc.c \
-#    ../lzma/CpuArch.c \
+    ../lzma/Aes.c \
+    ../lzma/AesOpt.c \
+    ../lzma/CpuArch.c \
 #    ../lzma/LzFind.c \
 #    ../lzma/LzFindMt.c \
 #    ../lzma/LzFindOpt.c \
     ../lzma/LzmaDec.c \
 #    ../lzma/LzmaEnc.c \
 #    ../lzma/LzmaLib.c \
-    ../lzma/LzmaUtil/ringbuffer.c \
-#    ../lzma/Threads.c \
+    ../lzma/Sha256.c \
+    ../lzma/Sha256Opt.c \
+    ../lzma/Threads.c \
     ../lzma/LzmaUtil/LzmaUtil.c \
+    ../lzma/LzmaUtil/bsaes.c \
+    ../lzma/LzmaUtil/bsbundle.c \
+    ../lzma/LzmaUtil/bshdr.c \
+    ../lzma/LzmaUtil/bsmem.c \
+    ../lzma/LzmaUtil/bsseek.c \
+    ../lzma/LzmaUtil/bsseg.c \
+    ../lzma/LzmaUtil/bstrace.c \
+    ../lzma/LzmaUtil/spsc.c \
+    bsadd.c \
     bspatch.c \
+    bspatch_mt.c \
 
 HEADERS += \
+    ../lzma/7zCrc.h \
 #    ../lzma/7zFile.h \
 #    ../lzma/7zVersion.h \
-#    ../lzma/CpuArch.h \
+    ../lzma/Aes.h \
+    ../lzma/CpuArch.h \
 #    ../lzma/LzFind.h \
 #    ../lzma/LzFindMt.h \
     ../lzma/7zTypes.h \
@@ -36,6 +58,15 @@ HEADERS += \
 #    ../lzma/LzmaEnc.h \
 #    ../lzma/LzmaLib.h \
     ../lzma/LzmaUtil/LzmaUtil.h \
-    ../lzma/LzmaUtil/ringbuffer.h \
-#    ../lzma/Threads.h \
+    ../lzma/LzmaUtil/bsaes.h \
+    ../lzma/LzmaUtil/bsbundle.h \
+    ../lzma/LzmaUtil/bshdr.h \
+    ../lzma/LzmaUtil/bsmem.h \
+    ../lzma/LzmaUtil/bsseek.h \
+    ../lzma/LzmaUtil/bsseg.h \
+    ../lzma/LzmaUtil/bstrace.h \
+    ../lzma/LzmaUtil/spsc.h \
+    ../lzma/Sha256.h \
+    ../lzma/Threads.h \
+    bsadd.h \
     bspatch.h \